@@ -4,7 +4,16 @@
 // FS root inode number
 #define ROOT_DIR_INUM (0)
 
+// Maximum length of a path name component, and of a whole path name
 #define MAX_FILE_NAME (40)
+#define MAX_PATH_NAME (256)
+
+// Number of direct block pointers in each inode
+#define INODE_DIRECT_BLOCKS (10)
+
+// Number of data blocks a directory's entries (its hash table) take at first,
+// once it has any: the table then doubles whenever it gets too full
+#define DIR_MIN_BLOCKS (1)
 
 #define DELAY (5000)
 
@@ -0,0 +1,156 @@
+#include "dcache.h"
+#include "betterassert.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Cached directory entry (de_parent is -1 when the slot is empty).
+ */
+typedef struct {
+    int de_parent;
+    int de_inumber;
+    bool de_directory;
+    char de_name[MAX_FILE_NAME];
+} dcache_entry_t;
+
+// Slots are guarded by DCACHE_LOCKS mutexes, slot i by lock i % DCACHE_LOCKS
+#define DCACHE_LOCKS (64)
+
+static dcache_entry_t *dcache_slots;
+static size_t dcache_capacity; // a power of two
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+
+/**
+ * Hash a (parent inumber, name) pair (FNV-1a).
+ */
+static size_t dcache_hash(int parent, char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(int); i++) {
+        hash ^= (uint8_t)((unsigned)parent >> (8 * i));
+        hash *= 16777619u;
+    }
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash & (dcache_capacity - 1);
+}
+
+static bool dcache_matches(dcache_entry_t const *entry, int parent,
+                           char const *name) {
+    return entry->de_parent == parent &&
+           strncmp(entry->de_name, name, MAX_FILE_NAME) == 0;
+}
+
+/**
+ * Initialize the cache, with twice as many slots as there can be entries
+ * (each file and directory but the root has one), so few of them collide.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int dcache_init(size_t max_inode_count) {
+    dcache_capacity = DCACHE_LOCKS;
+    while (dcache_capacity < 2 * max_inode_count) {
+        dcache_capacity *= 2;
+    }
+
+    dcache_slots = malloc(dcache_capacity * sizeof(dcache_entry_t));
+    if (dcache_slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < dcache_capacity; i++) {
+        dcache_slots[i].de_parent = -1;
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        if (pthread_mutex_init(&dcache_locks[i], NULL) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void dcache_destroy(void) {
+    if (dcache_slots == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&dcache_locks[i]);
+    }
+    free(dcache_slots);
+    dcache_slots = NULL;
+}
+
+/**
+ * Look up a cached directory entry.
+ *
+ * Input:
+ *   - parent: inumber of the directory
+ *   - name: name of the entry
+ *   - directory: set to whether the entry is a directory (if cached)
+ *
+ * Returns the inumber of the entry, -1 if it is not cached.
+ */
+int dcache_get(int parent, char const *name, bool *directory) {
+    size_t slot = dcache_hash(parent, name);
+    pthread_mutex_t *lock = &dcache_locks[slot % DCACHE_LOCKS];
+    ALWAYS_ASSERT(pthread_mutex_lock(lock) == 0, "failed to lock mutex");
+
+    int inumber = -1;
+    dcache_entry_t const *entry = &dcache_slots[slot];
+    if (dcache_matches(entry, parent, name)) {
+        inumber = entry->de_inumber;
+        *directory = entry->de_directory;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(lock) == 0, "failed to unlock mutex");
+    return inumber;
+}
+
+/**
+ * Cache a directory entry (with the directory locked by the caller).
+ *
+ * Input:
+ *   - parent: inumber of the directory
+ *   - name: name of the entry
+ *   - inumber: inumber of the entry
+ *   - directory: whether the entry is a directory
+ */
+void dcache_put(int parent, char const *name, int inumber, bool directory) {
+    size_t slot = dcache_hash(parent, name);
+    pthread_mutex_t *lock = &dcache_locks[slot % DCACHE_LOCKS];
+    ALWAYS_ASSERT(pthread_mutex_lock(lock) == 0, "failed to lock mutex");
+
+    dcache_entry_t *entry = &dcache_slots[slot];
+    entry->de_parent = parent;
+    entry->de_inumber = inumber;
+    entry->de_directory = directory;
+    strncpy(entry->de_name, name, MAX_FILE_NAME - 1);
+    entry->de_name[MAX_FILE_NAME - 1] = '\0';
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(lock) == 0, "failed to unlock mutex");
+}
+
+/**
+ * Drop a directory entry from the cache, if cached (with the directory
+ * locked for writing by the caller).
+ *
+ * Input:
+ *   - parent: inumber of the directory
+ *   - name: name of the entry
+ */
+void dcache_invalidate(int parent, char const *name) {
+    size_t slot = dcache_hash(parent, name);
+    pthread_mutex_t *lock = &dcache_locks[slot % DCACHE_LOCKS];
+    ALWAYS_ASSERT(pthread_mutex_lock(lock) == 0, "failed to lock mutex");
+
+    dcache_entry_t *entry = &dcache_slots[slot];
+    if (dcache_matches(entry, parent, name)) {
+        entry->de_parent = -1;
+    }
+
+    ALWAYS_ASSERT(pthread_mutex_unlock(lock) == 0, "failed to unlock mutex");
+}
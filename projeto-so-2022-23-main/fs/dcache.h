@@ -0,0 +1,28 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Cache of directory entries, mapping a (parent directory inumber, name) pair
+ * to the inumber of the entry, so path names are resolved without searching
+ * the directories along them.
+ *
+ * The cache is direct-mapped: each pair has a single slot, taken over by the
+ * last entry cached there. Only entries that exist are cached, and only while
+ * the caller holds the parent directory's lock, so an entry stays valid until
+ * it is invalidated, which tfs_unlink does (holding the parent's lock for
+ * writing) before removing it from the directory.
+ */
+
+int dcache_init(size_t max_inode_count);
+void dcache_destroy(void);
+
+int dcache_get(int parent, char const *name, bool *directory);
+void dcache_put(int parent, char const *name, int inumber, bool directory);
+void dcache_invalidate(int parent, char const *name);
+
+#endif // DCACHE_H
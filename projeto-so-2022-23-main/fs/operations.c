@@ -1,6 +1,8 @@
 #include "operations.h"
 #include "config.h"
+#include "dcache.h"
 #include "state.h"
+#include "wal.h"
 #include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -10,18 +12,149 @@
 
 #include "betterassert.h"
 
-pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 tfs_params tfs_default_params() {
     tfs_params params = {
         .max_inode_count = 64,
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .delay = {DELAY, DELAY, DELAY},
+        .store_path = NULL,
+        .sync_policy = TFS_SYNC_NONE,
+        .wal_path = NULL,
+        .wal_commit_interval_us = 1000,
+        .wal_commit_bytes = 64 * 1024,
     };
     return params;
 }
 
+/**
+ * Write to a file, starting at a given offset.
+ *
+ * Input:
+ *   - inode: the file's inode (write locked by the caller)
+ *   - offset: where to start writing
+ *   - buffer: buffer containing the contents to write
+ *   - to_write: length of the buffer contents (in bytes)
+ *
+ * Returns the number of bytes that were written (can be lower than 'to_write'
+ * if the maximum file size is exceeded or there is no space), or -1 if nothing
+ * could be written.
+ */
+static ssize_t inode_write(inode_t *inode, size_t offset, void const *buffer,
+                           size_t to_write) {
+    // Determine how many bytes to write
+    size_t max_file_size = state_max_file_size();
+    if (offset >= max_file_size) {
+        to_write = 0;
+    } else if (to_write > max_file_size - offset) {
+        to_write = max_file_size - offset;
+    }
+
+    size_t block_size = state_block_size();
+    size_t written = 0;
+    while (written < to_write) {
+        size_t position = offset + written;
+
+        // Find (allocating if needed) the block holding the current offset
+        int bnum = inode_block_get(inode, position / block_size, true);
+        if (bnum == -1) {
+            break; // no space
+        }
+
+        void *block = data_block_get(bnum);
+        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+
+        // Perform the actual write, up to the end of the block
+        size_t block_offset = position % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > to_write - written) {
+            chunk = to_write - written;
+        }
+        memcpy(block + block_offset, buffer + written, chunk);
+        written += chunk;
+    }
+
+    if (written == 0 && to_write > 0) {
+        return -1; // no space
+    }
+
+    if (offset + written > inode->i_size) {
+        inode->i_size = offset + written;
+    }
+    return (ssize_t)written;
+}
+
+/**
+ * Read from a file, starting at a given offset.
+ *
+ * Input:
+ *   - inode: the file's inode (read locked by the caller)
+ *   - offset: where to start reading
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached).
+ */
+static size_t inode_read(inode_t *inode, size_t offset, void *buffer,
+                         size_t len) {
+    // Determine how many bytes to read
+    size_t to_read = 0;
+    if (inode->i_size > offset) {
+        to_read = inode->i_size - offset;
+    }
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    size_t block_size = state_block_size();
+    size_t bytes_read = 0;
+    while (bytes_read < to_read) {
+        size_t position = offset + bytes_read;
+        size_t block_offset = position % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > to_read - bytes_read) {
+            chunk = to_read - bytes_read;
+        }
+
+        // Perform the actual read (blocks never written read as zeros)
+        int bnum = inode_block_get(inode, position / block_size, false);
+        if (bnum == -1) {
+            memset(buffer + bytes_read, 0, chunk);
+        } else {
+            void *block = data_block_get(bnum);
+            ALWAYS_ASSERT(block != NULL,
+                          "tfs_read: data block deleted mid-read");
+            memcpy(buffer + bytes_read, block + block_offset, chunk);
+        }
+        bytes_read += chunk;
+    }
+
+    return to_read;
+}
+
+/**
+ * Replay a change recovered from the write-ahead log, unless the file it was
+ * made to has since been deleted.
+ */
+static void wal_apply(wal_record_type type, int inumber, uint64_t generation,
+                      size_t offset, void const *data, size_t length) {
+    if (!inode_is_taken(inumber)) {
+        return;
+    }
+    inode_t *inode = inode_get(inumber);
+    if (inode->i_node_type != T_FILE || inode->i_generation != generation) {
+        return;
+    }
+
+    if (type == WAL_TRUNCATE) {
+        inode_truncate(inode);
+    } else {
+        inode_write(inode, offset, data, length);
+    }
+}
+
 int tfs_init(tfs_params const *params_ptr) {
     tfs_params params;
     if (params_ptr != NULL) {
@@ -30,13 +163,30 @@ int tfs_init(tfs_params const *params_ptr) {
         params = tfs_default_params();
     }
 
-    if (state_init(params) != 0) {
+    if (state_init(params) != 0 || dcache_init(params.max_inode_count) != 0) {
         return -1;
     }
 
-    // create root inode
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+    // A restored store already has its root inode, but may have been left
+    // inconsistent by a crash
+    if (state_restored()) {
+        if (state_recover() != 0) {
+            dcache_destroy();
+            state_destroy();
+            return -1;
+        }
+    } else {
+        // create root inode
+        int root = inode_create(T_DIRECTORY);
+        if (root != ROOT_DIR_INUM) {
+            return -1;
+        }
+    }
+
+    // Replay the changes logged before a crash
+    if (wal_init(&params, wal_apply) != 0) {
+        dcache_destroy();
+        state_destroy();
         return -1;
     }
 
@@ -44,69 +194,156 @@ int tfs_init(tfs_params const *params_ptr) {
 }
 
 int tfs_destroy() {
+    dcache_destroy();
+    if (wal_destroy() != 0) {
+        state_destroy();
+        return -1;
+    }
     if (state_destroy() != 0) {
         return -1;
     }
     return 0;
 }
 
+/**
+ * Flush the store after a file or directory was created or deleted, before
+ * the change is acknowledged, when there is a write-ahead log: it only holds
+ * changes to the contents of files, which cannot be replayed into files the
+ * store does not have (or into an inode since reused).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int namespace_sync(void) {
+    if (wal_enabled() && state_sync() != 0) {
+        return -1;
+    }
+    return 0;
+}
+
 static bool valid_pathname(char const *name) {
-    return name != NULL && strlen(name) > 1 && name[0] == '/';
+    return name != NULL && strlen(name) > 1 && strlen(name) < MAX_PATH_NAME &&
+           name[0] == '/';
+}
+
+/**
+ * Looks for a file in a directory, through the directory entry cache.
+ *
+ * Input:
+ *   - dir_inumber: the directory's inumber (locked by the caller)
+ *   - sub_name: file name (a single path name component)
+ *   - directory: set to whether the file is a directory (if found)
+ * Returns the inumber of the file, -1 if unsuccessful.
+ */
+static int tfs_lookup(int dir_inumber, char const *sub_name, bool *directory) {
+    int inum = dcache_get(dir_inumber, sub_name, directory);
+    if (inum != -1) {
+        return inum;
+    }
+
+    inum = find_in_dir(inode_get(dir_inumber), sub_name);
+    if (inum != -1) {
+        // The entry cannot be removed while the directory is locked, so it is
+        // cached while still there
+        *directory = inode_get(inum)->i_node_type == T_DIRECTORY;
+        dcache_put(dir_inumber, sub_name, inum, *directory);
+    }
+    return inum;
 }
 
 /**
- * Looks for a file.
+ * Looks for the directory holding a file, going down from the root directory
+ * through every component of its path name but the last one.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Directories are never deleted, so each directory along a path name is only
+ * locked (for reading) while being searched, through the directory entry
+ * cache or not, and unlocked before the next one is searched.
  *
  * Input:
  *   - name: absolute path name
- *   - root_inode: the root directory inode
- * Returns the inumber of the file, -1 if unsuccessful.
+ *   - sub_name: set to the last component of name
+ * Returns the inumber of the directory, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name, inode_t const *root_inode) {
+static int tfs_lookup_dir(char const *name, char const **sub_name) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
+    int dir_inumber = ROOT_DIR_INUM;
+    char const *component = name + 1; // skip the initial '/' character
+    char const *slash;
+    while ((slash = strchr(component, '/')) != NULL) {
+        size_t length = (size_t)(slash - component);
+        if (length == 0 || length > MAX_FILE_NAME - 1) {
+            return -1; // invalid component
+        }
+        char dir_name[MAX_FILE_NAME];
+        memcpy(dir_name, component, length);
+        dir_name[length] = '\0';
+
+        bool directory = false;
+        inode_rdlock(dir_inumber);
+        int inum = tfs_lookup(dir_inumber, dir_name, &directory);
+        inode_unlock(dir_inumber);
+        if (inum == -1 || !directory) {
+            return -1;
+        }
 
-    return find_in_dir(root_inode, name);
+        dir_inumber = inum;
+        component = slash + 1;
+    }
+
+    *sub_name = component;
+    return dir_inumber;
 }
 
 int tfs_open(char const *name, tfs_file_mode_t mode) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
+    // Checks if the path name is valid (and finds the file's directory)
+    char const *sub_name;
+    int dir_inum = tfs_lookup_dir(name, &sub_name);
+    if (dir_inum == -1) {
         return -1;
     }
-    // Checks if the path name is valid
-    if (!valid_pathname(name)) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
-        return -1;
+
+    inode_t *dir_inode = inode_get(dir_inum);
+    ALWAYS_ASSERT(dir_inode != NULL, "tfs_open: dir inode must exist");
+
+    // Creating a file modifies the directory, so it needs exclusive access;
+    // otherwise concurrent opens only share the directory
+    if (mode & TFS_O_CREAT) {
+        inode_wrlock(dir_inum);
+    } else {
+        inode_rdlock(dir_inum);
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
-    int inum = tfs_lookup(name, root_dir_inode);
+    bool directory = false;
+    int inum = tfs_lookup(dir_inum, sub_name, &directory);
+    bool created = false;
     size_t offset;
 
-    if (inum >= 0) {
+    if (inum >= 0 && directory) {
+        inode_unlock(dir_inum);
+        return -1; // directories cannot be opened
+    } else if (inum >= 0 && (mode & TFS_O_CREAT) && (mode & TFS_O_EXCL)) {
+        inode_unlock(dir_inum);
+        return -1; // the file was to be created by this open
+    } else if (inum >= 0) {
         // The file already exists
         inode_t *inode = inode_get(inum);
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
 
+        if (mode & TFS_O_TRUNC) {
+            inode_wrlock(inum);
+        } else {
+            inode_rdlock(inum);
+        }
+
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
+            inode_truncate(inode);
+            if (wal_enabled()) {
+                wal_append(WAL_TRUNCATE, inum, inode->i_generation, 0, NULL,
+                           0);
             }
         }
         // Determine initial offset
@@ -115,42 +352,38 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         } else {
             offset = 0;
         }
+
+        inode_unlock(inum);
     } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
         // Create inode
         inum = inode_create(T_FILE);
         if (inum == -1) {
-            if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-                WARN("failed to unlock mutex: %s", strerror(errno));
-                return -1;
-            }
+            inode_unlock(dir_inum);
             return -1; // no space in inode table
         }
 
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
+        // Add entry in the directory
+        if (add_dir_entry(dir_inode, sub_name, inum) == -1) {
             inode_delete(inum);
-            if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-                WARN("failed to unlock mutex: %s", strerror(errno));
-                return -1;
-            }
+            inode_unlock(dir_inum);
             return -1; // no space in directory
         }
 
+        created = true;
         offset = 0;
     } else {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+        inode_unlock(dir_inum);
         return -1;
     }
 
     // Finally, add entry to the open file table and return the corresponding
-    // handle
-    int ret = add_to_open_file_table(inum, offset);
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
+    // handle (still holding the directory lock, so the file cannot be unlinked
+    // in between)
+    int ret = add_to_open_file_table(inum, offset, mode & TFS_O_DURABLE);
+    inode_unlock(dir_inum);
+    if (ret != -1 && created && namespace_sync() != 0) {
+        tfs_close(ret);
         return -1;
     }
     return ret;
@@ -160,169 +393,376 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
     // opened but it remains created
 }
 
-int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
+int tfs_mkdir(char const *name) {
+    char const *sub_name;
+    int dir_inum = tfs_lookup_dir(name, &sub_name);
+    if (dir_inum == -1) {
         return -1;
     }
+
+    inode_t *dir_inode = inode_get(dir_inum);
+    inode_wrlock(dir_inum);
+
+    bool directory = false;
+    if (tfs_lookup(dir_inum, sub_name, &directory) != -1) {
+        inode_unlock(dir_inum);
+        return -1; // already exists
+    }
+
+    int inum = inode_create(T_DIRECTORY);
+    if (inum == -1) {
+        inode_unlock(dir_inum);
+        return -1; // no space in inode table
+    }
+
+    if (add_dir_entry(dir_inode, sub_name, inum) == -1) {
+        inode_delete(inum);
+        inode_unlock(dir_inum);
+        return -1; // no space in directory
+    }
+
+    inode_unlock(dir_inum);
+    return namespace_sync();
+}
+
+int tfs_close(int fhandle) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
         return -1; // invalid fd
     }
 
+    // Wait for any operation in progress on this handle
+    open_file_lock(file);
     remove_from_open_file_table(fhandle);
+    open_file_unlock(file);
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
+    if (state_sync_policy() == TFS_SYNC_ON_CLOSE && state_sync() != 0) {
         return -1;
     }
+
     return 0;
 }
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
-        return -1;
-    }
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
+    return tfs_writev(fhandle, &iov, 1);
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+    if (file == NULL || iovcnt < 0) {
         return -1;
     }
 
+    open_file_lock(file);
+
     //  From the open file table entry, we get the inode
     inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    inode_wrlock(file->of_inumber);
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
-    }
-
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-                    WARN("failed to unlock mutex: %s", strerror(errno));
-                    return -1;
-                }
-                return -1; // no space
-            }
+    // The file may have been deleted since it was opened (and its inode
+    // reused by another)
+    if (inode->i_generation != file->of_generation) {
+        inode_unlock(file->of_inumber);
+        open_file_unlock(file);
+        return -1;
+    }
 
-            inode->i_data_block = bnum;
+    // The buffers are written one after the other, up to the first that does
+    // not fit
+    size_t total = 0;
+    bool no_space = false;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t written = inode_write(inode, file->of_offset, iov[i].iov_base,
+                                      iov[i].iov_len);
+        if (written == -1) {
+            no_space = true;
+            break;
         }
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
-
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+        // Log the change before another write to the file can be made, so
+        // that the log replays them in order
+        if (wal_enabled() && written > 0) {
+            file->of_lsn = wal_append(WAL_WRITE, file->of_inumber,
+                                      inode->i_generation, file->of_offset,
+                                      iov[i].iov_base, (size_t)written);
+        }
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+        // The offset associated with the file handle is incremented
+        // accordingly
+        file->of_offset += (size_t)written;
+        total += (size_t)written;
+        if ((size_t)written < iov[i].iov_len) {
+            break;
         }
     }
+    uint64_t lsn = file->of_lsn;
+    bool durable = file->of_durable;
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
+    inode_unlock(file->of_inumber);
+    open_file_unlock(file);
+
+    if (no_space && total == 0) {
+        return -1; // no space
+    }
+
+    if (durable && wal_wait(lsn) != 0) {
         return -1;
     }
-    return (ssize_t)to_write;
-}
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
+    if (state_sync_policy() == TFS_SYNC_ON_WRITE && state_sync() != 0) {
         return -1;
     }
+
+    return (ssize_t)total;
+}
+
+int tfs_fsync(int fhandle) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
         return -1;
     }
 
+    open_file_lock(file);
+    uint64_t lsn = file->of_lsn;
+    open_file_unlock(file);
+
+    return wal_wait(lsn);
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return tfs_readv(fhandle, &iov, 1);
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || iovcnt < 0) {
+        return -1;
+    }
+
+    open_file_lock(file);
+
     // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
+    inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    // Readers of the same file (through different handles) share the inode
+    inode_rdlock(file->of_inumber);
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    if (inode->i_generation != file->of_generation) {
+        inode_unlock(file->of_inumber);
+        open_file_unlock(file);
+        return -1; // deleted since it was opened
+    }
+
+    // The buffers are filled one after the other, up to the end of the file
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t bytes_read = inode_read(inode, file->of_offset,
+                                       iov[i].iov_base, iov[i].iov_len);
+
+        // The offset associated with the file handle is incremented
+        // accordingly
+        file->of_offset += bytes_read;
+        total += bytes_read;
+        if (bytes_read < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    inode_unlock(file->of_inumber);
+    open_file_unlock(file);
+    return (ssize_t)total;
+}
+
+int tfs_get_inumber(char const *name) {
+    char const *sub_name;
+    int dir_inum = tfs_lookup_dir(name, &sub_name);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    bool directory = false;
+    inode_rdlock(dir_inum);
+    int inum = tfs_lookup(dir_inum, sub_name, &directory);
+    inode_unlock(dir_inum);
+
+    return inum;
+}
+
+int tfs_get_file(char const *name, tfs_file_t *file) {
+    char const *sub_name;
+    int dir_inum = tfs_lookup_dir(name, &sub_name);
+    if (dir_inum == -1) {
+        return -1;
+    }
+
+    // The file cannot be deleted while the directory is locked
+    bool directory = false;
+    inode_rdlock(dir_inum);
+    int inum = tfs_lookup(dir_inum, sub_name, &directory);
+    if (inum != -1 && !directory) {
+        file->tf_inumber = inum;
+        file->tf_generation = inode_get(inum)->i_generation;
+    }
+    inode_unlock(dir_inum);
+
+    return inum == -1 || directory ? -1 : 0;
+}
+
+/**
+ * Lock a file, checking that it (still) exists.
+ *
+ * Returns the file's inode, locked for reading (or writing, if write), or NULL
+ * if the file was deleted (even if its inode was reused since).
+ */
+static inode_t *file_lock(tfs_file_t file, bool write) {
+    if (!inode_is_taken(file.tf_inumber)) {
+        return NULL;
+    }
+
+    if (write) {
+        inode_wrlock(file.tf_inumber);
+    } else {
+        inode_rdlock(file.tf_inumber);
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+    // The file may have been deleted before it was locked (which changes its
+    // generation, under the lock)
+    inode_t *inode = inode_get(file.tf_inumber);
+    if (!inode_is_taken(file.tf_inumber) || inode->i_node_type != T_FILE ||
+        inode->i_generation != file.tf_generation) {
+        inode_unlock(file.tf_inumber);
+        return NULL;
+    }
+    return inode;
+}
+
+ssize_t tfs_pwrite(tfs_file_t file, void const *buffer, size_t len,
+                   size_t offset) {
+    inode_t *inode = file_lock(file, true);
+    if (inode == NULL) {
+        return -1;
+    }
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+    ssize_t written = inode_write(inode, offset, buffer, len);
+    if (wal_enabled() && written > 0) {
+        wal_append(WAL_WRITE, file.tf_inumber, inode->i_generation, offset,
+                   buffer, (size_t)written);
     }
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
+    inode_unlock(file.tf_inumber);
+
+    if (written != -1 && state_sync_policy() == TFS_SYNC_ON_WRITE &&
+        state_sync() != 0) {
         return -1;
     }
-    return (ssize_t)to_read;
+
+    return written;
 }
 
-int tfs_unlink(char const *target) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
+ssize_t tfs_pread(tfs_file_t file, void *buffer, size_t len, size_t offset) {
+    inode_t *inode = file_lock(file, false);
+    if (inode == NULL) {
         return -1;
     }
-    // Checks if the path name is valid
-    if (!valid_pathname(target)) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+
+    size_t bytes_read = inode_read(inode, offset, buffer, len);
+
+    inode_unlock(file.tf_inumber);
+    return (ssize_t)bytes_read;
+}
+
+int tfs_unlink(char const *target) {
+    // Checks if the path name is valid (and finds the file's directory)
+    char const *sub_name;
+    int dir_inum = tfs_lookup_dir(target, &sub_name);
+    if (dir_inum == -1) {
         return -1;
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
-    int inum = tfs_lookup(target, root_dir_inode);
+    inode_t *dir_inode = inode_get(dir_inum);
+    ALWAYS_ASSERT(dir_inode != NULL, "tfs_unlink: dir inode must exist");
 
-    if (inum == -1) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+    inode_wrlock(dir_inum);
+    bool directory = false;
+    int inum = tfs_lookup(dir_inum, sub_name, &directory);
+
+    // Directories are never deleted (so path name lookups need not lock them)
+    if (inum == -1 || directory) {
+        inode_unlock(dir_inum);
         return -1;
     }
 
+    // The entry must leave the cache before its inode can be reused
+    dcache_invalidate(dir_inum, sub_name);
+
+    // Wait for operations in progress on the file before deleting it
+    inode_wrlock(inum);
     inode_delete(inum);
-    if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+    inode_unlock(inum);
+
+    if (clear_dir_entry(dir_inode, sub_name) == -1) {
+        inode_unlock(dir_inum);
         return -1;
     }
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
+    inode_unlock(dir_inum);
+    return namespace_sync();
+}
+
+typedef struct {
+    void (*callback)(char const *name, size_t size, void *arg);
+    void *arg;
+
+    // Absolute path name of the directory being listed, ending in '/'
+    char path[MAX_PATH_NAME];
+    size_t length;
+} list_args_t;
+
+static void list_entry(char const *sub_name, int sub_inumber, void *arg) {
+    list_args_t *args = arg;
+
+    // Report absolute path names, as taken by the other operations (every
+    // file's fits, as it had to be created)
+    size_t length = strnlen(sub_name, MAX_FILE_NAME - 1);
+    if (args->length + length + 1 >= MAX_PATH_NAME) {
+        return;
+    }
+    memcpy(args->path + args->length, sub_name, length);
+    args->path[args->length + length] = '\0';
+
+    // Directories are listed (locked after their parent) in turn
+    inode_t *inode = inode_get(sub_inumber);
+    inode_rdlock(sub_inumber);
+    if (inode->i_node_type == T_DIRECTORY) {
+        size_t dir_length = args->length;
+        args->path[args->length + length] = '/';
+        args->length += length + 1;
+        dir_list(inode, list_entry, args);
+        args->length = dir_length;
+        inode_unlock(sub_inumber);
+        return;
     }
+    size_t size = inode->i_size;
+    inode_unlock(sub_inumber);
 
-    return 0;
+    args->callback(args->path, size, args->arg);
+}
+
+int tfs_list(void (*callback)(char const *name, size_t size, void *arg),
+             void *arg) {
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_list: root dir inode must exist");
+
+    list_args_t args = {.callback = callback, .arg = arg, .length = 1};
+    args.path[0] = '/';
+
+    inode_rdlock(ROOT_DIR_INUM);
+    int result = dir_list(root_dir_inode, list_entry, &args);
+    inode_unlock(ROOT_DIR_INUM);
+
+    return result;
 }
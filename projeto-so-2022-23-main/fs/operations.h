@@ -2,10 +2,61 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * When the backing store is flushed (msync'ed) to disk, besides on
+ * tfs_destroy.
+ */
+typedef enum {
+    TFS_SYNC_NONE,     // only when the kernel writes it back
+    TFS_SYNC_ON_CLOSE, // when a file is closed
+    TFS_SYNC_ON_WRITE, // after every write
+} tfs_sync_policy_t;
+
+/**
+ * Classes of accesses to the FS state, each with its own simulated storage
+ * latency.
+ */
+typedef enum {
+    TFS_DELAY_INODE,      // inodes and the inode bitmap
+    TFS_DELAY_DIRECTORY,  // directory entries
+    TFS_DELAY_DATA_BLOCK, // data blocks and the block bitmap
+    TFS_DELAY_CLASSES,
+} tfs_delay_class_t;
 
 /**
  * TécnicoFS parameters.
+ *
+ * Every file and directory (the root directory included) takes one of the
+ * max_inode_count inodes, which bounds how many there can be in all, and in
+ * any one directory. A directory's entries take data blocks from the same
+ * max_block_count as file contents: none while it is empty, and then a hash
+ * table that is rebuilt over twice as many blocks whenever it would be more
+ * than three quarters full (a block of block_size bytes holds
+ * block_size / 44 entries). Adding an entry only fails for lack of blocks once
+ * the table is full and the blocks for one twice its size are not free.
+ *
+ * When store_path is not NULL, the persistent FS state (inodes, allocation
+ * bitmaps and data blocks) is mapped from that file, so it survives restarts:
+ * the file is created if needed, and must otherwise have been created with the
+ * same inode count, block count and block size.
+ *
+ * When wal_path is not NULL (which requires a store_path), writes and
+ * truncations are also logged in that file, committed in groups by a
+ * background thread: a group is written (and fdatasync'ed) once
+ * wal_commit_bytes (which must not be zero) are pending or
+ * wal_commit_interval_us after its first change. Changes committed to the log
+ * survive a crash, and are replayed into the store on the next tfs_init.
+ * Creating and deleting files and directories flush the store before
+ * returning instead, and a store left inconsistent by a crash is checked (its
+ * allocation bitmaps rebuilt) before the replay.
+ *
+ * Every access to the FS state is delayed by delay[class] busy-loop
+ * iterations, emulating the latency of secondary storage: all zero runs purely
+ * in memory, the same value everywhere gives a fixed latency.
  */
 typedef struct {
     size_t max_inode_count;
@@ -13,6 +64,15 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    size_t delay[TFS_DELAY_CLASSES];
+
+    char const *store_path;
+    tfs_sync_policy_t sync_policy;
+
+    char const *wal_path;
+    size_t wal_commit_interval_us;
+    size_t wal_commit_bytes;
 } tfs_params;
 
 /**
@@ -36,25 +96,43 @@ int tfs_destroy();
  * TécnicoFS file opening modes.
  */
 typedef enum {
-    TFS_O_CREAT = 0b001,
-    TFS_O_TRUNC = 0b010,
-    TFS_O_APPEND = 0b100,
+    TFS_O_CREAT = 0b0001,
+    TFS_O_TRUNC = 0b0010,
+    TFS_O_APPEND = 0b0100,
+    TFS_O_DURABLE = 0b1000,
+    TFS_O_EXCL = 0b10000,
 } tfs_file_mode_t;
 
 /**
  * Open a file.
  *
  * Input:
- *   - name: absolute path name
+ *   - name: absolute path name (the directories along it must exist)
  *   - mode: can be a combination (with bitwise or) of the following flags:
  *     - append mode (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
  *     - create file if it does not exist (TFS_O_CREAT)
+ *     - with TFS_O_CREAT, fail if the file already exists (TFS_O_EXCL), so
+ *       of concurrent opens of a file only the one creating it succeeds
+ *     - return from writes only once they are in the write-ahead log
+ *       (TFS_O_DURABLE)
  *
  * Returns file handle of the opened file if successful, -1 otherwise.
  */
 int tfs_open(char const *name, tfs_file_mode_t mode);
 
+/**
+ * Create a directory.
+ *
+ * Input:
+ *   - name: absolute path name (the directories along it must exist)
+ *
+ * Directories cannot be opened nor deleted.
+ *
+ * Returns 0 if successful, -1 otherwise (including name already existing).
+ */
+int tfs_mkdir(char const *name);
+
 /**
  * Create a symbolic link to a file.
  *
@@ -96,10 +174,39 @@ int tfs_close(int fhandle);
  *   - len: length of the buffer contents (in bytes)
  *
  * Returns the number of bytes that were written (can be lower than 'len' if the
- * maximum file size is exceeded), or -1 in case of error.
+ * maximum file size is exceeded), or -1 in case of error (including the file
+ * having been deleted since it was opened: reads and writes through its
+ * handles fail from then on).
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/**
+ * Write several buffers to an open file, one after the other, starting at the
+ * current offset, in a single operation (no other operation on the file comes
+ * in between).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: the buffers, with their lengths
+ *   - iovcnt: number of buffers
+ *
+ * Returns the total number of bytes that were written (can be lower than the
+ * sum of the lengths if the maximum file size is exceeded, in which case the
+ * buffers after the one cut short are not written), or -1 in case of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Wait until the writes made through an open file are in the write-ahead log
+ * (returning immediately if there is no log).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
 /**
  * Read from an open file, starting at the current offset.
  *
@@ -113,6 +220,84 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Read from an open file into several buffers, one after the other, starting
+ * at the current offset, in a single operation.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: the destination buffers, with their lengths
+ *   - iovcnt: number of buffers
+ *
+ * Returns the total number of bytes that were copied from the file (can be
+ * lower than the sum of the lengths if the file size was reached), or -1 in
+ * case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Look up a file (or directory).
+ *
+ * Input:
+ *   - name: absolute path name
+ *
+ * Returns the inumber of the file if it exists, -1 otherwise.
+ */
+int tfs_get_inumber(char const *name);
+
+/**
+ * A file, for positional reads and writes: its inumber and the generation of
+ * its inode, which changes once the file is deleted, so a file deleted (and
+ * its inode reused by another) is never reached through it.
+ */
+typedef struct {
+    int tf_inumber;
+    uint64_t tf_generation;
+} tfs_file_t;
+
+/**
+ * Look up a file, for positional reads and writes.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - file: set to the file, if found
+ *
+ * Returns 0 if the file exists, -1 otherwise (including name being a
+ * directory).
+ */
+int tfs_get_file(char const *name, tfs_file_t *file);
+
+/**
+ * Write to a file, starting at a given offset, without an open file handle.
+ *
+ * Input:
+ *   - file: the file (obtained from tfs_get_file)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: where to start writing
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error (including the file
+ * having been deleted).
+ */
+ssize_t tfs_pwrite(tfs_file_t file, void const *buffer, size_t len,
+                   size_t offset);
+
+/**
+ * Read from a file, starting at a given offset, without an open file handle.
+ *
+ * Input:
+ *   - file: the file (obtained from tfs_get_file)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: where to start reading
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error
+ * (including the file having been deleted).
+ */
+ssize_t tfs_pread(tfs_file_t file, void *buffer, size_t len, size_t offset);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -124,6 +309,18 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_unlink(char const *target);
 
+/**
+ * List the files in TécnicoFS, in every directory.
+ *
+ * Input:
+ *   - callback: called with the absolute path name and size of each file
+ *   - arg: passed on to every call of callback
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_list(void (*callback)(char const *name, size_t size, void *arg),
+             void *arg);
+
 /**
  * Copy the contents of a file that exists in the OS' file system tree
  * (outside TécnicoFS) to the TécnicoFS.
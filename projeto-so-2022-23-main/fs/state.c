@@ -1,39 +1,108 @@
 #include "state.h"
 #include "betterassert.h"
 
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in a single region: in primary memory or, when a store path is
+ * given, in a file mapped into memory, laid out as described by its
+ * superblock).
  */
 static tfs_params fs_params;
 
+/*
+ * Superblock, at the start of the region: the parameters the region was
+ * created with and the offset of each part of the state.
+ */
+typedef struct {
+    uint64_t sb_magic; // STORE_MAGIC once the region is initialized
+    uint64_t sb_inode_count;
+    uint64_t sb_block_count;
+    uint64_t sb_block_size;
+    uint64_t sb_inode_table;
+    uint64_t sb_inode_bitmap;
+    uint64_t sb_block_bitmap;
+    uint64_t sb_data;
+    uint64_t sb_length;
+} superblock_t;
+
+#define STORE_MAGIC (UINT64_C(0x3365726f74534654)) // "TFStore3"
+#define STORE_ALIGNMENT (4096)
+
+static char *store;
+static size_t store_length;
+static bool store_mapped;
+static bool store_restored;
+
+/*
+ * Allocation bitmap: one bit per slot (set when TAKEN), packed in 64-bit words,
+ * plus the index of the word where the next search starts.
+ */
+typedef struct {
+    uint64_t *words;
+    size_t n_words;
+    size_t hint;
+    tfs_delay_class_t delay_class; // of the structure it allocates from
+} allocation_bitmap_t;
+
+#define BITMAP_WORD_BITS (64)
+
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+static allocation_bitmap_t free_inodes;
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static allocation_bitmap_t free_blocks;
 
 /*
  * Volatile FS state
  */
-static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+
+/*
+ * Open file table: segments of entries allocated as the table grows, so that
+ * entries never move. Segment 0 holds max_open_files_count entries and every
+ * other segment as many as all segments before it, so a handle's segment
+ * follows from its leading bit. FREE entries are kept in a stack, linked
+ * through of_next_free.
+ */
+#define OPEN_FILE_SEGMENTS (32)
+static open_file_entry_t *open_file_segments[OPEN_FILE_SEGMENTS];
+static size_t open_file_n_segments;
+static atomic_size_t open_file_capacity; // set once a segment is ready
+static int open_file_free;               // top of the stack, -1 if empty
+
+/*
+ * Synchronization
+ *
+ * Each inode has its own reader-writer lock (directories included, so the
+ * root directory lock is the root inode's lock). The allocation vectors and
+ * the open file table have their own mutexes, which are only held for the
+ * duration of an allocation/release and never while taking an inode lock.
+ */
+static pthread_rwlock_t *inode_locks;
+static pthread_mutex_t free_inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t free_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t open_file_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry_t))
+#define BLOCK_POINTERS (BLOCK_SIZE / sizeof(int))
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -44,11 +113,19 @@ static inline bool valid_block_number(int block_number) {
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle >= 0 &&
+           (size_t)file_handle <
+               atomic_load_explicit(&open_file_capacity, memory_order_acquire);
 }
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+size_t state_max_file_size(void) {
+    return (INODE_DIRECT_BLOCKS + BLOCK_POINTERS +
+            BLOCK_POINTERS * BLOCK_POINTERS) *
+           BLOCK_SIZE;
+}
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -73,13 +150,290 @@ static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
  * Auxiliary function to insert a delay.
  * Used in accesses to persistent FS state as a way of emulating access
  * latencies as if such data structures were really stored in secondary memory.
+ * The length of the delay (possibly none) is set per class of access in the
+ * FS parameters.
+ *
+ * Input:
+ *   - delay_class: the kind of FS state accessed
  */
-static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
+static void insert_delay(tfs_delay_class_t delay_class) {
+    for (size_t i = 0; i < fs_params.delay[delay_class]; i++) {
         touch_all_memory();
     }
 }
 
+static size_t bitmap_words(size_t n_slots) {
+    return (n_slots + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/**
+ * Attach an allocation bitmap to its words.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - words: bitmap_words(n_slots) words
+ *   - n_slots: number of slots
+ *   - clear: whether to mark every slot FREE (otherwise the words are kept, as
+ *     restored from the store)
+ *   - delay_class: latency class of accesses to the bitmap
+ */
+static void bitmap_init(allocation_bitmap_t *bitmap, uint64_t *words,
+                        size_t n_slots, bool clear,
+                        tfs_delay_class_t delay_class) {
+    bitmap->n_words = bitmap_words(n_slots);
+    bitmap->hint = 0;
+    bitmap->words = words;
+    bitmap->delay_class = delay_class;
+    if (!clear) {
+        return;
+    }
+
+    memset(words, 0, bitmap->n_words * sizeof(uint64_t));
+    // Bits past the last slot are permanently TAKEN, so they are never found
+    size_t tail = n_slots % BITMAP_WORD_BITS;
+    if (tail != 0) {
+        bitmap->words[bitmap->n_words - 1] = ~((UINT64_C(1) << tail) - 1);
+    }
+}
+
+/**
+ * Find a FREE slot in an allocation bitmap and mark it TAKEN.
+ *
+ * The search starts at the hint word, which always precedes (or holds) the
+ * first word with free slots, so the search is amortized O(1).
+ *
+ * Returns the slot index, or -1 if every slot is TAKEN.
+ */
+static int bitmap_alloc(allocation_bitmap_t *bitmap) {
+    for (size_t w = bitmap->hint; w < bitmap->n_words; w++) {
+        if (w == bitmap->hint || (w * sizeof(uint64_t)) % BLOCK_SIZE == 0) {
+            // simulate storage access delay to the bitmap
+            insert_delay(bitmap->delay_class);
+        }
+
+        uint64_t free_bits = ~bitmap->words[w];
+        if (free_bits != 0) {
+            int bit = __builtin_ctzll(free_bits);
+            bitmap->words[w] |= UINT64_C(1) << bit;
+            bitmap->hint = w;
+            return (int)(w * BITMAP_WORD_BITS + (size_t)bit);
+        }
+    }
+
+    bitmap->hint = bitmap->n_words;
+    return -1;
+}
+
+static bool bitmap_is_taken(allocation_bitmap_t const *bitmap, size_t slot) {
+    return (bitmap->words[slot / BITMAP_WORD_BITS] >>
+            (slot % BITMAP_WORD_BITS)) &
+           1;
+}
+
+/**
+ * Mark a slot of an allocation bitmap FREE.
+ */
+static void bitmap_free(allocation_bitmap_t *bitmap, size_t slot) {
+    size_t w = slot / BITMAP_WORD_BITS;
+    bitmap->words[w] &= ~(UINT64_C(1) << (slot % BITMAP_WORD_BITS));
+    if (w < bitmap->hint) {
+        bitmap->hint = w;
+    }
+}
+
+/**
+ * Mark a slot of an allocation bitmap TAKEN.
+ */
+static void bitmap_set(allocation_bitmap_t *bitmap, size_t slot) {
+    bitmap->words[slot / BITMAP_WORD_BITS] |= UINT64_C(1)
+                                              << (slot % BITMAP_WORD_BITS);
+}
+
+static void mutex_lock(pthread_mutex_t *mutex) {
+    ALWAYS_ASSERT(pthread_mutex_lock(mutex) == 0, "failed to lock mutex");
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex) {
+    ALWAYS_ASSERT(pthread_mutex_unlock(mutex) == 0, "failed to unlock mutex");
+}
+
+/**
+ * Compute the layout of the persistent state for the current parameters.
+ */
+static void store_layout(superblock_t *superblock) {
+    size_t offset = 0;
+    memset(superblock, 0, sizeof(superblock_t));
+    superblock->sb_inode_count = INODE_TABLE_SIZE;
+    superblock->sb_block_count = DATA_BLOCKS;
+    superblock->sb_block_size = BLOCK_SIZE;
+
+    offset += sizeof(superblock_t);
+    superblock->sb_inode_table = offset;
+    offset += INODE_TABLE_SIZE * sizeof(inode_t);
+    offset = (offset + sizeof(uint64_t) - 1) / sizeof(uint64_t) *
+             sizeof(uint64_t);
+    superblock->sb_inode_bitmap = offset;
+    offset += bitmap_words(INODE_TABLE_SIZE) * sizeof(uint64_t);
+    superblock->sb_block_bitmap = offset;
+    offset += bitmap_words(DATA_BLOCKS) * sizeof(uint64_t);
+    offset = (offset + STORE_ALIGNMENT - 1) / STORE_ALIGNMENT * STORE_ALIGNMENT;
+    superblock->sb_data = offset;
+    offset += DATA_BLOCKS * BLOCK_SIZE;
+    superblock->sb_length = offset;
+}
+
+/**
+ * Obtain the region holding the persistent state: a zeroed allocation or,
+ * with a store path, the store file mapped into memory (created and sized if
+ * new, restored if it holds an initialized state).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int store_open(void) {
+    superblock_t layout;
+    store_layout(&layout);
+    store_length = layout.sb_length;
+    store_restored = false;
+
+    if (fs_params.store_path == NULL) {
+        store = calloc(1, store_length);
+        if (store == NULL) {
+            return -1;
+        }
+        store_mapped = false;
+        memcpy(store, &layout, sizeof(superblock_t));
+        return 0;
+    }
+
+    int fd = open(fs_params.store_path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size == 0 && ftruncate(fd, (off_t)store_length) == -1) ||
+        (st.st_size != 0 && (size_t)st.st_size != store_length)) {
+        close(fd); // a store of another size was created with other parameters
+        return -1;
+    }
+
+    void *map =
+        mmap(NULL, store_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping holds its own reference to the file
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    store = map;
+    store_mapped = true;
+
+    // A store whose initialization never completed is initialized again
+    superblock_t *superblock = (superblock_t *)store;
+    if (superblock->sb_magic == STORE_MAGIC) {
+        layout.sb_magic = STORE_MAGIC;
+        if (memcmp(superblock, &layout, sizeof(superblock_t)) != 0) {
+            munmap(store, store_length);
+            store = NULL;
+            return -1; // created with other parameters
+        }
+        store_restored = true;
+    } else {
+        memcpy(store, &layout, sizeof(superblock_t));
+    }
+    return 0;
+}
+
+/**
+ * Release the region holding the persistent state, flushing it to the store
+ * first.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int store_close(void) {
+    int result = 0;
+    if (store_mapped) {
+        result = state_sync();
+        if (munmap(store, store_length) == -1) {
+            result = -1;
+        }
+    } else {
+        free(store);
+    }
+    store = NULL;
+    return result;
+}
+
+/**
+ * Flush the persistent state to the store (if there is one).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_sync(void) {
+    if (!store_mapped) {
+        return 0;
+    }
+    return msync(store, store_length, MS_SYNC);
+}
+
+tfs_sync_policy_t state_sync_policy(void) { return fs_params.sync_policy; }
+
+bool state_restored(void) { return store_restored; }
+
+/**
+ * Add a segment to the open file table, with FREE entries only.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The table already has as many handles as fit in an int.
+ *   - No memory for the segment.
+ */
+static int open_file_table_grow(void) {
+    size_t capacity = atomic_load(&open_file_capacity);
+    size_t size = open_file_n_segments == 0 ? MAX_OPEN_FILES : capacity;
+    if (size == 0 || open_file_n_segments == OPEN_FILE_SEGMENTS ||
+        capacity + size > INT_MAX) {
+        return -1;
+    }
+
+    open_file_entry_t *segment = malloc(size * sizeof(open_file_entry_t));
+    if (segment == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (pthread_mutex_init(&segment[i].of_lock, NULL) != 0) {
+            while (i-- > 0) {
+                pthread_mutex_destroy(&segment[i].of_lock);
+            }
+            free(segment);
+            return -1;
+        }
+        atomic_init(&segment[i].of_state, FREE);
+        segment[i].of_next_free =
+            i + 1 < size ? (int)(capacity + i + 1) : open_file_free;
+    }
+
+    open_file_free = (int)capacity;
+    open_file_segments[open_file_n_segments++] = segment;
+    atomic_store_explicit(&open_file_capacity, capacity + size,
+                          memory_order_release);
+    return 0;
+}
+
+/**
+ * Obtain the open file table entry of a valid handle.
+ */
+static open_file_entry_t *open_file_entry(int fhandle) {
+    size_t handle = (size_t)fhandle;
+    if (handle < MAX_OPEN_FILES) {
+        return &open_file_segments[0][handle];
+    }
+
+    // Segment k > 0 starts at MAX_OPEN_FILES << (k - 1)
+    size_t k = (size_t)(64 - __builtin_clzll(handle / MAX_OPEN_FILES));
+    return &open_file_segments[k][handle - (MAX_OPEN_FILES << (k - 1))];
+}
+
 /**
  * Initialize FS state.
  *
@@ -91,37 +445,47 @@ static void insert_delay(void) {
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - The store cannot be opened or mapped, or was created with other
+ *     parameters.
  */
 int state_init(tfs_params params) {
-    fs_params = params;
-
     if (inode_table != NULL) {
         return -1; // already initialized
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+    fs_params = params;
 
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
-        return -1; // allocation failed
+    if (store_open() != 0) {
+        return -1;
     }
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+    superblock_t *superblock = (superblock_t *)store;
+    inode_table = (inode_t *)(store + superblock->sb_inode_table);
+    fs_data = store + superblock->sb_data;
+    bitmap_init(&free_inodes, (uint64_t *)(store + superblock->sb_inode_bitmap),
+                INODE_TABLE_SIZE, !store_restored, TFS_DELAY_INODE);
+    bitmap_init(&free_blocks, (uint64_t *)(store + superblock->sb_block_bitmap),
+                DATA_BLOCKS, !store_restored, TFS_DELAY_DATA_BLOCK);
+    if (!store_restored) {
+        superblock->sb_magic = STORE_MAGIC;
+    }
+
+    inode_locks = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
+    if (!inode_locks) {
+        return -1; // allocation failed
     }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (pthread_rwlock_init(&inode_locks[i], NULL) != 0) {
+            return -1;
+        }
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+    open_file_n_segments = 0;
+    atomic_store(&open_file_capacity, 0);
+    open_file_free = -1;
+    if (open_file_table_grow() != 0) {
+        return -1;
     }
 
     return 0;
@@ -130,24 +494,36 @@ int state_init(tfs_params params) {
 /**
  * Destroy FS state.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Returns 0 if succesful, -1 otherwise (if the store could not be flushed).
  */
 int state_destroy(void) {
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+    }
+    size_t segment_size = MAX_OPEN_FILES;
+    for (size_t k = 0; k < open_file_n_segments; k++) {
+        for (size_t i = 0; i < segment_size; i++) {
+            pthread_mutex_destroy(&open_file_segments[k][i].of_lock);
+        }
+        free(open_file_segments[k]);
+        open_file_segments[k] = NULL;
+        if (k > 0) {
+            segment_size *= 2;
+        }
+    }
+    open_file_n_segments = 0;
+    atomic_store(&open_file_capacity, 0);
+
+    int result = store_close();
+    free(inode_locks);
 
     inode_table = NULL;
-    freeinode_ts = NULL;
     fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+    free_inodes.words = NULL;
+    free_blocks.words = NULL;
+    inode_locks = NULL;
 
-    return 0;
+    return result;
 }
 
 /**
@@ -160,22 +536,12 @@ int state_destroy(void) {
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
+    // Finds (and takes) the first free entry in inode table
+    mutex_lock(&free_inodes_lock);
+    int inumber = bitmap_alloc(&free_inodes);
+    mutex_unlock(&free_inodes_lock);
 
-            return (int)inumber;
-        }
-    }
-
-    // no free inodes
-    return -1;
+    return inumber; // -1 if no free inodes
 }
 
 /**
@@ -183,8 +549,8 @@ static int inode_alloc(void) {
  *
  * Allocates and initializes a new inode.
  * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * set to BLOCK_SIZE. Regular files will not have any data block allocated
+ * (i_size will be set to 0, all block pointers to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -193,7 +559,6 @@ static int inode_alloc(void) {
  *
  * Possible errors:
  *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
  */
 int inode_create(inode_type i_type) {
     int inumber = inode_alloc();
@@ -202,39 +567,22 @@ int inode_create(inode_type i_type) {
     }
 
     inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    insert_delay(TFS_DELAY_INODE); // simulate storage access delay (to inode)
 
     inode->i_node_type = i_type;
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
-            // run regular deletion process
-            inode_delete(inumber);
-            return -1;
-        }
-
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
+    inode->i_size = 0;
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_data_blocks[i] = -1;
+    }
+    inode->i_indirect_block = -1;
+    inode->i_double_indirect_block = -1;
+    inode->i_entries = 0;
 
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
-    } break;
+    switch (i_type) {
+    case T_DIRECTORY:
+        // A directory's blocks are allocated as entries are added to it
     case T_FILE:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
+        // In case of a new file, there is nothing else to initialize
         break;
     default:
         PANIC("inode_create: unknown file type");
@@ -247,23 +595,46 @@ int inode_create(inode_type i_type) {
  * Delete an inode.
  *
  * Input:
- *   - inumber: inode's number
+ *   - inumber: inode's number (write locked by the caller, if the file may be
+ *     in use)
  */
 void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
+    // simulate storage access delay (to inode and free_inodes)
+    insert_delay(TFS_DELAY_INODE);
+    insert_delay(TFS_DELAY_INODE);
 
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
 
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
+    // Before the inode can be reused, so whoever locks it next knows the file
+    // is gone
+    inode_truncate(&inode_table[inumber]);
+    inode_table[inumber].i_generation++;
+
+    mutex_lock(&free_inodes_lock);
+    ALWAYS_ASSERT(bitmap_is_taken(&free_inodes, (size_t)inumber),
                   "inode_delete: inode already freed");
+    bitmap_free(&free_inodes, (size_t)inumber);
+    mutex_unlock(&free_inodes_lock);
+}
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+/**
+ * Check whether an inode is in use.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns true if the inode is allocated, false otherwise.
+ */
+bool inode_is_taken(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return false;
     }
 
-    freeinode_ts[inumber] = FREE;
+    mutex_lock(&free_inodes_lock);
+    bool taken = bitmap_is_taken(&free_inodes, (size_t)inumber);
+    mutex_unlock(&free_inodes_lock);
+
+    return taken;
 }
 
 /**
@@ -277,10 +648,352 @@ void inode_delete(int inumber) {
 inode_t *inode_get(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-    insert_delay(); // simulate storage access delay to inode
+    insert_delay(TFS_DELAY_INODE); // simulate storage access delay to inode
     return &inode_table[inumber];
 }
 
+/**
+ * Obtain the block number stored in a block pointer, optionally allocating a
+ * new data block if the pointer is unset.
+ *
+ * Returns the block number, or -1 if unset and not allocated.
+ */
+static int block_pointer_get(int *pointer, bool alloc) {
+    if (*pointer == -1 && alloc) {
+        *pointer = data_block_alloc();
+    }
+    return *pointer;
+}
+
+/**
+ * Obtain the contents of an indirect block (an array of BLOCK_POINTERS block
+ * numbers), optionally allocating it (with every entry unset) if needed.
+ *
+ * Returns a pointer to the block numbers, or NULL if unset and not allocated.
+ */
+static int *indirect_block_get(int *pointer, bool alloc) {
+    bool fresh = *pointer == -1;
+    if (block_pointer_get(pointer, alloc) == -1) {
+        return NULL;
+    }
+
+    int *block_numbers = (int *)data_block_get(*pointer);
+    ALWAYS_ASSERT(block_numbers != NULL,
+                  "indirect_block_get: indirect block must exist");
+    if (fresh) {
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            block_numbers[i] = -1;
+        }
+    }
+    return block_numbers;
+}
+
+/**
+ * Obtain the number of the data block holding a given block of a file.
+ *
+ * Input:
+ *   - inode: the file's inode (locked for writing if alloc is true)
+ *   - block_index: index of the block within the file (offset / BLOCK_SIZE)
+ *   - alloc: whether missing blocks (data or indirect) should be allocated
+ *
+ * Returns the block number, or -1 if the block is not allocated (or could not
+ * be allocated).
+ *
+ * Possible errors:
+ *   - block_index beyond the maximum file size.
+ *   - No free data blocks.
+ */
+int inode_block_get(inode_t *inode, size_t block_index, bool alloc) {
+    if (block_index < INODE_DIRECT_BLOCKS) {
+        return block_pointer_get(&inode->i_data_blocks[block_index], alloc);
+    }
+    block_index -= INODE_DIRECT_BLOCKS;
+
+    if (block_index < BLOCK_POINTERS) {
+        int *indirect = indirect_block_get(&inode->i_indirect_block, alloc);
+        if (indirect == NULL) {
+            return -1;
+        }
+        return block_pointer_get(&indirect[block_index], alloc);
+    }
+    block_index -= BLOCK_POINTERS;
+
+    if (block_index < BLOCK_POINTERS * BLOCK_POINTERS) {
+        int *double_indirect =
+            indirect_block_get(&inode->i_double_indirect_block, alloc);
+        if (double_indirect == NULL) {
+            return -1;
+        }
+        int *indirect = indirect_block_get(
+            &double_indirect[block_index / BLOCK_POINTERS], alloc);
+        if (indirect == NULL) {
+            return -1;
+        }
+        return block_pointer_get(&indirect[block_index % BLOCK_POINTERS],
+                                 alloc);
+    }
+
+    return -1; // beyond maximum file size
+}
+
+/**
+ * Free the data blocks referenced by an indirect block, and the block itself.
+ *
+ * Input:
+ *   - block_number: the indirect block's number
+ *   - depth: 1 for a single indirect block, 2 for a double indirect block
+ */
+static void indirect_block_free(int block_number, int depth) {
+    int const *block_numbers = (int const *)data_block_get(block_number);
+    ALWAYS_ASSERT(block_numbers != NULL,
+                  "indirect_block_free: indirect block must exist");
+
+    for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+        if (block_numbers[i] == -1) {
+            continue;
+        }
+        if (depth > 1) {
+            indirect_block_free(block_numbers[i], depth - 1);
+        } else {
+            data_block_free(block_numbers[i]);
+        }
+    }
+    data_block_free(block_number);
+}
+
+/**
+ * Free every data block of an inode and set its size to 0.
+ *
+ * Input:
+ *   - inode: the inode (locked for writing)
+ */
+void inode_truncate(inode_t *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_data_blocks[i] != -1) {
+            data_block_free(inode->i_data_blocks[i]);
+            inode->i_data_blocks[i] = -1;
+        }
+    }
+    if (inode->i_indirect_block != -1) {
+        indirect_block_free(inode->i_indirect_block, 1);
+        inode->i_indirect_block = -1;
+    }
+    if (inode->i_double_indirect_block != -1) {
+        indirect_block_free(inode->i_double_indirect_block, 2);
+        inode->i_double_indirect_block = -1;
+    }
+
+    inode->i_size = 0;
+}
+
+/**
+ * Lock an inode for reading (shared with other readers).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_rdlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_rdlock: invalid inumber");
+    ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode_locks[inumber]) == 0,
+                  "inode_rdlock: failed to lock inode");
+}
+
+/**
+ * Lock an inode for writing (exclusive).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_wrlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_wrlock: invalid inumber");
+    ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode_locks[inumber]) == 0,
+                  "inode_wrlock: failed to lock inode");
+}
+
+/**
+ * Unlock an inode previously locked with inode_rdlock or inode_wrlock.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unlock(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unlock: invalid inumber");
+    ALWAYS_ASSERT(pthread_rwlock_unlock(&inode_locks[inumber]) == 0,
+                  "inode_unlock: failed to unlock inode");
+}
+
+/*
+ * Directories
+ *
+ * The entries of a directory form a hash table (open addressing with linear
+ * probing) laid over its data blocks: an entry is stored at the first empty
+ * slot at or after the slot given by the hash of its name. Since the table
+ * lives in the directory's blocks, lookups, insertions and removals only
+ * visit a few slots.
+ *
+ * A directory gets its first DIR_MIN_BLOCKS blocks with its first entry, and
+ * the table is rebuilt over twice as many blocks whenever it would be more
+ * than three quarters full, for as long as there are free data blocks (and up
+ * to the maximum file size).
+ */
+
+/**
+ * Number of slots of a directory's hash table.
+ */
+static size_t dir_capacity(inode_t const *inode) {
+    return inode->i_size / BLOCK_SIZE * DIR_ENTRIES_PER_BLOCK;
+}
+
+/**
+ * Hash a file name (FNV-1a) into a slot of a table of the given capacity.
+ */
+static size_t dir_hash(char const *name, size_t capacity) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash % capacity;
+}
+
+/**
+ * Obtain a pointer to a slot of a directory's hash table.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - slot: slot index (< dir_capacity(inode))
+ */
+static dir_entry_t *dir_slot_get(inode_t *inode, size_t slot) {
+    int b = inode_block_get(inode, slot / DIR_ENTRIES_PER_BLOCK, false);
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_slot_get: directory must have its data blocks");
+
+    return &dir_entry[slot % DIR_ENTRIES_PER_BLOCK];
+}
+
+/**
+ * Find the slot holding an entry of a directory.
+ *
+ * Returns the slot index, or -1 if there is no entry named sub_name.
+ */
+static long dir_slot_find(inode_t *inode, char const *sub_name) {
+    size_t capacity = dir_capacity(inode);
+    if (capacity == 0) {
+        return -1; // no entries yet
+    }
+
+    size_t slot = dir_hash(sub_name, capacity);
+    for (size_t probes = 0; probes < capacity; probes++) {
+        dir_entry_t const *entry = dir_slot_get(inode, slot);
+        if (entry->d_inumber == -1) {
+            return -1; // reached the end of the probe sequence
+        }
+        if (strncmp(entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+            return (long)slot;
+        }
+        slot = (slot + 1) % capacity;
+    }
+    return -1;
+}
+
+/**
+ * Store an entry in a directory's hash table as it is (without growing it).
+ *
+ * Returns 0 if successful, -1 if there is an entry named sub_name already or
+ * no empty slot.
+ */
+static int dir_insert(inode_t *inode, char const *sub_name, int sub_inumber) {
+    size_t capacity = dir_capacity(inode);
+    if (capacity == 0) {
+        return -1; // no blocks yet
+    }
+
+    // Finds and fills the first empty slot of the name's probe sequence
+    size_t slot = dir_hash(sub_name, capacity);
+    for (size_t probes = 0; probes < capacity; probes++) {
+        dir_entry_t *entry = dir_slot_get(inode, slot);
+        if (entry->d_inumber == -1) {
+            entry->d_inumber = sub_inumber;
+            strncpy(entry->d_name, sub_name, MAX_FILE_NAME - 1);
+            entry->d_name[MAX_FILE_NAME - 1] = '\0';
+            inode->i_entries++;
+            return 0;
+        }
+        if (strncmp(entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+            return -1; // already exists
+        }
+        slot = (slot + 1) % capacity;
+    }
+
+    return -1; // no space for entry
+}
+
+/**
+ * Rebuild a directory's hash table over twice as many blocks (or its first
+ * DIR_MIN_BLOCKS): the new blocks are all taken before the old ones are
+ * released, so the table is left as it was if they cannot be.
+ *
+ * Input:
+ *   - inode: directory inode (locked for writing)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ *   - The table would be beyond the maximum file size.
+ */
+static int dir_grow(inode_t *inode) {
+    size_t blocks = inode->i_size / BLOCK_SIZE;
+    size_t grown_blocks = blocks == 0 ? DIR_MIN_BLOCKS : 2 * blocks;
+
+    // The new table is built in an inode of its own, whose blocks then become
+    // the directory's
+    inode_t grown = {
+        .i_node_type = T_DIRECTORY,
+        .i_size = 0,
+        .i_indirect_block = -1,
+        .i_double_indirect_block = -1,
+    };
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        grown.i_data_blocks[i] = -1;
+    }
+    for (size_t i = 0; i < grown_blocks; i++) {
+        int b = inode_block_get(&grown, i, true);
+        if (b == -1) {
+            inode_truncate(&grown);
+            return -1;
+        }
+
+        // Empty entries are labeled with inumber==-1
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        for (size_t j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            dir_entry[j].d_inumber = -1;
+            memset(dir_entry[j].d_name, 0, MAX_FILE_NAME);
+        }
+    }
+    grown.i_size = grown_blocks * BLOCK_SIZE;
+
+    size_t capacity = dir_capacity(inode);
+    for (size_t slot = 0; slot < capacity; slot++) {
+        dir_entry_t const *entry = dir_slot_get(inode, slot);
+        if (entry->d_inumber != -1) {
+            ALWAYS_ASSERT(dir_insert(&grown, entry->d_name,
+                                     entry->d_inumber) == 0,
+                          "dir_grow: entries must fit the grown table");
+        }
+    }
+
+    inode_truncate(inode);
+    memcpy(inode->i_data_blocks, grown.i_data_blocks,
+           sizeof(grown.i_data_blocks));
+    inode->i_indirect_block = grown.i_indirect_block;
+    inode->i_double_indirect_block = grown.i_double_indirect_block;
+    inode->i_size = grown.i_size;
+    inode->i_entries = grown.i_entries;
+    return 0;
+}
+
 /**
  * Clear the directory entry associated with a sub file.
  *
@@ -295,31 +1008,53 @@ inode_t *inode_get(int inumber) {
  *   - Directory does not contain an entry for sub_name.
  */
 int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
+    insert_delay(TFS_DELAY_DIRECTORY);
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
+    long found = dir_slot_find(inode, sub_name);
+    if (found == -1) {
+        return -1; // sub_name not found
+    }
 
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
+    // Shift back the entries that follow in the same probe sequence, so that
+    // no lookup stops early at the slot being emptied
+    size_t capacity = dir_capacity(inode);
+    size_t hole = (size_t)found;
+    size_t slot = hole;
+    for (size_t probes = 1; probes < capacity; probes++) {
+        slot = (slot + 1) % capacity;
+        dir_entry_t *entry = dir_slot_get(inode, slot);
+        if (entry->d_inumber == -1) {
+            break;
+        }
+
+        // The entry can fill the hole unless its home slot lies cyclically in
+        // (hole, slot]
+        size_t home = dir_hash(entry->d_name, capacity);
+        bool stays = hole <= slot ? (hole < home && home <= slot)
+                                  : (hole < home || home <= slot);
+        if (!stays) {
+            *dir_slot_get(inode, hole) = *entry;
+            hole = slot;
         }
     }
-    return -1; // sub_name not found
+
+    dir_entry_t *entry = dir_slot_get(inode, hole);
+    entry->d_inumber = -1;
+    memset(entry->d_name, 0, MAX_FILE_NAME);
+    inode->i_entries--;
+    return 0;
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Store the inumber for a sub file in a directory, first growing its hash
+ * table if the entry would leave it more than three quarters full (or if it
+ * has no blocks yet).
  *
  * Input:
- *   - inode: directory inode
+ *   - inode: directory inode (locked for writing)
  *   - sub_name: sub file name
  *   - sub_inumber: inumber of the sub inode
  *
@@ -328,35 +1063,30 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - Directory already contains an entry for sub_name.
+ *   - Directory is full of entries, and its table cannot grow (no free data
+ *     blocks, or already as large as a file can be).
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
     if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
         return -1; // invalid sub_name
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    // simulate storage access delay to inode with inumber
+    insert_delay(TFS_DELAY_DIRECTORY);
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
-
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
-
-            return 0;
+    // A table that cannot grow is still filled up, for as long as it has room
+    if (4 * (inode->i_entries + 1) > 3 * dir_capacity(inode)) {
+        if (dir_slot_find(inode, sub_name) != -1) {
+            return -1; // already exists
         }
+        dir_grow(inode);
     }
 
-    return -1; // no space for entry
+    return dir_insert(inode, sub_name, sub_inumber);
 }
 
 /**
@@ -372,31 +1102,54 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
  *   - inode is not a directory inode.
  *   - Directory does not contain a file named sub_name.
  */
-int find_in_dir(inode_t const *inode, char const *sub_name) {
+int find_in_dir(inode_t *inode, char const *sub_name) {
     ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
     ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    // simulate storage access delay to inode with inumber
+    insert_delay(TFS_DELAY_DIRECTORY);
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    long slot = dir_slot_find(inode, sub_name);
+    if (slot == -1) {
+        return -1; // entry not found
+    }
 
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    return dir_slot_get(inode, (size_t)slot)->d_inumber;
+}
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
-        }
+/**
+ * Go through the entries of a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - callback: called with the name and inumber of each entry
+ *   - arg: passed on to every call of callback
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ */
+int dir_list(inode_t *inode,
+             void (*callback)(char const *sub_name, int sub_inumber, void *arg),
+             void *arg) {
+    // simulate storage access delay to inode with inumber
+    insert_delay(TFS_DELAY_DIRECTORY);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
 
-    return -1; // entry not found
+    size_t capacity = dir_capacity(inode);
+    for (size_t slot = 0; slot < capacity; slot++) {
+        dir_entry_t const *entry = dir_slot_get(inode, slot);
+        if (entry->d_inumber != -1) {
+            callback(entry->d_name, entry->d_inumber, arg);
+        }
+    }
+    return 0;
 }
 
 /**
@@ -408,18 +1161,11 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
  *   - No free data blocks.
  */
 int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+    mutex_lock(&free_blocks_lock);
+    int block_number = bitmap_alloc(&free_blocks);
+    mutex_unlock(&free_blocks_lock);
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-
-            return (int)i;
-        }
-    }
-    return -1;
+    return block_number;
 }
 
 /**
@@ -432,9 +1178,14 @@ void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    // simulate storage access delay to free_blocks
+    insert_delay(TFS_DELAY_DATA_BLOCK);
 
-    free_blocks[block_number] = FREE;
+    mutex_lock(&free_blocks_lock);
+    ALWAYS_ASSERT(bitmap_is_taken(&free_blocks, (size_t)block_number),
+                  "data_block_free: block already freed");
+    bitmap_free(&free_blocks, (size_t)block_number);
+    mutex_unlock(&free_blocks_lock);
 }
 
 /**
@@ -449,34 +1200,261 @@ void *data_block_get(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
+    // simulate storage access delay to block
+    insert_delay(TFS_DELAY_DATA_BLOCK);
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/*
+ * Recovery of a restored store
+ *
+ * The kernel writes the store's pages back whenever it sees fit, so after a
+ * crash the inodes, directory entries and bitmaps in it may disagree: a block
+ * of a file may be FREE in the bitmap (and be handed out to another file), an
+ * entry may name a deleted inode. The bitmaps are rebuilt from what the
+ * directory tree references, dropping what cannot be trusted.
+ */
+
+/**
+ * Claim, in the rebuilt block bitmap, the block a block pointer references.
+ * A reference out of range or to a block already claimed is dropped (the
+ * pointer unset), so no block is shared.
+ *
+ * Returns true if the pointer still references a block.
+ */
+static bool recover_block(int *pointer) {
+    if (*pointer == -1) {
+        return false;
+    }
+    if (!valid_block_number(*pointer) ||
+        bitmap_is_taken(&free_blocks, (size_t)*pointer)) {
+        *pointer = -1;
+        return false;
+    }
+    bitmap_set(&free_blocks, (size_t)*pointer);
+    return true;
+}
+
+/**
+ * Claim the blocks referenced by an indirect block (already claimed).
+ *
+ * Input:
+ *   - block_number: the indirect block's number
+ *   - depth: 1 for a single indirect block, 2 for a double indirect block
+ */
+static void recover_indirect_block(int block_number, int depth) {
+    int *block_numbers = (int *)data_block_get(block_number);
+    for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+        if (recover_block(&block_numbers[i]) && depth > 1) {
+            recover_indirect_block(block_numbers[i], depth - 1);
+        }
+    }
+}
+
+/**
+ * Claim the blocks of a file.
+ */
+static void recover_file(inode_t *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        recover_block(&inode->i_data_blocks[i]);
+    }
+    if (recover_block(&inode->i_indirect_block)) {
+        recover_indirect_block(inode->i_indirect_block, 1);
+    }
+    if (recover_block(&inode->i_double_indirect_block)) {
+        recover_indirect_block(inode->i_double_indirect_block, 2);
+    }
+    if (inode->i_size > state_max_file_size()) {
+        inode->i_size = state_max_file_size();
+    }
+}
+
+/**
+ * Claim the blocks of a directory, all or none: its entries are spread over
+ * all of its blocks (i_size / BLOCK_SIZE of them), so it is unusable without
+ * any of them.
+ *
+ * Returns true if successful, false otherwise.
+ */
+static bool recover_directory(inode_t *inode) {
+    if (inode->i_size % BLOCK_SIZE != 0 ||
+        inode->i_size > state_max_file_size()) {
+        return false;
+    }
+
+    recover_file(inode);
+    for (size_t i = 0; i < inode->i_size / BLOCK_SIZE; i++) {
+        if (inode_block_get(inode, i, false) == -1) {
+            inode_truncate(inode); // releases the blocks claimed
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Rebuild the entries of a directory (whose blocks are claimed), keeping
+ * those naming an inode that was TAKEN, is of a known type, is not in another
+ * directory already and whose blocks could be claimed. The inodes kept are
+ * claimed too, and the directories among them pushed onto a stack.
+ *
+ * Input:
+ *   - inode: the directory's inode
+ *   - restored: the inode bitmap, as restored
+ *   - entries: room for an entry per inode (the most that can be kept)
+ *   - stack, top: the directories still to rebuild
+ */
+static void recover_entries(inode_t *inode,
+                            allocation_bitmap_t const *restored,
+                            dir_entry_t *entries, int *stack, size_t *top) {
+    size_t n_entries = 0;
+    size_t capacity = dir_capacity(inode);
+    for (size_t slot = 0; slot < capacity; slot++) {
+        dir_entry_t *entry = dir_slot_get(inode, slot);
+        if (valid_inumber(entry->d_inumber) && n_entries < INODE_TABLE_SIZE) {
+            entries[n_entries] = *entry;
+            entries[n_entries].d_name[MAX_FILE_NAME - 1] = '\0';
+            n_entries++;
+        }
+        entry->d_inumber = -1;
+        memset(entry->d_name, 0, MAX_FILE_NAME);
+    }
+    inode->i_entries = 0;
+
+    // The entries kept are no more than there were, so they fit the table as
+    // it is (growing it could take blocks not claimed yet)
+
+    for (size_t i = 0; i < n_entries; i++) {
+        int inumber = entries[i].d_inumber;
+        if (!valid_inumber(inumber) ||
+            !bitmap_is_taken(restored, (size_t)inumber) ||
+            bitmap_is_taken(&free_inodes, (size_t)inumber)) {
+            continue;
+        }
+
+        inode_t *sub_inode = &inode_table[inumber];
+        if (sub_inode->i_node_type == T_DIRECTORY) {
+            if (!recover_directory(sub_inode)) {
+                continue;
+            }
+            if (dir_insert(inode, entries[i].d_name, inumber) == -1) {
+                inode_truncate(sub_inode); // releases the blocks claimed
+                continue; // a duplicate name
+            }
+            stack[(*top)++] = inumber;
+        } else if (sub_inode->i_node_type == T_FILE) {
+            if (dir_insert(inode, entries[i].d_name, inumber) == -1) {
+                continue; // a duplicate name
+            }
+            recover_file(sub_inode);
+        } else {
+            continue;
+        }
+        bitmap_set(&free_inodes, (size_t)inumber);
+    }
+}
+
+/**
+ * Rebuild the directory tree, from the root directory down.
+ *
+ * Input:
+ *   - restored: the inode bitmap, as restored
+ *   - entries: room for an entry per inode
+ *   - stack: room for every inumber
+ *
+ * Returns 0 if successful, -1 otherwise (the root directory is damaged).
+ */
+static int recover_tree(allocation_bitmap_t const *restored,
+                        dir_entry_t *entries, int *stack) {
+    bitmap_init(&free_inodes, free_inodes.words, INODE_TABLE_SIZE, true,
+                TFS_DELAY_INODE);
+    bitmap_init(&free_blocks, free_blocks.words, DATA_BLOCKS, true,
+                TFS_DELAY_DATA_BLOCK);
+
+    inode_t *root = &inode_table[ROOT_DIR_INUM];
+    if (!bitmap_is_taken(restored, ROOT_DIR_INUM) ||
+        root->i_node_type != T_DIRECTORY || !recover_directory(root)) {
+        return -1;
+    }
+    bitmap_set(&free_inodes, ROOT_DIR_INUM);
+
+    // Every inode is reached at most once, so the stack never overflows
+    size_t top = 0;
+    stack[top++] = ROOT_DIR_INUM;
+    while (top > 0) {
+        int inumber = stack[--top];
+        recover_entries(&inode_table[inumber], restored, entries, stack, &top);
+    }
+    return 0;
+}
+
+/**
+ * Make a restored store consistent: rebuild the inode and block bitmaps from
+ * the inodes and blocks reachable from the root directory (the others are
+ * freed), dropping the references that cannot be trusted (out of range, or to
+ * a block or inode already in use).
+ *
+ * Must be called before the FS is used (e.g., before the changes logged are
+ * replayed, so none is made to a block that is still in use).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The root directory is damaged.
+ *   - malloc failure.
+ */
+int state_recover(void) {
+    allocation_bitmap_t restored = free_inodes;
+    restored.words = malloc(free_inodes.n_words * sizeof(uint64_t));
+    dir_entry_t *entries = malloc(INODE_TABLE_SIZE * sizeof(dir_entry_t));
+    int *stack = malloc(INODE_TABLE_SIZE * sizeof(int));
+
+    int result = -1;
+    if (restored.words != NULL && entries != NULL && stack != NULL) {
+        memcpy(restored.words, free_inodes.words,
+               free_inodes.n_words * sizeof(uint64_t));
+        result = recover_tree(&restored, entries, stack);
+    }
+
+    free(restored.words);
+    free(entries);
+    free(stack);
+    return result;
+}
+
 /**
  * Add a new entry to the open file table.
  *
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
+ *   - durable: whether writes wait until they are in the write-ahead log
  *
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
  *   - No space in open file table for a new open file.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-
-            return i;
-        }
+int add_to_open_file_table(int inumber, size_t offset, bool durable) {
+    mutex_lock(&open_file_table_lock);
+    if (open_file_free == -1 && open_file_table_grow() != 0) {
+        mutex_unlock(&open_file_table_lock);
+        return -1;
     }
 
-    return -1;
+    int fhandle = open_file_free;
+    open_file_entry_t *file = open_file_entry(fhandle);
+    open_file_free = file->of_next_free;
+
+    file->of_inumber = inumber;
+    file->of_generation = inode_table[inumber].i_generation;
+    file->of_offset = offset;
+    file->of_durable = durable;
+    file->of_lsn = 0;
+    atomic_store(&file->of_state, TAKEN);
+    mutex_unlock(&open_file_table_lock);
+
+    return fhandle;
 }
 
 /**
@@ -489,10 +1467,16 @@ void remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(valid_file_handle(fhandle),
                   "remove_from_open_file_table: file handle must be valid");
 
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
+    open_file_entry_t *file = open_file_entry(fhandle);
+
+    mutex_lock(&open_file_table_lock);
+    ALWAYS_ASSERT(atomic_load(&file->of_state) == TAKEN,
                   "remove_from_open_file_table: file handle must be taken");
 
-    free_open_file_entries[fhandle] = FREE;
+    atomic_store(&file->of_state, FREE);
+    file->of_next_free = open_file_free;
+    open_file_free = fhandle;
+    mutex_unlock(&open_file_table_lock);
 }
 
 /**
@@ -509,14 +1493,35 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
+    open_file_entry_t *file = open_file_entry(fhandle);
+    if (atomic_load(&file->of_state) != TAKEN) {
         return NULL;
     }
 
-    return &open_file_table[fhandle];
+    return file;
+}
+
+/**
+ * Lock an open file entry, serializing accesses to its offset.
+ *
+ * Input:
+ *   - file: open file entry (obtained from get_open_file_entry)
+ */
+void open_file_lock(open_file_entry_t *file) {
+    mutex_lock(&file->of_lock);
+}
+
+/**
+ * Unlock an open file entry.
+ *
+ * Input:
+ *   - file: open file entry (obtained from get_open_file_entry)
+ */
+void open_file_unlock(open_file_entry_t *file) {
+    mutex_unlock(&file->of_lock);
 }
 
 //Sque não preciso disto
 int _open_file_entry_size() {
-    return sizeof(&open_file_table);
+    return sizeof(&open_file_segments[0]);
 }
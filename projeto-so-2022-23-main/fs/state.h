@@ -4,7 +4,10 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -26,7 +29,21 @@ typedef struct {
     inode_type i_node_type;
 
     size_t i_size;
-    int i_data_block;
+    // Data block pointers (-1 when not allocated): the first blocks are
+    // referenced directly, the following ones through a block of block numbers
+    // (single indirect) and through a block of single indirect blocks (double
+    // indirect)
+    int i_data_blocks[INODE_DIRECT_BLOCKS];
+    int i_indirect_block;
+    int i_double_indirect_block;
+
+    // Incremented every time the inode is deleted, so changes logged for a
+    // deleted file are not replayed into a newer one, and a deleted file is
+    // not reached through a tfs_file_t once its inode is reused
+    uint64_t i_generation;
+
+    // Entries of a directory (in its hash table, see add_dir_entry)
+    size_t i_entries;
 
     // in a more complete FS, more fields could exist here
 } inode_t;
@@ -38,29 +55,60 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
  */
 typedef struct {
     int of_inumber;
+    uint64_t of_generation; // of the inode, once the file was opened
     size_t of_offset;
+
+    // Whether writes wait for the write-ahead log, and the LSN of the last
+    // write logged through this entry
+    bool of_durable;
+    uint64_t of_lsn;
+
+    atomic_int of_state; // allocation_state_t
+    int of_next_free;    // next FREE entry (-1 if none), when FREE
+
+    // serializes operations that use (and move) this entry's offset
+    pthread_mutex_t of_lock;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
 
+int state_sync(void);
+tfs_sync_policy_t state_sync_policy(void);
+bool state_restored(void);
+int state_recover(void);
+
 size_t state_block_size(void);
+size_t state_max_file_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
+bool inode_is_taken(int inumber);
 inode_t *inode_get(int inumber);
+int inode_block_get(inode_t *inode, size_t block_index, bool alloc);
+void inode_truncate(inode_t *inode);
+
+void inode_rdlock(int inumber);
+void inode_wrlock(int inumber);
+void inode_unlock(int inumber);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
-int find_in_dir(inode_t const *inode, char const *sub_name);
+int find_in_dir(inode_t *inode, char const *sub_name);
+int dir_list(inode_t *inode,
+             void (*callback)(char const *sub_name, int sub_inumber, void *arg),
+             void *arg);
 
 int data_block_alloc(void);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, size_t offset, bool durable);
 void remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+
+void open_file_lock(open_file_entry_t *file);
+void open_file_unlock(open_file_entry_t *file);
 int _open_file_entry_size();
 
 #endif // STATE_H
@@ -0,0 +1,388 @@
+#include "wal.h"
+#include "betterassert.h"
+#include "state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Record header, followed in the log by wr_length bytes of data (for writes).
+ */
+typedef struct {
+    uint32_t wr_magic;
+    uint32_t wr_checksum; // FNV-1a of the header (with wr_checksum 0) and data
+    int32_t wr_inumber;
+    uint32_t wr_type;
+    uint64_t wr_generation;
+    uint64_t wr_offset;
+    uint64_t wr_length;
+} wal_record_t;
+
+#define WAL_RECORD_MAGIC (0x4c415754u) // "TWAL"
+
+typedef struct {
+    char *data;
+    size_t capacity;
+} wal_buffer_t;
+
+static struct {
+    bool enabled;
+    int fd;
+    size_t commit_bytes;
+    long commit_interval_ns;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // records to commit, or stopping
+    pthread_cond_t committed; // durable advanced, or failed
+    pthread_t committer;
+
+    // Records being appended (current) and being written (the other one)
+    wal_buffer_t buffers[2];
+    size_t current;
+    size_t used;
+    struct timespec deadline; // of the commit of the records in current
+
+    uint64_t appended; // LSN of the last record appended
+    uint64_t durable;  // LSN of the last record committed
+    size_t log_size;
+    bool failed;
+    bool stopping;
+} wal;
+
+static uint32_t wal_checksum(uint32_t hash, void const *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= ((uint8_t const *)data)[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t wal_record_checksum(wal_record_t record, void const *data) {
+    record.wr_checksum = 0;
+    uint32_t hash = wal_checksum(2166136261u, &record, sizeof(wal_record_t));
+    return wal_checksum(hash, data, record.wr_length);
+}
+
+static void mutex_lock(pthread_mutex_t *mutex) {
+    ALWAYS_ASSERT(pthread_mutex_lock(mutex) == 0, "failed to lock mutex");
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex) {
+    ALWAYS_ASSERT(pthread_mutex_unlock(mutex) == 0, "failed to unlock mutex");
+}
+
+/**
+ * Empty the log: every record in it is reflected in the store once the store
+ * is flushed.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_checkpoint(void) {
+    if (state_sync() != 0 || ftruncate(wal.fd, 0) != 0) {
+        return -1;
+    }
+    wal.log_size = 0;
+    return 0;
+}
+
+/**
+ * Write a commit's records to the log and wait until they are on disk.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_flush(char const *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t written = write(wal.fd, data + done, length - done);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)written;
+    }
+    if (fdatasync(wal.fd) != 0) {
+        return -1;
+    }
+
+    wal.log_size += length;
+    if (wal.log_size >= WAL_CHECKPOINT_BYTES) {
+        return wal_checkpoint();
+    }
+    return 0;
+}
+
+static void *wal_committer(void *arg) {
+    (void)arg;
+
+    mutex_lock(&wal.lock);
+    while (true) {
+        while (wal.used == 0 && !wal.stopping) {
+            pthread_cond_wait(&wal.work, &wal.lock);
+        }
+        if (wal.used == 0) {
+            break; // stopping, with nothing left to commit
+        }
+
+        // Let more records join this commit, up to its deadline
+        while (!wal.stopping && wal.used < wal.commit_bytes) {
+            if (pthread_cond_timedwait(&wal.work, &wal.lock, &wal.deadline) ==
+                ETIMEDOUT) {
+                break;
+            }
+        }
+
+        // Appends go on into the other buffer while this one is written
+        wal_buffer_t *buffer = &wal.buffers[wal.current];
+        size_t length = wal.used;
+        uint64_t lsn = wal.appended;
+        wal.current = 1 - wal.current;
+        wal.used = 0;
+        mutex_unlock(&wal.lock);
+
+        int result = wal_flush(buffer->data, length);
+
+        mutex_lock(&wal.lock);
+        if (result == 0) {
+            wal.durable = lsn;
+        } else {
+            wal.failed = true;
+        }
+        pthread_cond_broadcast(&wal.committed);
+    }
+    mutex_unlock(&wal.lock);
+
+    return NULL;
+}
+
+/**
+ * Apply the records of the log, stopping at the first incomplete or corrupted
+ * one (a commit cut short), and empty it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int wal_recover(wal_apply_t apply) {
+    struct stat st;
+    if (fstat(wal.fd, &st) != 0) {
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        return 0;
+    }
+
+    char *log = malloc(size);
+    if (log == NULL) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytes_read =
+            pread(wal.fd, log + done, size - done, (off_t)done);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += (size_t)bytes_read;
+    }
+
+    size_t position = 0;
+    while (done - position >= sizeof(wal_record_t)) {
+        wal_record_t record;
+        memcpy(&record, log + position, sizeof(wal_record_t));
+        char const *data = log + position + sizeof(wal_record_t);
+        if (record.wr_magic != WAL_RECORD_MAGIC ||
+            record.wr_length > done - position - sizeof(wal_record_t) ||
+            wal_record_checksum(record, data) != record.wr_checksum) {
+            break;
+        }
+
+        apply((wal_record_type)record.wr_type, record.wr_inumber,
+              record.wr_generation, record.wr_offset, data, record.wr_length);
+        position += sizeof(wal_record_t) + record.wr_length;
+    }
+    free(log);
+
+    return wal_checkpoint();
+}
+
+/**
+ * Open the log (if params has a log path), recover the changes it holds and
+ * start the committer.
+ *
+ * Input:
+ *   - params: TécnicoFS parameters
+ *   - apply: function applying each change recovered
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - A log path without a store path (the changes would be replayed into an
+ *     empty FS).
+ *   - A zero wal_commit_bytes (commits would never have anything to gather).
+ *   - The log cannot be opened, read or emptied.
+ *   - The committer thread cannot be started.
+ */
+int wal_init(tfs_params const *params, wal_apply_t apply) {
+    memset(&wal, 0, sizeof(wal));
+    if (params->wal_path == NULL) {
+        return 0;
+    }
+    if (params->store_path == NULL || params->wal_commit_bytes == 0) {
+        return -1;
+    }
+
+    wal.fd = open(params->wal_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (wal.fd == -1) {
+        return -1;
+    }
+    if (wal_recover(apply) != 0) {
+        close(wal.fd);
+        return -1;
+    }
+
+    wal.commit_bytes = params->wal_commit_bytes;
+    wal.commit_interval_ns = (long)params->wal_commit_interval_us * 1000;
+    if (pthread_mutex_init(&wal.lock, NULL) != 0 ||
+        pthread_cond_init(&wal.work, NULL) != 0 ||
+        pthread_cond_init(&wal.committed, NULL) != 0 ||
+        pthread_create(&wal.committer, NULL, wal_committer, NULL) != 0) {
+        close(wal.fd);
+        return -1;
+    }
+
+    wal.enabled = true;
+    return 0;
+}
+
+/**
+ * Commit the records not yet committed, stop the committer and close the log
+ * (empty, as the store is flushed).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int wal_destroy(void) {
+    if (!wal.enabled) {
+        return 0;
+    }
+
+    mutex_lock(&wal.lock);
+    wal.stopping = true;
+    pthread_cond_signal(&wal.work);
+    mutex_unlock(&wal.lock);
+    pthread_join(wal.committer, NULL);
+
+    int result = wal.failed ? -1 : wal_checkpoint();
+    close(wal.fd);
+    free(wal.buffers[0].data);
+    free(wal.buffers[1].data);
+    pthread_mutex_destroy(&wal.lock);
+    pthread_cond_destroy(&wal.work);
+    pthread_cond_destroy(&wal.committed);
+    wal.enabled = false;
+
+    return result;
+}
+
+bool wal_enabled(void) { return wal.enabled; }
+
+/**
+ * Append a record to the log.
+ *
+ * Records of a file must be appended in the order the changes were made (i.e.,
+ * while holding the file's lock).
+ *
+ * Input:
+ *   - type: the kind of change
+ *   - inumber, generation: the file changed
+ *   - offset, data, length: the bytes written (for writes)
+ *
+ * Returns the record's LSN, to wait for with wal_wait.
+ */
+uint64_t wal_append(wal_record_type type, int inumber, uint64_t generation,
+                    size_t offset, void const *data, size_t length) {
+    wal_record_t record = {
+        .wr_magic = WAL_RECORD_MAGIC,
+        .wr_inumber = inumber,
+        .wr_type = (uint32_t)type,
+        .wr_generation = generation,
+        .wr_offset = offset,
+        .wr_length = length,
+    };
+    record.wr_checksum = wal_record_checksum(record, data);
+    size_t record_size = sizeof(wal_record_t) + length;
+
+    mutex_lock(&wal.lock);
+    wal_buffer_t *buffer = &wal.buffers[wal.current];
+    size_t need = wal.used + record_size;
+    if (need > buffer->capacity) {
+        // Room for a whole commit, at least
+        size_t capacity = buffer->capacity > wal.commit_bytes
+                              ? buffer->capacity
+                              : wal.commit_bytes;
+        while (capacity < need) {
+            capacity *= 2;
+        }
+        char *data_grown = realloc(buffer->data, capacity);
+        if (data_grown == NULL) {
+            // The change cannot be made durable
+            wal.failed = true;
+            pthread_cond_broadcast(&wal.committed);
+            mutex_unlock(&wal.lock);
+            return wal.appended;
+        }
+        buffer->data = data_grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + wal.used, &record, sizeof(wal_record_t));
+    memcpy(buffer->data + wal.used + sizeof(wal_record_t), data, length);
+
+    if (wal.used == 0) {
+        // The first record of a commit sets its deadline
+        clock_gettime(CLOCK_REALTIME, &wal.deadline);
+        wal.deadline.tv_nsec += wal.commit_interval_ns;
+        wal.deadline.tv_sec += wal.deadline.tv_nsec / 1000000000L;
+        wal.deadline.tv_nsec %= 1000000000L;
+        pthread_cond_signal(&wal.work);
+    }
+    wal.used += record_size;
+    if (wal.used >= wal.commit_bytes) {
+        pthread_cond_signal(&wal.work);
+    }
+
+    wal.appended += record_size;
+    uint64_t lsn = wal.appended;
+    mutex_unlock(&wal.lock);
+
+    return lsn;
+}
+
+/**
+ * Wait until a record is durable (committed to the log).
+ *
+ * Returns 0 if successful, -1 if the log failed.
+ */
+int wal_wait(uint64_t lsn) {
+    if (!wal.enabled) {
+        return 0;
+    }
+
+    mutex_lock(&wal.lock);
+    while (wal.durable < lsn && !wal.failed) {
+        pthread_cond_wait(&wal.committed, &wal.lock);
+    }
+    int result = wal.failed ? -1 : 0;
+    mutex_unlock(&wal.lock);
+
+    return result;
+}
@@ -0,0 +1,43 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Write-ahead log of the changes to file contents (writes and truncations).
+ *
+ * Records are appended to an in-memory buffer and written to the log file,
+ * followed by a single fdatasync, by a committer thread: once
+ * wal_commit_bytes are buffered or wal_commit_interval_us after the first
+ * record of a commit was appended, whichever comes first. Every record is
+ * identified by its LSN (the log position where it ends); waiting for an LSN
+ * waits for the commit that includes it, so concurrent writers share fsyncs.
+ *
+ * When the log grows past WAL_CHECKPOINT_BYTES, the store is flushed and the
+ * log emptied, as every record in it is then reflected in the store.
+ */
+
+#define WAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+typedef enum { WAL_WRITE = 1, WAL_TRUNCATE = 2 } wal_record_type;
+
+/**
+ * Function applying a logged change, during recovery.
+ */
+typedef void (*wal_apply_t)(wal_record_type type, int inumber,
+                            uint64_t generation, size_t offset,
+                            void const *data, size_t length);
+
+int wal_init(tfs_params const *params, wal_apply_t apply);
+int wal_destroy(void);
+bool wal_enabled(void);
+
+uint64_t wal_append(wal_record_type type, int inumber, uint64_t generation,
+                    size_t offset, void const *data, size_t length);
+int wal_wait(uint64_t lsn);
+
+#endif // WAL_H
@@ -13,11 +13,12 @@
 #include <unistd.h>
 
 int box_request(int server_pipe, char *session_pipe_name, char *box,
-                uint8_t code) {
+                uint8_t code, box_retention_t const *retention) {
 
     // Send the request to the Server
 
-    void *message = calloc(REQUEST_LENGTH, sizeof(char));
+    size_t length = request_length(code);
+    void *message = calloc(length, sizeof(char));
     if (message == NULL) {
         fprintf(stderr,"Unable to alloc memory to request box action.\n");
         return -1;
@@ -38,13 +39,17 @@ int box_request(int server_pipe, char *session_pipe_name, char *box,
     memcpy(message, &tfs_directory, sizeof(char));
     message += sizeof(char);
     // Box
-    size_t box_n_bytes =
-        strlen(box) > BOX_NAME_LENGTH - 1 ? BOX_NAME_LENGTH - 1 : strlen(box);
-    memcpy(message, box, box_n_bytes);
+    memcpy(message, box, strlen(box));
+
+    // Retention of a Box created
+    if (retention != NULL) {
+        memcpy(message + BOX_NAME_LENGTH - 1, retention,
+               sizeof(box_retention_t));
+    }
 
     message -= (UINT8_T_SIZE + PIPE_NAME_LENGTH + 1);
 
-    if (write(server_pipe, message, REQUEST_LENGTH) == -1) {
+    if (write(server_pipe, message, length) == -1) {
         fprintf(stderr,"Unable to write message.\n");
         free(message);
         return -1;
@@ -78,7 +83,7 @@ int box_request(int server_pipe, char *session_pipe_name, char *box,
     if (memcmp(&return_code, &BOX_SUCCESS, sizeof(int32_t)) == 0) {
         fprintf(stdout, "OK\n");
     } else {
-        fprintf(stdout, "ERROR%s\n", error_message);
+        fprintf(stdout, "ERROR %s\n", error_message);
     }
 
     if (close(session_pipe) == -1) {
@@ -134,39 +139,43 @@ int list_box_request(int server_pipe, char *session_pipe_name) {
 
     int flag = TRUE;
     while (flag) {
-        if (read(session_pipe, buffer, LIST_RESPONSE) == -1) {
+        if (read(session_pipe, buffer, LIST_RESPONSE) <= 0) {
             fprintf(stderr,"Unable to read Box list.\n");
             return -1;
         }
 
+        // Skip the answer's code
+        void *entry = buffer + UINT8_T_SIZE;
+
         uint8_t last;
-        memcpy(&last, buffer, UINT8_T_SIZE);
-        buffer += UINT8_T_SIZE;
-        // FIXME se nao houver boxes last vem a 1 e box_name a \0
-        if (memcmp(&last, &BOX_ERROR, UINT8_T_SIZE) == 0) {
-            fprintf(stdout, "NO BOXES FOUND\n");
-            break;
-        } else if (memcmp(&last, &LAST_BOX, UINT8_T_SIZE) == 0) {
+        memcpy(&last, entry, UINT8_T_SIZE);
+        entry += UINT8_T_SIZE;
+        if (last == LAST_BOX) {
             flag = FALSE;
         }
 
         char box_name[BOX_NAME_LENGTH];
         memset(box_name, 0, BOX_NAME_LENGTH);
-        memcpy(box_name, buffer, BOX_NAME_LENGTH);
-        buffer += BOX_NAME_LENGTH;
+        memcpy(box_name, entry, BOX_NAME_LENGTH);
+        entry += BOX_NAME_LENGTH;
+        // With no Boxes, the only entry has an empty name
+        if (box_name[0] == '\0') {
+            fprintf(stdout, "NO BOXES FOUND\n");
+            break;
+        }
 
         uint64_t box_size;
-        memcpy(&box_size, buffer, sizeof(uint64_t));
-        buffer += sizeof(uint64_t);
+        memcpy(&box_size, entry, sizeof(uint64_t));
+        entry += sizeof(uint64_t);
 
         uint64_t n_publishers;
-        memcpy(&n_publishers, buffer, sizeof(uint64_t));
-        buffer += sizeof(uint64_t);
+        memcpy(&n_publishers, entry, sizeof(uint64_t));
+        entry += sizeof(uint64_t);
 
         uint64_t n_subscribers;
-        memcpy(&n_subscribers, buffer, sizeof(uint64_t));
+        memcpy(&n_subscribers, entry, sizeof(uint64_t));
 
-        if (insertionSort(head, box_name, box_size, n_publishers,
+        if (insertionSort(&head, box_name, box_size, n_publishers,
                           n_subscribers) != 0) {
             return -1;
         }
@@ -174,6 +183,7 @@ int list_box_request(int server_pipe, char *session_pipe_name) {
 
     print_list(head);
     destroy_list(head);
+    free(buffer);
     if (close(session_pipe) == -1) {
         return -1;
     }
@@ -181,13 +191,63 @@ int list_box_request(int server_pipe, char *session_pipe_name) {
     return 0;
 }
 
+/*
+ * Parse a retention limit of a Box created: "--max-bytes=<bytes>",
+ * "--max-records=<records>" or "--max-age=<seconds>".
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int parse_retention(char const *option, box_retention_t *retention) {
+    uint64_t *limit;
+    char const *value;
+    if (strncmp(option, "--max-bytes=", 12) == 0) {
+        limit = &retention->br_max_bytes;
+        value = option + 12;
+    } else if (strncmp(option, "--max-records=", 14) == 0) {
+        limit = &retention->br_max_records;
+        value = option + 14;
+    } else if (strncmp(option, "--max-age=", 10) == 0) {
+        limit = &retention->br_max_age;
+        value = option + 10;
+    } else {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+        return -1;
+    }
+    *limit = (uint64_t)parsed;
+    return 0;
+}
+
 int main(int argc, char **argv) {
 
-    if (argc != 5 && argc != 4) {
+    if (argc < 4 || argc > 8) {
         fprintf(stderr,"A wrong number of arguments was passed(%d).\n", argc);
         return -1;
     }
 
+    // Longer names are rejected rather than cut short (naming another Box)
+    if (argc >= 5 && strlen(argv[4]) > BOX_NAME_MAX) {
+        fprintf(stderr,"Box name %s is longer than %zu characters.\n", argv[4],
+                BOX_NAME_MAX);
+        return -1;
+    }
+
+    // A Box created may be given retention limits (0, the default, for none)
+    box_retention_t retention;
+    memset(&retention, 0, sizeof(box_retention_t));
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[3], "create") != 0 ||
+            parse_retention(argv[i], &retention) != 0) {
+            fprintf(stderr,"Unknown option %s.\n", argv[i]);
+            return -1;
+        }
+    }
+
     // Server's Pipe name
     char *server_pipe_name = calloc(PIPE_NAME_LENGTH, sizeof(char));
     memcpy(server_pipe_name, PIPE_PATH, strlen(PIPE_PATH));
@@ -202,7 +262,7 @@ int main(int argc, char **argv) {
     // Request
     char *request = argv[3];
     char *box_name = NULL;
-    if (argc == 5) {
+    if (argc >= 5) {
         // Box's name
         box_name = argv[4];
     }
@@ -231,7 +291,7 @@ int main(int argc, char **argv) {
     // FIXME faltava ! antes do strcmp
     if (!strcmp(request, "create")) {
         if (box_request(server_pipe, session_pipe_name, box_name,
-                        BOX_CREATION_R) != 0) {
+                        BOX_CREATION_R, &retention) != 0) {
             fprintf(stderr,"Unable to create Box.\n");
             free(server_pipe_name);
             free(session_pipe_name);
@@ -239,7 +299,7 @@ int main(int argc, char **argv) {
         }
     } else if (!strcmp(request, "remove")) {
         if (box_request(server_pipe, session_pipe_name, box_name,
-                        BOX_REMOVAL_R) != 0) {
+                        BOX_REMOVAL_R, NULL) != 0) {
             fprintf(stderr,"Unable to remove Box.\n");
             free(server_pipe_name);
             free(session_pipe_name);
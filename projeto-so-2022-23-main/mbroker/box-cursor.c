@@ -0,0 +1,102 @@
+#include "box-cursor.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#define BOX_CURSOR_SCAN (32) // slots read at a time
+
+// Serializes the lookups of cursors, so two Subscribers naming a new cursor
+// at once do not take the same slot for different names
+static pthread_mutex_t cursors_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void box_cursor_name(char const *box_name, char *cursors_name) {
+    size_t length = strnlen(box_name, BOX_NAME_LENGTH);
+    assert(length < BOX_NAME_LENGTH);
+    memcpy(cursors_name, box_name, length);
+    memcpy(cursors_name + length, BOX_CURSOR_SUFFIX,
+           sizeof(BOX_CURSOR_SUFFIX));
+}
+
+/*
+ * Look up a cursor among the slots of a Box's cursors.
+ *
+ * Returns 1 if found (setting *slot and *offset), 0 if not (setting *slot to
+ * the first slot past the last one), -1 if unable to read the slots.
+ */
+static int box_cursor_find(tfs_file_t cursors, char const *name, uint64_t *slot,
+                           uint64_t *offset) {
+    box_cursor_t slots[BOX_CURSOR_SCAN];
+    uint64_t first = 0;
+    while (1) {
+        ssize_t bytes_read = tfs_pread(cursors, slots, sizeof(slots),
+                                       first * sizeof(box_cursor_t));
+        if (bytes_read == -1) {
+            return -1;
+        }
+
+        size_t count = (size_t)bytes_read / sizeof(box_cursor_t);
+        for (size_t i = 0; i < count; i++) {
+            if (strncmp(slots[i].bc_name, name, CURSOR_NAME_LENGTH) == 0) {
+                *slot = first + i;
+                *offset = slots[i].bc_offset;
+                return 1;
+            }
+        }
+
+        first += count;
+        if (count < BOX_CURSOR_SCAN) {
+            *slot = first;
+            return 0;
+        }
+    }
+}
+
+int box_cursor_open(char const *box_name, char const *name,
+                    tfs_file_t *cursors, uint64_t *slot, uint64_t *offset) {
+    char cursors_name[BOX_CURSOR_NAME_LENGTH];
+    box_cursor_name(box_name, cursors_name);
+
+    pthread_mutex_lock(&cursors_lock);
+    int opened = tfs_get_file(cursors_name, cursors);
+    if (opened == -1) {
+        int fhandle = tfs_open(cursors_name, TFS_O_CREAT);
+        if (fhandle == -1 || tfs_close(fhandle) == -1) {
+            pthread_mutex_unlock(&cursors_lock);
+            return -1;
+        }
+        opened = tfs_get_file(cursors_name, cursors);
+    }
+
+    int found = opened == -1 ? -1
+                             : box_cursor_find(*cursors, name, slot, offset);
+    if (found == 0) {
+        box_cursor_t cursor;
+        memset(&cursor, 0, sizeof(box_cursor_t));
+        strncpy(cursor.bc_name, name, CURSOR_NAME_LENGTH - 1);
+        cursor.bc_offset = *offset;
+        if (tfs_pwrite(*cursors, &cursor, sizeof(box_cursor_t),
+                       *slot * sizeof(box_cursor_t)) !=
+            (ssize_t)sizeof(box_cursor_t)) {
+            found = -1;
+        }
+    }
+    pthread_mutex_unlock(&cursors_lock);
+
+    return found == -1 ? -1 : 0;
+}
+
+int box_cursor_save(tfs_file_t cursors, uint64_t slot, uint64_t offset) {
+    ssize_t written =
+        tfs_pwrite(cursors, &offset, sizeof(uint64_t),
+                   slot * sizeof(box_cursor_t) +
+                       offsetof(box_cursor_t, bc_offset));
+    return written == (ssize_t)sizeof(uint64_t) ? 0 : -1;
+}
+
+void box_cursor_unlink(char const *box_name) {
+    char cursors_name[BOX_CURSOR_NAME_LENGTH];
+    box_cursor_name(box_name, cursors_name);
+    tfs_unlink(cursors_name); // there are none until a cursor is named
+}
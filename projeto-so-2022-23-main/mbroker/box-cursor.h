@@ -0,0 +1,43 @@
+#ifndef __MBROKER_BOX_CURSOR_H__
+#define __MBROKER_BOX_CURSOR_H__
+
+#include "../utils/common.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Named cursors of the Subscribers of a Box, kept in the TFS file
+ * "<box>#cur" (created once a Subscriber names a cursor).
+ *
+ * The file is an array of slots, one per name, each holding the offset of the
+ * first record of the Box not yet delivered to the Subscriber of that name.
+ * Slots are never freed, so a cursor stays in the same slot (and is saved
+ * with a single write) for as long as the Box exists.
+ */
+
+#define BOX_CURSOR_SUFFIX "#cur"
+#define BOX_CURSOR_NAME_LENGTH (BOX_NAME_LENGTH + sizeof(BOX_CURSOR_SUFFIX))
+
+typedef struct {
+    char bc_name[CURSOR_NAME_LENGTH];
+    uint64_t bc_offset;
+} box_cursor_t;
+
+// box_cursor_open: find (or add, at offset) the cursor of the given name of a
+// Box, setting *cursors to the Box's cursors, *slot to its slot and *offset to
+// its offset
+//
+// Returns 0 if successful, -1 if unable to open them
+int box_cursor_open(char const *box_name, char const *name,
+                    tfs_file_t *cursors, uint64_t *slot, uint64_t *offset);
+
+// box_cursor_save: save the offset of the cursor in slot
+//
+// Returns 0 if successful, -1 otherwise (including the Box having been
+// removed)
+int box_cursor_save(tfs_file_t cursors, uint64_t slot, uint64_t offset);
+
+// box_cursor_unlink: delete the cursors of a Box (if any)
+void box_cursor_unlink(char const *box_name);
+
+#endif // __MBROKER_BOX_CURSOR_H__
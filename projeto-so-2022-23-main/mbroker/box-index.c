@@ -0,0 +1,45 @@
+#include "box-index.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+void box_index_name(char const *box_name, char *index_name) {
+    size_t length = strnlen(box_name, BOX_NAME_LENGTH);
+    assert(length < BOX_NAME_LENGTH);
+    memcpy(index_name, box_name, length);
+    memcpy(index_name + length, BOX_INDEX_SUFFIX, sizeof(BOX_INDEX_SUFFIX));
+}
+
+int box_index_open(char const *box_name, tfs_file_t *index) {
+    char index_name[BOX_INDEX_NAME_LENGTH];
+    box_index_name(box_name, index_name);
+
+    int fhandle = tfs_open(index_name, TFS_O_CREAT);
+    if (fhandle == -1 || tfs_close(fhandle) == -1) {
+        return -1;
+    }
+    return tfs_get_file(index_name, index);
+}
+
+int box_index_unlink(char const *box_name) {
+    char index_name[BOX_INDEX_NAME_LENGTH];
+    box_index_name(box_name, index_name);
+    return tfs_unlink(index_name);
+}
+
+int box_index_get(tfs_file_t index, uint64_t number,
+                  box_index_entry_t *entry) {
+    ssize_t bytes_read = tfs_pread(index, entry, sizeof(box_index_entry_t),
+                                   number * sizeof(box_index_entry_t));
+    return bytes_read == (ssize_t)sizeof(box_index_entry_t) ? 0 : -1;
+}
+
+int box_index_add(tfs_file_t index, uint64_t seq, uint64_t offset,
+                  uint64_t timestamp) {
+    box_index_entry_t entry = {.bie_offset = offset,
+                               .bie_timestamp = timestamp};
+    ssize_t written =
+        tfs_pwrite(index, &entry, sizeof(box_index_entry_t),
+                   (seq / BOX_INDEX_INTERVAL) * sizeof(box_index_entry_t));
+    return written == (ssize_t)sizeof(box_index_entry_t) ? 0 : -1;
+}
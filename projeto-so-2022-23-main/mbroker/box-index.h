@@ -0,0 +1,59 @@
+#ifndef __MBROKER_BOX_INDEX_H__
+#define __MBROKER_BOX_INDEX_H__
+
+#include "../utils/common.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sparse index of the records of a Box, kept in the TFS file "<box>#idx".
+ *
+ * Entry i holds the offset (in the Box) and timestamp of record
+ * i * BOX_INDEX_INTERVAL, so a record is found by its sequence number with a
+ * single entry read, or by its timestamp with a binary search of the entries,
+ * plus a scan of at most BOX_INDEX_INTERVAL record headers (see
+ * box-segment.h). The Publisher writes the entries of the records it commits
+ * before publishing them, so a Box with n records has its first
+ * ceil(n / BOX_INDEX_INTERVAL) entries; those of records in segments since
+ * dropped are left behind.
+ */
+
+#define BOX_INDEX_INTERVAL (64)
+#define BOX_INDEX_SUFFIX "#idx"
+#define BOX_INDEX_NAME_LENGTH (BOX_NAME_LENGTH + sizeof(BOX_INDEX_SUFFIX))
+
+typedef struct {
+    uint64_t bie_offset;
+    uint64_t bie_timestamp;
+} box_index_entry_t;
+
+// box_index_name: write the name of a Box's index into index_name (of
+// BOX_INDEX_NAME_LENGTH bytes); the Box's name must be whole (shorter than
+// BOX_NAME_LENGTH, as the Server rejects longer ones), so it is never cut
+// short
+void box_index_name(char const *box_name, char *index_name);
+
+// box_index_open: create (if needed) the index of a Box, setting *index to it
+//
+// Returns 0 if successful, -1 if unable to create it
+int box_index_open(char const *box_name, tfs_file_t *index);
+
+// box_index_unlink: delete the index of a Box
+//
+// Returns 0 if successful, -1 otherwise
+int box_index_unlink(char const *box_name);
+
+// box_index_add: add the entry of record seq (a multiple of
+// BOX_INDEX_INTERVAL), at offset of the Box's file
+//
+// Returns 0 if successful, -1 otherwise
+int box_index_add(tfs_file_t index, uint64_t seq, uint64_t offset,
+                  uint64_t timestamp);
+
+// box_index_get: read entry number of an index
+//
+// Returns 0 if successful, -1 if there is no such entry (yet)
+int box_index_get(tfs_file_t index, uint64_t number,
+                  box_index_entry_t *entry);
+
+#endif // __MBROKER_BOX_INDEX_H__
@@ -0,0 +1,362 @@
+#include "box-segment.h"
+#include "../fs/operations.h"
+#include "box-index.h"
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void box_segment_name(char const *box_name, uint64_t number, char *name) {
+    assert(strnlen(box_name, BOX_NAME_LENGTH) < BOX_NAME_LENGTH);
+    snprintf(name, BOX_SEGMENT_NAME_LENGTH, "%s%s%" PRIu64, box_name,
+             BOX_SEGMENT_SUFFIX, number);
+}
+
+int box_segment_parse(char const *name, char *box_name, uint64_t *number) {
+    // Boxes' names do not hold the mark, so the first one starts the suffix
+    char const *mark = strchr(name, BOX_FILE_MARK);
+    if (mark == NULL || (size_t)(mark - name) >= BOX_NAME_LENGTH ||
+        strncmp(mark, BOX_SEGMENT_SUFFIX, strlen(BOX_SEGMENT_SUFFIX)) != 0) {
+        return -1;
+    }
+
+    char const *digits = mark + strlen(BOX_SEGMENT_SUFFIX);
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(digits, &end, 10);
+    if (errno != 0 || end == digits || *end != '\0' || digits[0] == '-') {
+        return -1;
+    }
+
+    memset(box_name, 0, BOX_NAME_LENGTH);
+    memcpy(box_name, name, (size_t)(mark - name));
+    *number = (uint64_t)parsed;
+    return 0;
+}
+
+int box_segment_create(char const *box_name, uint64_t number,
+                       uint64_t first_seq, uint64_t created) {
+    char name[BOX_SEGMENT_NAME_LENGTH];
+    box_segment_name(box_name, number, name);
+
+    int fhandle = tfs_open(name, TFS_O_CREAT | TFS_O_APPEND);
+    if (fhandle == -1) {
+        return -1;
+    }
+
+    box_segment_header_t header = {.bsh_first_seq = first_seq,
+                                   .bsh_created = created};
+    if (tfs_write(fhandle, &header, BOX_SEGMENT_HEADER_LENGTH) !=
+        (ssize_t)BOX_SEGMENT_HEADER_LENGTH) {
+        tfs_close(fhandle);
+        tfs_unlink(name);
+        return -1;
+    }
+    return fhandle;
+}
+
+int box_segment_open(char const *box_name, uint64_t number) {
+    char name[BOX_SEGMENT_NAME_LENGTH];
+    box_segment_name(box_name, number, name);
+    return tfs_open(name, TFS_O_APPEND);
+}
+
+int box_segment_unlink(char const *box_name, uint64_t number) {
+    char name[BOX_SEGMENT_NAME_LENGTH];
+    box_segment_name(box_name, number, name);
+    return tfs_unlink(name);
+}
+
+void box_segment_reader_init(box_segment_reader_t *reader,
+                             char const *box_name) {
+    memcpy(reader->bsr_box_name, box_name, BOX_NAME_LENGTH);
+    reader->bsr_number = 0;
+    reader->bsr_file.tf_inumber = -1;
+}
+
+ssize_t box_segment_pread(box_segment_reader_t *reader, void *buffer,
+                          size_t len, uint64_t offset) {
+    uint64_t number = offset / BOX_SEGMENT_SIZE;
+    if (reader->bsr_file.tf_inumber == -1 || reader->bsr_number != number) {
+        char name[BOX_SEGMENT_NAME_LENGTH];
+        box_segment_name(reader->bsr_box_name, number, name);
+        reader->bsr_number = number;
+        if (tfs_get_file(name, &reader->bsr_file) == -1) {
+            reader->bsr_file.tf_inumber = -1;
+            return -1;
+        }
+    }
+
+    ssize_t bytes_read = tfs_pread(reader->bsr_file, buffer, len,
+                                   offset % BOX_SEGMENT_SIZE);
+    if (bytes_read == -1) {
+        reader->bsr_file.tf_inumber = -1; // dropped
+    }
+    return bytes_read;
+}
+
+uint64_t box_segment_start(struct Box *box) {
+    return box->box_segment_first * BOX_SEGMENT_SIZE +
+           BOX_SEGMENT_HEADER_LENGTH;
+}
+
+/*
+ * Whether the oldest segment of a Box (which has more than one) is beyond
+ * its retention. Every record of a segment is older than the next segment.
+ *
+ * The caller must hold box_lock.
+ */
+static bool box_segment_expired(struct Box *box, uint64_t now) {
+    box_retention_t const *retention = &box->box_retention;
+    box_segment_t *oldest = box_segment_get(box, box->box_segment_first);
+    box_segment_t *next = box_segment_get(box, box->box_segment_first + 1);
+
+    if (retention->br_max_bytes != 0 &&
+        box->box_size > retention->br_max_bytes) {
+        return true;
+    }
+    if (retention->br_max_records != 0 &&
+        box->box_ring_next - oldest->bs_first_seq >
+            retention->br_max_records) {
+        return true;
+    }
+    return retention->br_max_age != 0 &&
+           retention->br_max_age < now / 1000000000u &&
+           next->bs_created <= now - retention->br_max_age * 1000000000u;
+}
+
+/*
+ * Drop the oldest segment of a Box (which has more than one): from the Box,
+ * so it is no longer read, and then from TFS.
+ *
+ * The caller must hold box_lock, which is released.
+ */
+static void box_segment_drop_locked(struct Box *box) {
+    uint64_t number = box->box_segment_first;
+    box_segment_pop(box);
+    pthread_mutex_unlock(&box->box_lock);
+
+    if (box_segment_unlink(box->box_name, number) != 0) {
+        fprintf(stderr,"Unable to unlink segment of Box %s.\n", box->box_name);
+    }
+}
+
+int box_segment_drop(struct Box *box) {
+    pthread_mutex_lock(&box->box_lock);
+    if (box->box_segment_count <= 1 || box->removed) {
+        pthread_mutex_unlock(&box->box_lock);
+        return -1;
+    }
+    box_segment_drop_locked(box);
+    return 0;
+}
+
+void box_segment_retain(struct Box *box, uint64_t now) {
+    while (true) {
+        pthread_mutex_lock(&box->box_lock);
+        if (box->box_segment_count <= 1 || box->removed ||
+            !box_segment_expired(box, now)) {
+            pthread_mutex_unlock(&box->box_lock);
+            return;
+        }
+        box_segment_drop_locked(box);
+    }
+}
+
+/*
+ * Read the header of the record at offset of a Box.
+ *
+ * Returns 0 if there is a whole record there (ending at most at end, in the
+ * same segment), -1 otherwise.
+ */
+static int record_at(box_segment_reader_t *reader, uint64_t offset,
+                     uint64_t end, box_record_t *record) {
+    if (end < offset || end - offset < BOX_RECORD_HEADER_LENGTH ||
+        box_segment_pread(reader, record, BOX_RECORD_HEADER_LENGTH, offset) !=
+            (ssize_t)BOX_RECORD_HEADER_LENGTH ||
+        record->br_length >= MESSAGE_SIZE ||
+        end - offset - BOX_RECORD_HEADER_LENGTH < record->br_length) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the header of the record at *offset of a Box (before end), moving
+ * *offset to the next segment once past the records of one.
+ *
+ * Returns 0 if there is a record, -1 otherwise (including its segment having
+ * been dropped).
+ */
+static int next_record(struct Box *box, box_segment_reader_t *reader,
+                       uint64_t *offset, uint64_t end, box_record_t *record) {
+    while (*offset < end) {
+        uint64_t number = *offset / BOX_SEGMENT_SIZE;
+        pthread_mutex_lock(&box->box_lock);
+        box_segment_t *segment = box_segment_get(box, number);
+        uint64_t records_end = segment == NULL
+                                   ? 0
+                                   : number * BOX_SEGMENT_SIZE +
+                                         BOX_SEGMENT_HEADER_LENGTH +
+                                         segment->bs_used;
+        pthread_mutex_unlock(&box->box_lock);
+
+        if (segment == NULL) {
+            return -1;
+        }
+        if (*offset >= records_end) {
+            *offset = (number + 1) * BOX_SEGMENT_SIZE +
+                      BOX_SEGMENT_HEADER_LENGTH;
+            continue;
+        }
+        return record_at(reader, *offset, records_end < end ? records_end : end,
+                         record);
+    }
+    return -1;
+}
+
+void box_segment_restore(box_segment_reader_t *reader, tfs_file_t index,
+                         uint64_t number, size_t size, uint64_t *seq,
+                         box_segment_t *segment) {
+    uint64_t offset = number * BOX_SEGMENT_SIZE;
+    uint64_t end = offset + size;
+
+    // A segment cut short before its header was written has no records
+    box_segment_header_t header;
+    segment->bs_number = number;
+    segment->bs_used = 0;
+    segment->bs_first_seq = *seq;
+    segment->bs_created = 0;
+    if (box_segment_pread(reader, &header, BOX_SEGMENT_HEADER_LENGTH,
+                          offset) != (ssize_t)BOX_SEGMENT_HEADER_LENGTH) {
+        return;
+    }
+    segment->bs_first_seq = header.bsh_first_seq;
+    segment->bs_created = header.bsh_created;
+    offset += BOX_SEGMENT_HEADER_LENGTH;
+    uint64_t records = header.bsh_first_seq;
+
+    // Resume from the last entry of the index of a record that made it into
+    // the segment (the last records written may have been lost)
+    uint64_t next_entry =
+        (records + BOX_INDEX_INTERVAL - 1) / BOX_INDEX_INTERVAL;
+    box_index_entry_t entry;
+    box_record_t record;
+    while (box_index_get(index, next_entry, &entry) == 0 &&
+           entry.bie_offset >= offset &&
+           record_at(reader, entry.bie_offset, end, &record) == 0 &&
+           record.br_seq == next_entry * BOX_INDEX_INTERVAL) {
+        offset = entry.bie_offset;
+        records = record.br_seq;
+        next_entry++;
+    }
+
+    while (record_at(reader, offset, end, &record) == 0 &&
+           record.br_seq == records) {
+        if (records % BOX_INDEX_INTERVAL == 0 &&
+            records / BOX_INDEX_INTERVAL >= next_entry) {
+            box_index_add(index, records, offset, record.br_timestamp);
+        }
+        offset += BOX_RECORD_HEADER_LENGTH + record.br_length;
+        records++;
+    }
+
+    segment->bs_used =
+        offset - number * BOX_SEGMENT_SIZE - BOX_SEGMENT_HEADER_LENGTH;
+    *seq = records;
+}
+
+uint64_t box_segment_seek_seq(struct Box *box, box_segment_reader_t *reader,
+                              uint64_t seq) {
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t start = box_segment_start(box);
+    uint64_t first = box_segment_get(box, box->box_segment_first)->bs_first_seq;
+    uint64_t records = box->box_ring_next;
+    uint64_t end = box->box_end;
+    pthread_mutex_unlock(&box->box_lock);
+
+    if (seq >= records) {
+        return end;
+    }
+    if (seq <= first) {
+        return start;
+    }
+
+    // From the closest entry before it (or the first record retained, if
+    // unavailable)
+    uint64_t offset = start;
+    uint64_t current = first;
+    box_index_entry_t entry;
+    box_record_t record;
+    if (box_index_get(box->box_index, seq / BOX_INDEX_INTERVAL, &entry) == 0 &&
+        entry.bie_offset >= start) {
+        uint64_t entry_offset = entry.bie_offset;
+        if (next_record(box, reader, &entry_offset, end, &record) == 0 &&
+            record.br_seq == seq - seq % BOX_INDEX_INTERVAL) {
+            offset = entry_offset;
+            current = record.br_seq;
+        }
+    }
+
+    while (current < seq) {
+        if (next_record(box, reader, &offset, end, &record) != 0) {
+            return end;
+        }
+        offset += BOX_RECORD_HEADER_LENGTH + record.br_length;
+        current++;
+    }
+
+    // The record may be the first of the next segment
+    if (next_record(box, reader, &offset, end, &record) != 0) {
+        return end;
+    }
+    return offset;
+}
+
+uint64_t box_segment_seek_time(struct Box *box, box_segment_reader_t *reader,
+                               uint64_t timestamp) {
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t start = box_segment_start(box);
+    uint64_t first = box_segment_get(box, box->box_segment_first)->bs_first_seq;
+    uint64_t records = box->box_ring_next;
+    uint64_t end = box->box_end;
+    pthread_mutex_unlock(&box->box_lock);
+
+    // Find the first entry (of a record retained) published at or after
+    // timestamp
+    uint64_t first_entry =
+        (first + BOX_INDEX_INTERVAL - 1) / BOX_INDEX_INTERVAL;
+    uint64_t low = first_entry;
+    uint64_t high = (records + BOX_INDEX_INTERVAL - 1) / BOX_INDEX_INTERVAL;
+    box_index_entry_t entry;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (box_index_get(box->box_index, middle, &entry) == 0 &&
+            entry.bie_timestamp < timestamp) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    // The record is among those following the entry before it
+    uint64_t offset = start;
+    if (low > first_entry &&
+        box_index_get(box->box_index, low - 1, &entry) == 0 &&
+        entry.bie_offset >= start) {
+        offset = entry.bie_offset;
+    }
+
+    box_record_t record;
+    while (next_record(box, reader, &offset, end, &record) == 0) {
+        if (record.br_timestamp >= timestamp) {
+            return offset;
+        }
+        offset += BOX_RECORD_HEADER_LENGTH + record.br_length;
+    }
+    return end;
+}
@@ -0,0 +1,115 @@
+#ifndef __MBROKER_BOX_SEGMENT_H__
+#define __MBROKER_BOX_SEGMENT_H__
+
+#include "../utils/common.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Segments of a Box, kept in the TFS files "<box>#s<number>".
+ *
+ * A Box's records are appended to its last segment; once the next record
+ * does not fit in BOX_SEGMENT_SIZE bytes (or TFS runs out of space), the
+ * Publisher rolls to a new segment. The oldest segments are dropped, whole,
+ * with a single unlink: once the Box's retention is exceeded, or to make room
+ * for the new segment when TFS is full. The Box's file itself holds its
+ * retention.
+ *
+ * An offset of a Box is in segment offset / BOX_SEGMENT_SIZE, so offsets
+ * (kept by the index, cursors and Subscribers) stay valid as segments are
+ * added and dropped. A segment is never filled up to BOX_SEGMENT_SIZE, so the
+ * offset past its records is still in it.
+ */
+
+#define BOX_SEGMENT_SUFFIX "#s"
+#define BOX_SEGMENT_NAME_LENGTH                                                \
+    (BOX_NAME_LENGTH + sizeof(BOX_SEGMENT_SUFFIX) + 20)
+
+// Reads the segments of a Box, looking up each one's inumber once
+typedef struct {
+    char bsr_box_name[BOX_NAME_LENGTH];
+    uint64_t bsr_number;
+    tfs_file_t bsr_file; // segment bsr_number (tf_inumber -1 if not found)
+} box_segment_reader_t;
+
+// box_segment_name: write the name of segment number of a Box into name (of
+// BOX_SEGMENT_NAME_LENGTH bytes); the Box's name must be whole, as for
+// box_index_name
+void box_segment_name(char const *box_name, uint64_t number, char *name);
+
+// box_segment_parse: find the Box (a name of BOX_NAME_LENGTH bytes) and
+// number of a segment from its name
+//
+// Returns 0 if successful, -1 if name is not a segment's
+int box_segment_parse(char const *name, char *box_name, uint64_t *number);
+
+// box_segment_create: create segment number of a Box, starting with record
+// first_seq, and open it for appending
+//
+// Returns the file handle, or -1 if unable to create it (e.g., TFS is full)
+int box_segment_create(char const *box_name, uint64_t number,
+                       uint64_t first_seq, uint64_t created);
+
+// box_segment_open: open segment number of a Box for appending
+//
+// Returns the file handle, or -1 if unable to open it
+int box_segment_open(char const *box_name, uint64_t number);
+
+// box_segment_unlink: delete segment number of a Box
+//
+// Returns 0 if successful, -1 otherwise
+int box_segment_unlink(char const *box_name, uint64_t number);
+
+// box_segment_reader_init: prepare a reader of the segments of a Box
+void box_segment_reader_init(box_segment_reader_t *reader,
+                             char const *box_name);
+
+// box_segment_pread: read the segment holding offset of a Box, from offset
+//
+// Returns the number of bytes read (stopping at the end of the segment), or
+// -1 if the segment does not exist
+ssize_t box_segment_pread(box_segment_reader_t *reader, void *buffer,
+                          size_t len, uint64_t offset);
+
+// box_segment_start: offset of the first record retained by a Box (the
+// caller must hold box_lock)
+uint64_t box_segment_start(struct Box *box);
+
+// box_segment_drop: drop the oldest segment of a Box, unless it is the last
+// (or the Box was removed, which deletes its segments itself)
+//
+// Returns 0 if successful, -1 if there is only one segment (or none left)
+int box_segment_drop(struct Box *box);
+
+// box_segment_retain: drop the oldest segments of a Box while its retention
+// is exceeded (at time now, in ns since the Epoch)
+void box_segment_retain(struct Box *box, uint64_t now);
+
+// box_segment_restore: find the whole records of segment number of a Box, a
+// file of the given size, adding the entries missing from the Box's index
+//
+// *seq is the number of the segment's first record, unless its header says
+// otherwise; on return it is the number of the record following the
+// segment's
+void box_segment_restore(box_segment_reader_t *reader, tfs_file_t index,
+                         uint64_t number, size_t size, uint64_t *seq,
+                         box_segment_t *segment);
+
+// box_segment_seek_seq: find record seq of a Box (or its first record, if
+// already dropped)
+//
+// Returns the offset of the record, or box_end if there is no such record
+// (yet)
+uint64_t box_segment_seek_seq(struct Box *box, box_segment_reader_t *reader,
+                              uint64_t seq);
+
+// box_segment_seek_time: find the first record of a Box published at or
+// after timestamp
+//
+// Returns the offset of the record, or box_end if there is no such record
+// (yet)
+uint64_t box_segment_seek_time(struct Box *box, box_segment_reader_t *reader,
+                               uint64_t timestamp);
+
+#endif // __MBROKER_BOX_SEGMENT_H__
@@ -1,180 +1,891 @@
 #include "../fs/operations.h"
-#include "../producer-consumer/producer-consumer.h"
 #include "../utils/common.h"
+#include "../utils/frame-pool.h"
+#include "../utils/scheduler.h"
+#include "box-cursor.h"
+#include "box-index.h"
+#include "box-segment.h"
 #include "logging.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-Client_Info *register_client(void *buffer, int session_pipe) {
+/*
+ * A Publisher's or Subscriber's session, run by the scheduler as a state
+ * machine: every run does what it can without blocking (at most
+ * SESSION_ROUNDS rounds of it) and then waits for the Session's Pipe to be
+ * ready (through epoll) or for the Box to grow. It is a FRAME_SESSION frame.
+ */
+typedef struct {
+    task_t s_task; // first, so the task is the session
+    scheduler_t *s_scheduler;
+    uint8_t s_op_code;
+    Client_Info s_info;
+    struct Box *s_box;
+    char *s_buffer; // FRAME_MESSAGE, of SESSION_BUFFER_SIZE bytes
+
+    // Publisher: the Box's last segment, the frames read from the Pipe and
+    // the messages received since the last commit
+    int s_fd;
+    frame_reader_t s_reader;
+    box_message_t *s_batch[PUB_COMMIT_BATCH];
+    size_t s_batch_count;
+
+    // Subscriber: the Box's segments, the offset of the Box up to which it
+    // was sent or read into s_buffer, the bytes of s_buffer not yet sent
+    // (records, the last of which may not have been read whole) and the
+    // number of the next message to take from the ring
+    box_segment_reader_t s_segments;
+    uint64_t s_box_offset;
+    size_t s_pending;
+    uint64_t s_ring_seq;
+    box_waiter_t s_waiter;
+
+    // Subscriber: its named cursor (s_cursors' tf_inumber is -1 without one),
+    // the offset of the first record not yet delivered and the messages
+    // delivered since the cursor was last saved
+    tfs_file_t s_cursors;
+    uint64_t s_cursor_slot;
+    uint64_t s_delivered;
+    size_t s_unsaved;
+
+    // Subscriber: frames queued to the Pipe but not yet written
+    // (s_iov[s_iov_first..s_iov_count)), pointing into the ring messages held
+    // or into the first s_consumed bytes of s_buffer
+    struct iovec s_iov[2 * SUB_RING_BATCH];
+    size_t s_iov_first;
+    size_t s_iov_count;
+    box_message_t *s_held[SUB_RING_BATCH];
+    size_t s_held_count;
+    char s_headers[SUB_RING_BATCH][FRAME_HEADER_LENGTH];
+    size_t s_consumed;
+    size_t s_sending; // messages queued
+} session_t;
+
+_Static_assert(sizeof(session_t) <= SESSION_FRAME_SIZE,
+               "a session does not fit in its frame");
+
+/*
+ * Whether a name field of a request (of length bytes) holds a whole name,
+ * its '\0' included: longer names are rejected rather than cut short, as the
+ * name cut short (and the names of the files derived from it) would be
+ * another's.
+ */
+static bool name_fits(void const *field, size_t length) {
+    return memchr(field, '\0', length) != NULL;
+}
 
-    char box_name[BOX_NAME_LENGTH];
-    memset(box_name, 0, BOX_NAME_LENGTH);
-    memcpy(box_name, buffer, BOX_NAME_LENGTH);
+/*
+ * Read a client's registration.
+ *
+ * Returns 0 if successful, -1 if the Box's name is too long.
+ */
+int register_client(Client_Info *info, void *buffer, int session_pipe) {
+    memset(info, 0, sizeof(Client_Info));
+    if (!name_fits(buffer, BOX_NAME_LENGTH)) {
+        fprintf(stderr,"Box name too long.\n");
+        return -1;
+    }
+    memcpy(info->box_name, buffer, BOX_NAME_LENGTH);
+    info->session_pipe = session_pipe;
+    return 0;
+}
 
-    Client_Info *info = calloc(1, sizeof(Client_Info));
-    if (info == NULL) {
-        fprintf(stderr,"Unable to alloc memory to create Client.\n");
-        return NULL;
+/*
+ * Read where a Subscriber's registration starts reading the Box.
+ *
+ * Returns 0 if successful, -1 if the cursor's name is too long.
+ */
+static int register_start(Client_Info *info, void *buffer) {
+    void *cursor_name = buffer + UINT8_T_SIZE + sizeof(uint64_t);
+    if (!name_fits(cursor_name, CURSOR_NAME_LENGTH)) {
+        fprintf(stderr,"Cursor name too long.\n");
+        return -1;
     }
+    memcpy(&info->start_kind, buffer, UINT8_T_SIZE);
+    memcpy(&info->start_value, buffer + UINT8_T_SIZE, sizeof(uint64_t));
+    memcpy(info->cursor_name, cursor_name, CURSOR_NAME_LENGTH);
+    return 0;
+}
 
-    strncpy(info->box_name, box_name, BOX_NAME_LENGTH);
-    info->session_pipe = session_pipe;
+static void publisher_leave(struct Box *box) {
+    pthread_mutex_lock(&box->box_lock);
+    box->n_publishers--;
+    pthread_mutex_unlock(&box->box_lock);
+    putBox(box);
+}
 
-    return info;
+static void subscriber_leave(struct Box *box, box_waiter_t *waiter) {
+    pthread_mutex_lock(&box->box_lock);
+    box->n_subscribers--;
+    if (waiter != NULL) {
+        box_unwait(box, waiter);
+    }
+    pthread_mutex_unlock(&box->box_lock);
+    putBox(box);
 }
 
-int publisher(Client_Info *info, struct Box *head) {
-    void *message = calloc(MESSAGE_SIZE + UINT8_T_SIZE, sizeof(char));
-    if (message == NULL) {
-        fprintf(stderr,"Unable to alloc memory to read Publisher's message.\n");
-        return -1;
+/*
+ * Write records into the last segment of a Box with a single TFS call and
+ * publish them: once they are in the TFS write-ahead log (if any), so
+ * Subscribers never see messages a crash could lose, add them to the Box's
+ * index and ring and wake up the Subscribers. segment is the caller's copy of
+ * the last segment.
+ *
+ * Returns the number of records published: fewer than count if TFS ran out of
+ * space (which may cut the last record written short). Sets *result to -1 if
+ * they could not be made durable or indexed (the whole records written are
+ * published anyway, as they are in the segment).
+ */
+static size_t publish_records(session_t *session, box_segment_t *segment,
+                              box_message_t **batch, size_t count,
+                              int *result) {
+    assert(count > 0 && count <= PUB_COMMIT_BATCH);
+    struct Box *box = session->s_box;
+    struct iovec iov[2 * PUB_COMMIT_BATCH];
+    for (size_t i = 0; i < count; i++) {
+        iov[2 * i].iov_base = &batch[i]->bm_record;
+        iov[2 * i].iov_len = BOX_RECORD_HEADER_LENGTH;
+        iov[2 * i + 1].iov_base = batch[i]->bm_frame + FRAME_HEADER_LENGTH;
+        iov[2 * i + 1].iov_len = batch[i]->bm_record.br_length;
     }
 
-    struct Box *box = getBox(head, info->box_name);
-    if (box == NULL) {
-        fprintf(stderr,"Box not found.\n");
-        return -1;
+    ssize_t written = tfs_writev(session->s_fd, iov, (int)(2 * count));
+    if (written == -1) {
+        written = 0; // no space
+    } else if (tfs_fsync(session->s_fd) != 0) {
+        fprintf(stderr,"Unable to commit messages into Box.\n");
+        *result = -1;
     }
 
-    if (box->n_publishers != 0) {
-        return -1;
+    uint64_t base = segment->bs_number * BOX_SEGMENT_SIZE +
+                    BOX_SEGMENT_HEADER_LENGTH + segment->bs_used;
+    size_t whole = 0;
+    uint64_t offset = 0;
+    while (whole < count &&
+           offset + batch[whole]->bm_length <= (uint64_t)written) {
+        batch[whole]->bm_offset = base + offset;
+        offset += batch[whole]->bm_length;
+        whole++;
     }
 
-    box->n_publishers++;
+    // Index the records before they are published, so seeks always find the
+    // entries of published records (dropping the oldest segments while TFS
+    // has no room for the entries)
+    for (size_t i = 0; i < whole; i++) {
+        box_record_t const *record = &batch[i]->bm_record;
+        if (record->br_seq % BOX_INDEX_INTERVAL != 0) {
+            continue;
+        }
+        while (box_index_add(box->box_index, record->br_seq,
+                             batch[i]->bm_offset, record->br_timestamp) != 0) {
+            if (box_segment_drop(box) != 0) {
+                fprintf(stderr,"Unable to index messages of Box.\n");
+                *result = -1;
+                break;
+            }
+        }
+    }
 
-    int fd = tfs_open(info->box_name, TFS_O_APPEND);
-    if (fd == -1) {
-        fprintf(stderr,"Unable to open TFS file.\n");
-        box->n_publishers--;
-        free(message);
+    pthread_mutex_lock(&box->box_lock);
+    for (size_t i = 0; i < whole; i++) {
+        box_ring_push(box, batch[i]);
+    }
+    box_segment_last(box)->bs_used += offset;
+    box->box_size += offset;
+    box->box_end = base + offset;
+    box_wake_all(box);
+    pthread_mutex_unlock(&box->box_lock);
+
+    segment->bs_used += offset;
+    return whole;
+}
+
+/*
+ * Start the next segment of a Box, where its Publisher goes on writing from
+ * record seq, dropping the oldest segments while TFS has no room for it.
+ * segment is the caller's copy of the last segment.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int publisher_roll(session_t *session, box_segment_t *segment,
+                          uint64_t seq, uint64_t timestamp) {
+    struct Box *box = session->s_box;
+    box_segment_t next = {.bs_number = segment->bs_number + 1,
+                          .bs_used = 0,
+                          .bs_first_seq = seq,
+                          .bs_created = timestamp};
+
+    int fd;
+    while ((fd = box_segment_create(box->box_name, next.bs_number, seq,
+                                    timestamp)) == -1) {
+        if (box_segment_drop(box) != 0) {
+            return -1;
+        }
+    }
+
+    // A Box removed meanwhile has had its segments deleted
+    pthread_mutex_lock(&box->box_lock);
+    int pushed = box->removed ? -1 : box_segment_push(box, &next);
+    pthread_mutex_unlock(&box->box_lock);
+    if (pushed != 0) {
+        tfs_close(fd);
+        box_segment_unlink(box->box_name, next.bs_number);
         return -1;
     }
 
-    uint64_t bytes_written;
+    tfs_close(session->s_fd);
+    session->s_fd = fd;
+    *segment = next;
+    return 0;
+}
 
-    while (TRUE) {
-        if (read(info->session_pipe, message, MESSAGE_SIZE + UINT8_T_SIZE) <=
-            0) {
-            fprintf(stderr,"Error reading message from Publisher's Pipe.\n");
-            box->n_publishers--;
-            free(message);
-            tfs_close(fd);
-            return -1;
+/*
+ * Publish a Publisher's batch of messages into its Box, as records, rolling
+ * over to new segments as needed, and then drop the segments beyond the
+ * Box's retention. The messages are released (or handed over to the ring).
+ *
+ * Returns 0 if successful, -1 if the messages could not all be published.
+ */
+static int publish_batch(session_t *session) {
+    struct Box *box = session->s_box;
+    box_message_t **batch = session->s_batch;
+    size_t count = session->s_batch_count;
+
+    // The Box's only Publisher numbers its records (and appends them)
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t seq = box->box_ring_next;
+    box_segment_t segment = *box_segment_last(box);
+    pthread_mutex_unlock(&box->box_lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp =
+        (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    for (size_t i = 0; i < count; i++) {
+        batch[i]->bm_record.br_seq = seq + i;
+        batch[i]->bm_record.br_timestamp = timestamp;
+    }
+
+    int result = 0;
+    size_t done = 0;
+    while (done < count) {
+        // A Box removed meanwhile has had its files deleted, and their inodes
+        // may be another Box's by now (writes racing with the removal fail,
+        // as the files' handles no longer reach them), so its Publisher's
+        // session ends
+        pthread_mutex_lock(&box->box_lock);
+        int removed = box->removed;
+        pthread_mutex_unlock(&box->box_lock);
+        if (removed) {
+            fprintf(stderr,"Box %s removed, not publishing.\n", box->box_name);
+            result = -1;
+            break;
         }
-        message += UINT8_T_SIZE;
-        if ((bytes_written =
-                 (uint64_t)tfs_write(fd, message, strlen(message) + 1)) == -1) {
-            fprintf(stderr,"Error writing message into Box.\n");
-            box->n_publishers--;
-            free(message);
-            tfs_close(fd);
-            return -1;
+
+        // The records that fit in the segment (leaving at least a byte, so
+        // the offset past its records is never the next segment's first)
+        size_t fit = 0;
+        uint64_t used = BOX_SEGMENT_HEADER_LENGTH + segment.bs_used;
+        while (done + fit < count &&
+               used + batch[done + fit]->bm_length < BOX_SEGMENT_SIZE) {
+            used += batch[done + fit]->bm_length;
+            fit++;
         }
-        box->box_size += bytes_written;
-        if (bytes_written != strlen(message) + 1) {
+
+        if (fit > 0) {
+            size_t published = publish_records(session, &segment, batch + done,
+                                               fit, &result);
+            done += published;
+            if (result == -1) {
+                break;
+            }
+            if (published == fit) {
+                continue;
+            }
+        }
+
+        // Roll over once the segment is full, or once TFS has no more room
+        // for it (after making room by dropping the oldest segment)
+        if ((fit > 0 && box_segment_drop(box) != 0) ||
+            publisher_roll(session, &segment, seq + done, timestamp) != 0) {
             fprintf(stderr,"Unable to write whole message, Box full.\n");
+            result = -1;
+            break;
         }
     }
 
-    box->n_publishers--;
-    free(message);
-    tfs_close(fd);
-    return 0;
+    for (size_t i = done; i < count; i++) {
+        box_message_put(batch[i]);
+    }
+
+    box_segment_retain(box, timestamp);
+    return result;
 }
 
-int subscriber(Client_Info *info, struct Box *head) {
-    void *message = calloc(MESSAGE_SIZE + UINT8_T_SIZE, sizeof(char));
-    if (message == NULL) {
-        fprintf(stderr,"Unable to alloc memory to read from Box.\n");
+static void session_wake(void *arg) {
+    session_t *session = arg;
+    scheduler_wake(session->s_scheduler, &session->s_task);
+}
+
+static session_t *session_create(scheduler_t *scheduler, uint8_t op_code,
+                                 Client_Info *info, struct Box *box,
+                                 task_status_t (*run)(task_t *task)) {
+    session_t *session = frame_get(FRAME_SESSION);
+    if (session == NULL) {
+        return NULL;
+    }
+    memset(session, 0, sizeof(session_t));
+
+    session->s_buffer = frame_get(FRAME_MESSAGE);
+    if (session->s_buffer == NULL) {
+        frame_put(FRAME_SESSION, session);
+        return NULL;
+    }
+
+    scheduler_task_init(&session->s_task, run);
+    session->s_scheduler = scheduler;
+    session->s_op_code = op_code;
+    session->s_info = *info;
+    session->s_box = box;
+    session->s_fd = -1;
+    session->s_cursors.tf_inumber = -1;
+    session->s_waiter.bw_wake = session_wake;
+    session->s_waiter.bw_arg = session;
+    return session;
+}
+
+/*
+ * Save a Subscriber's cursor (if it has one), once at least batch messages
+ * were delivered since it was last saved.
+ *
+ * Returns 0 if successful (or not needed), -1 otherwise.
+ */
+static int subscriber_save(session_t *session, size_t batch) {
+    if (session->s_cursors.tf_inumber == -1 || session->s_unsaved == 0 ||
+        session->s_unsaved < batch) {
+        return 0;
+    }
+    if (box_cursor_save(session->s_cursors, session->s_cursor_slot,
+                        session->s_delivered) != 0) {
+        fprintf(stderr,"Unable to save Subscriber's cursor.\n");
         return -1;
     }
+    session->s_unsaved = 0;
+    return 0;
+}
 
-    struct Box *box = getBox(head, info->box_name);
+/*
+ * End a session: publish what the Publisher sent (or save where the
+ * Subscriber is), leave the Box, close the Session's Pipe and free the
+ * session.
+ */
+static task_status_t session_end(session_t *session, int result) {
+    if (session->s_op_code == PUB_REGISTER) {
+        // What was received must be published, even if the session failed
+        if (session->s_batch_count > 0 && publish_batch(session) != 0) {
+            result = -1;
+        }
+        publisher_leave(session->s_box);
+        tfs_close(session->s_fd);
+    } else {
+        subscriber_save(session, 1);
+        subscriber_leave(session->s_box, &session->s_waiter);
+        for (size_t i = 0; i < session->s_held_count; i++) {
+            box_message_put(session->s_held[i]);
+        }
+    }
+
+    if (result == -1) {
+        fprintf(stderr, session->s_op_code == PUB_REGISTER
+                            ? "Publisher unable to write.\n"
+                            : "Subscriber unable to read.\n");
+    }
+
+    scheduler_unwatch(session->s_scheduler, session->s_info.session_pipe);
+    close(session->s_info.session_pipe);
+    frame_put(FRAME_MESSAGE, session->s_buffer);
+    frame_put(FRAME_SESSION, session);
+    return TASK_DONE;
+}
+
+/*
+ * Wait (parked) until the Session's Pipe is ready for events.
+ */
+static task_status_t session_watch(session_t *session, uint32_t events) {
+    if (scheduler_watch(session->s_scheduler, &session->s_task,
+                        session->s_info.session_pipe, events) != 0) {
+        fprintf(stderr,"Unable to wait for Session's Pipe.\n");
+        return session_end(session, -1);
+    }
+    return TASK_WAIT;
+}
+
+static task_status_t publisher_run(task_t *task) {
+    session_t *session = (session_t *)task;
+
+    for (size_t round = 0; round < SESSION_ROUNDS; round++) {
+        uint8_t code;
+        char *received;
+        uint32_t received_length;
+        errno = 0;
+        int status = frame_reader_next(&session->s_reader, &code, &received,
+                                       &received_length);
+        if (status == -1 && errno == EAGAIN) {
+            // Nothing more to read for now (the batch was committed once the
+            // reader ran out of frames)
+            return session_watch(session, EPOLLIN);
+        }
+        if (status == 0) {
+            return session_end(session, 0); // Publisher closed its Pipe
+        }
+        if (status == -1 || code != PUB_2_SERVER ||
+            received_length >= MESSAGE_SIZE) {
+            fprintf(stderr,"Error reading message from Publisher's Pipe.\n");
+            return session_end(session, -1);
+        }
+
+        // Each message is copied into its own buffer, which is then handed over
+        // to the Box's ring for the Subscribers to send from
+        box_message_t *message = box_message_get();
+        if (message == NULL) {
+            fprintf(stderr,"Unable to alloc memory to read Publisher's message.\n");
+            return session_end(session, -1);
+        }
+
+        // Messages are kept as received (they may hold any bytes), numbered
+        // and timestamped once published
+        memcpy(message->bm_frame + FRAME_HEADER_LENGTH, received,
+               received_length);
+        frame_header(message->bm_frame, SERVER_2_SUB, received_length);
+        memset(&message->bm_record, 0, BOX_RECORD_HEADER_LENGTH);
+        message->bm_record.br_length = received_length;
+        message->bm_length = BOX_RECORD_HEADER_LENGTH + received_length;
+        session->s_batch[session->s_batch_count++] = message;
+
+        // Commit once the messages already received are in the batch
+        if (session->s_batch_count == PUB_COMMIT_BATCH ||
+            !frame_reader_ready(&session->s_reader)) {
+            int result = publish_batch(session);
+            session->s_batch_count = 0;
+            if (result == -1) {
+                return session_end(session, -1);
+            }
+        }
+    }
+
+    return TASK_YIELD;
+}
+
+int publisher(scheduler_t *scheduler, Client_Info *info, box_table_t *boxes) {
+    struct Box *box = getBox(boxes, info->box_name);
     if (box == NULL) {
         fprintf(stderr,"Box not found.\n");
         return -1;
     }
 
-    box->n_subscribers++;
+    // Only one Publisher per Box
+    pthread_mutex_lock(&box->box_lock);
+    if (box->n_publishers != 0) {
+        pthread_mutex_unlock(&box->box_lock);
+        putBox(box);
+        return -1;
+    }
+    box->n_publishers++;
+    pthread_mutex_unlock(&box->box_lock);
 
-    int fd = tfs_open(info->box_name, TFS_O_TRUNC);
+    // Only the Publisher adds segments, so the last one stays the last
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t last = box_segment_last(box)->bs_number;
+    pthread_mutex_unlock(&box->box_lock);
+
+    int fd = box_segment_open(info->box_name, last);
     if (fd == -1) {
         fprintf(stderr,"Unable to open TFS file.\n");
-        box->n_subscribers--;
-        free(message);
+        publisher_leave(box);
         return -1;
     }
 
-    char *buffer = calloc(MESSAGE_SIZE, sizeof(char));
-    if (buffer == NULL) {
-        fprintf(stderr,"Unable to alloc memory to create buffer.\n");
-        box->n_subscribers--;
-        free(message);
+    session_t *session =
+        session_create(scheduler, PUB_REGISTER, info, box, publisher_run);
+    if (session == NULL) {
+        fprintf(stderr,"Unable to alloc memory to read Publisher's message.\n");
+        publisher_leave(box);
         tfs_close(fd);
         return -1;
     }
+    session->s_fd = fd;
+    frame_reader_init(&session->s_reader, info->session_pipe,
+                      session->s_buffer, SESSION_BUFFER_SIZE);
+
+    // The Pipe reads as closed until the Publisher opens it, so the session
+    // first runs once there is something to read (or the Publisher left)
+    if (scheduler_watch(scheduler, &session->s_task, info->session_pipe,
+                        EPOLLIN) != 0) {
+        fprintf(stderr,"Unable to wait for Session's Pipe.\n");
+        frame_put(FRAME_MESSAGE, session->s_buffer);
+        frame_put(FRAME_SESSION, session);
+        publisher_leave(box);
+        tfs_close(fd);
+        return -1;
+    }
+    return 0;
+}
 
-    memcpy(message, &SERVER_2_SUB, UINT8_T_SIZE);
-    message += UINT8_T_SIZE;
+/*
+ * Write the frames queued to a Subscriber without blocking, and release what
+ * they point into once they are all written.
+ *
+ * Returns 1 if every frame was written, 0 if the Pipe is full, -1 if unable to
+ * write in it.
+ */
+static int subscriber_flush(session_t *session) {
+    while (session->s_iov_first < session->s_iov_count) {
+        ssize_t written =
+            writev(session->s_info.session_pipe,
+                   session->s_iov + session->s_iov_first,
+                   (int)(session->s_iov_count - session->s_iov_first));
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        // Skip what was written
+        size_t left = (size_t)written;
+        while (left > 0) {
+            struct iovec *iov = &session->s_iov[session->s_iov_first];
+            if (left < iov->iov_len) {
+                iov->iov_base = (char *)iov->iov_base + left;
+                iov->iov_len -= left;
+                break;
+            }
+            left -= iov->iov_len;
+            session->s_iov_first++;
+        }
+    }
 
-    while (TRUE) {
+    for (size_t i = 0; i < session->s_held_count; i++) {
+        box_message_put(session->s_held[i]);
+    }
+    session->s_held_count = 0;
+    session->s_iov_first = 0;
+    session->s_iov_count = 0;
+
+    memmove(session->s_buffer, session->s_buffer + session->s_consumed,
+            session->s_pending - session->s_consumed);
+    session->s_pending -= session->s_consumed;
+    session->s_consumed = 0;
+
+    // Everything read from the Box before what is still buffered was
+    // delivered
+    session->s_delivered = session->s_box_offset - session->s_pending;
+    session->s_unsaved += session->s_sending;
+    session->s_sending = 0;
+    return 1;
+}
 
-        if (tfs_read(fd, buffer, MESSAGE_SIZE) == -1) {
-            fprintf(stderr,"Unable to read message from Box.\n");
-            box->n_subscribers--;
-            free(message);
-            free(buffer);
-            tfs_close(fd);
+/*
+ * Queue the messages of the whole records read into a Subscriber's buffer (at
+ * most SUB_RING_BATCH), found from the records' headers alone.
+ *
+ * Returns the number of messages queued, or -1 on a corrupted record.
+ */
+static ssize_t subscriber_queue_buffered(session_t *session) {
+    size_t count = 0;
+    size_t start = 0;
+    while (count < SUB_RING_BATCH &&
+           session->s_pending - start >= BOX_RECORD_HEADER_LENGTH) {
+        box_record_t record;
+        memcpy(&record, session->s_buffer + start, BOX_RECORD_HEADER_LENGTH);
+        if (record.br_length >= MESSAGE_SIZE) {
             return -1;
         }
+        size_t record_length = BOX_RECORD_HEADER_LENGTH + record.br_length;
+        if (session->s_pending - start < record_length) {
+            break; // read in part
+        }
 
-        size_t i;
-        for (i = 0; i < MESSAGE_SIZE; i++) {
-            if (buffer[i] == '\0') {
-                memcpy(message, buffer, i);
-                break;
+        frame_header(session->s_headers[count], SERVER_2_SUB, record.br_length);
+        struct iovec *iov = &session->s_iov[session->s_iov_count];
+        iov[0].iov_base = session->s_headers[count];
+        iov[0].iov_len = FRAME_HEADER_LENGTH;
+        iov[1].iov_base =
+            session->s_buffer + start + BOX_RECORD_HEADER_LENGTH;
+        iov[1].iov_len = record.br_length;
+        session->s_iov_count += 2;
+        count++;
+        start += record_length;
+    }
+    session->s_consumed = start;
+    return (ssize_t)count;
+}
+
+static task_status_t subscriber_run(task_t *task) {
+    session_t *session = (session_t *)task;
+    struct Box *box = session->s_box;
+
+    for (size_t round = 0; round < SESSION_ROUNDS; round++) {
+        int flushed = subscriber_flush(session);
+        if (flushed == -1) {
+            fprintf(stderr,"Unable to write in Session's Pipe.\n");
+            return session_end(session, -1);
+        }
+        if (flushed == 0) {
+            return session_watch(session, EPOLLOUT);
+        }
+        subscriber_save(session, SUB_CURSOR_BATCH);
+
+        ssize_t queued = subscriber_queue_buffered(session);
+        if (queued == -1) {
+            fprintf(stderr,"Unable to read message from Box.\n");
+            return session_end(session, -1);
+        }
+        if (queued > 0) {
+            session->s_sending = (size_t)queued;
+            continue;
+        }
+
+        pthread_mutex_lock(&box->box_lock);
+        if (box->removed) {
+            pthread_mutex_unlock(&box->box_lock);
+            return session_end(session, 0);
+        }
+        if (box->box_end <= session->s_box_offset) {
+            // Sleep until the Publisher writes past what was already read
+            box_wait(box, &session->s_waiter);
+            pthread_mutex_unlock(&box->box_lock);
+            subscriber_save(session, 1);
+            return TASK_WAIT;
+        }
+
+        // Segments dropped meanwhile are skipped (with what was read of a
+        // record in them)
+        uint64_t start = box_segment_start(box);
+        if (session->s_box_offset < start) {
+            session->s_box_offset = start;
+            session->s_pending = 0;
+        }
+        uint64_t number = session->s_box_offset / BOX_SEGMENT_SIZE;
+        uint64_t records_end = number * BOX_SEGMENT_SIZE +
+                               BOX_SEGMENT_HEADER_LENGTH +
+                               box_segment_get(box, number)->bs_used;
+        size_t count = 0;
+        if (session->s_pending == 0) {
+            count = box_ring_take(box, &session->s_ring_seq,
+                                  session->s_box_offset, session->s_held,
+                                  SUB_RING_BATCH);
+        }
+        pthread_mutex_unlock(&box->box_lock);
+
+        if (count > 0) {
+            // Sent straight from the ring's buffers
+            for (size_t i = 0; i < count; i++) {
+                session->s_iov[i].iov_base = session->s_held[i]->bm_frame;
+                session->s_iov[i].iov_len =
+                    FRAME_HEADER_LENGTH +
+                    session->s_held[i]->bm_record.br_length;
+                session->s_box_offset = session->s_held[i]->bm_offset +
+                                        session->s_held[i]->bm_length;
             }
+            session->s_iov_count = count;
+            session->s_held_count = count;
+            session->s_sending = count;
+            continue;
         }
 
-        if (write(info->session_pipe, message - UINT8_T_SIZE,
-                  strlen(message) + 1)) {
-            fprintf(stderr,"Unable to write in Session's Pipe.\n");
-            box->n_subscribers--;
-            free(message);
-            free(buffer);
-            tfs_close(fd);
+        if (session->s_box_offset >= records_end) {
+            // Every record of the segment was read: go on with the next
+            session->s_box_offset =
+                (number + 1) * BOX_SEGMENT_SIZE + BOX_SEGMENT_HEADER_LENGTH;
+            continue;
+        }
+
+        // Not in the ring: read as many records as fit from the Box's segment,
+        // up to what was published (the Publisher may be waiting for more to
+        // be committed)
+        size_t to_read = SESSION_BUFFER_SIZE - session->s_pending;
+        if (to_read > records_end - session->s_box_offset) {
+            to_read = (size_t)(records_end - session->s_box_offset);
+        }
+        ssize_t bytes_read =
+            to_read == 0 ? -1
+                         : box_segment_pread(&session->s_segments,
+                                             session->s_buffer +
+                                                 session->s_pending,
+                                             to_read, session->s_box_offset);
+
+        // What was read from a segment dropped meanwhile (or of a Box removed
+        // meanwhile) is ignored: its name may be another Box's by now
+        pthread_mutex_lock(&box->box_lock);
+        int dropped = number < box->box_segment_first || box->removed;
+        pthread_mutex_unlock(&box->box_lock);
+        if (dropped) {
+            continue;
+        }
+        if (bytes_read == -1) {
+            fprintf(stderr,"Unable to read message from Box.\n");
+            return session_end(session, -1);
+        }
+        session->s_box_offset += (uint64_t)bytes_read;
+        session->s_pending += (size_t)bytes_read;
+    }
+
+    return TASK_YIELD;
+}
+
+/*
+ * Find where a Subscriber starts reading a Box, through the Box's index.
+ *
+ * Returns the offset of the first record to send (the end of the Box, if none
+ * has been published yet), setting *seq to the record's sequence number (as a
+ * hint, when it is not known).
+ */
+static uint64_t subscriber_start(struct Box *box, box_segment_reader_t *reader,
+                                 Client_Info const *info, uint64_t *seq) {
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t offset = box_segment_start(box);
+    uint64_t first = box->box_segment_first;
+    uint64_t end = box->box_end;
+    uint64_t records = box->box_ring_next;
+    pthread_mutex_unlock(&box->box_lock);
+
+    *seq = 0;
+    if (info->start_kind == SUB_START_LATEST) {
+        *seq = records;
+        return end;
+    }
+    if (info->start_kind == SUB_START_SEQUENCE) {
+        *seq = info->start_value < records ? info->start_value : records;
+        offset = box_segment_seek_seq(box, reader, info->start_value);
+    } else if (info->start_kind == SUB_START_TIMESTAMP) {
+        offset = box_segment_seek_time(box, reader, info->start_value);
+    }
+
+    // A seek through a segment dropped meanwhile starts from the first record
+    // retained instead
+    pthread_mutex_lock(&box->box_lock);
+    if (box->box_segment_first != first) {
+        offset = box_segment_start(box);
+    }
+    pthread_mutex_unlock(&box->box_lock);
+    return offset;
+}
+
+int subscriber(scheduler_t *scheduler, Client_Info *info, box_table_t *boxes) {
+    struct Box *box = getBox(boxes, info->box_name);
+    if (box == NULL) {
+        fprintf(stderr,"Box not found.\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&box->box_lock);
+    box->n_subscribers++;
+    pthread_mutex_unlock(&box->box_lock);
+
+    // The Box is read at offsets kept in the session (so Subscribers do not
+    // take open file handles)
+    session_t *session =
+        session_create(scheduler, SUB_REGISTER, info, box, subscriber_run);
+    if (session == NULL) {
+        fprintf(stderr,"Unable to alloc memory to create buffer.\n");
+        subscriber_leave(box, NULL);
+        return -1;
+    }
+    box_segment_reader_init(&session->s_segments, info->box_name);
+    session->s_box_offset = subscriber_start(box, &session->s_segments, info,
+                                             &session->s_ring_seq);
+
+    // A Subscriber naming a cursor resumes from it (or starts it where asked)
+    if (info->cursor_name[0] != '\0') {
+        uint64_t offset = session->s_box_offset;
+        if (box_cursor_open(info->box_name, info->cursor_name,
+                            &session->s_cursors, &session->s_cursor_slot,
+                            &offset) == -1) {
+            fprintf(stderr,"Unable to open Subscriber's cursor.\n");
+            frame_put(FRAME_MESSAGE, session->s_buffer);
+            frame_put(FRAME_SESSION, session);
+            subscriber_leave(box, NULL);
             return -1;
         }
 
-        memset(message, 0, MESSAGE_SIZE + UINT8_T_SIZE);
-        memcpy(message, &SERVER_2_SUB, UINT8_T_SIZE);
-        message += UINT8_T_SIZE;
-        memcpy(message, buffer + i, MESSAGE_SIZE - i);
-        message += MESSAGE_SIZE - i;
-        memset(buffer, 0, MESSAGE_SIZE);
+        // Where the cursor was may have been dropped since
+        pthread_mutex_lock(&box->box_lock);
+        uint64_t start = box_segment_start(box);
+        session->s_box_offset = offset < start          ? start
+                                : offset < box->box_end ? offset
+                                                        : box->box_end;
+        pthread_mutex_unlock(&box->box_lock);
     }
+    session->s_delivered = session->s_box_offset;
 
-    box->n_subscribers--;
-    free(message);
-    free(buffer);
-    tfs_close(fd);
+    scheduler_submit(scheduler, &session->s_task);
     return 0;
 }
 
-int box_answer(int session_pipe, int32_t return_code, uint8_t op_code) {
-    void *message = calloc(TOTAL_RESPONSE_LENGTH, sizeof(char));
+/*
+ * A frame of the Box listing, chained to the next one: its entries are
+ * lf_entries[0..lf_count), sorted by name once the listing is done (and
+ * lf_merged of them were merged meanwhile, while sorting).
+ */
+typedef struct list_frame {
+    struct list_frame *lf_next;
+    size_t lf_count;
+    size_t lf_merged;
+    char lf_entries[LIST_FRAME_ENTRIES * LIST_RESPONSE];
+} list_frame_t;
+
+_Static_assert(sizeof(list_frame_t) <= LIST_FRAME_SIZE,
+               "a listing's entries do not fit in their frame");
+
+/*
+ * An answer to a Manager, written to its Pipe without blocking (over several
+ * runs of the request, should the Pipe fill up).
+ */
+typedef struct {
+    char *r_data;         // a FRAME_RESPONSE frame, or r_list's entries
+    list_frame_t *r_list; // a listing: the frames not yet sent whole
+    size_t r_length;
+    size_t r_sent;
+} reply_t;
+
+static void list_release(list_frame_t *list) {
+    while (list != NULL) {
+        list_frame_t *next = list->lf_next;
+        frame_put(FRAME_LIST, list);
+        list = next;
+    }
+}
+
+static void reply_release(reply_t *reply) {
+    if (reply->r_list != NULL) {
+        list_release(reply->r_list);
+    } else if (reply->r_data != NULL) {
+        frame_put(FRAME_RESPONSE, reply->r_data);
+    }
+    reply->r_data = NULL;
+    reply->r_list = NULL;
+}
+
+int box_answer(reply_t *reply, int32_t return_code, uint8_t op_code) {
+    char *message = frame_get(FRAME_RESPONSE);
     if (message == NULL) {
         fprintf(stderr,"Unable to alloc memory to send Message.\n");
         return -1;
     }
+    memset(message, 0, TOTAL_RESPONSE_LENGTH);
 
     switch (op_code) {
     case BOX_CREATION_R:
@@ -188,232 +899,732 @@ int box_answer(int session_pipe, int32_t return_code, uint8_t op_code) {
     default:
         fprintf(stderr,"Unknown OP_CODE given.\n");
     }
-    message += UINT8_T_SIZE;
 
-    memcpy(message, &return_code, sizeof(int32_t));
-    message += sizeof(int32_t);
+    memcpy(message + UINT8_T_SIZE, &return_code, sizeof(int32_t));
 
-    char error_message[] = "ERROR: Unable to process request.";
+    char error_message[] = "Unable to process request.";
     if (return_code == BOX_ERROR) {
-        memcpy(message, error_message, strlen(error_message));
+        memcpy(message + UINT8_T_SIZE + sizeof(int32_t), error_message,
+               strlen(error_message));
     }
 
-    if (write(session_pipe, message, strlen(error_message)) == -1) {
-        fprintf(stderr,"Unable to write in Session's Pipe.\n");
-        message -= (UINT8_T_SIZE + sizeof(int32_t));
-        free(message);
-        return -1;
-    }
+    reply->r_data = message;
+    reply->r_list = NULL;
+    reply->r_length = TOTAL_RESPONSE_LENGTH;
+    reply->r_sent = 0;
+    return 0;
+}
 
-    message -= (UINT8_T_SIZE + sizeof(int32_t));
-    free(message);
+/*
+ * Create the directories along a Box's name (e.g., "/team" and "/team/service"
+ * for "/team/service/topic"), unless they already exist.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int box_directories(char const *box_name) {
+    char path[BOX_NAME_LENGTH];
+    for (char const *slash = strchr(box_name + 1, '/'); slash != NULL;
+         slash = strchr(slash + 1, '/')) {
+        size_t length = (size_t)(slash - box_name);
+        memcpy(path, box_name, length);
+        path[length] = '\0';
+        if (tfs_mkdir(path) == -1 && tfs_get_inumber(path) == -1) {
+            return -1;
+        }
+    }
     return 0;
 }
 
-int create_box(int session_pipe, void *buffer, struct Box *head,
+/*
+ * Delete the files of a Box whose creation failed, the Box's own file last:
+ * until then, no other creation of the Box can start.
+ */
+static void create_box_undo(char const *box_name) {
+    box_segment_unlink(box_name, 0);
+    box_index_unlink(box_name);
+    tfs_unlink(box_name);
+}
+
+int create_box(reply_t *reply, void *buffer, box_table_t *boxes,
                uint8_t op_code) {
 
+    if (!name_fits(buffer, BOX_NAME_LENGTH)) {
+        fprintf(stderr,"Box name too long.\n");
+        box_answer(reply, BOX_ERROR, op_code);
+        return -1;
+    }
     char box_name[BOX_NAME_LENGTH];
-    memset(box_name, 0, BOX_NAME_LENGTH);
     memcpy(box_name, buffer, BOX_NAME_LENGTH);
-    int fhandle = tfs_open(box_name, TFS_O_CREAT);
+    if (strchr(box_name, BOX_FILE_MARK) != NULL) {
+        fprintf(stderr,"Invalid Box name %s.\n", box_name);
+        box_answer(reply, BOX_ERROR, op_code);
+        return -1;
+    }
+
+    if (tfs_get_inumber(box_name) != -1) {
+        fprintf(stderr,"Box %s already exists.\n", box_name);
+        box_answer(reply, BOX_ERROR, op_code);
+        return -1;
+    }
+
+    // The Box's file holds its retention. Only one of the concurrent
+    // creations of a Box creates it (and goes on creating the Box).
+    box_retention_t retention;
+    memcpy(&retention, buffer + BOX_NAME_LENGTH, sizeof(box_retention_t));
+    int fhandle = box_directories(box_name) == -1
+                      ? -1
+                      : tfs_open(box_name, TFS_O_CREAT | TFS_O_EXCL);
     if (fhandle == -1) {
         fprintf(stderr,"Unable to create Box %s.\n", box_name);
-        box_answer(session_pipe, BOX_ERROR, op_code);
+        box_answer(reply, BOX_ERROR, op_code);
         return -1;
     }
 
-    if (tfs_close(fhandle) == -1) {
-        box_answer(session_pipe, BOX_ERROR, op_code);
+    ssize_t written = tfs_write(fhandle, &retention, sizeof(box_retention_t));
+    if (tfs_close(fhandle) == -1 ||
+        written != (ssize_t)sizeof(box_retention_t)) {
+        fprintf(stderr,"Unable to write retention of Box %s.\n", box_name);
+        create_box_undo(box_name);
+        box_answer(reply, BOX_ERROR, op_code);
         return -1;
     }
 
-    if (insertBox(head, box_name, BOX_NAME_LENGTH) == -1) {
-        box_answer(session_pipe, BOX_ERROR, op_code);
-        fprintf(stderr,"Unable to insert Box %s.\n", box_name);
+    tfs_file_t index;
+    if (box_index_open(box_name, &index) == -1) {
+        fprintf(stderr,"Unable to create index of Box %s.\n", box_name);
+        create_box_undo(box_name);
+        box_answer(reply, BOX_ERROR, op_code);
         return -1;
     }
 
-    if (box_answer(session_pipe, BOX_SUCCESS, op_code) == -1) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    box_segment_t segment = {.bs_number = 0,
+                             .bs_used = 0,
+                             .bs_first_seq = 0,
+                             .bs_created = (uint64_t)now.tv_sec * 1000000000u +
+                                           (uint64_t)now.tv_nsec};
+    fhandle = box_segment_create(box_name, segment.bs_number,
+                                 segment.bs_first_seq, segment.bs_created);
+    if (fhandle == -1 || tfs_close(fhandle) == -1) {
+        fprintf(stderr,"Unable to create segment of Box %s.\n", box_name);
+        create_box_undo(box_name);
+        box_answer(reply, BOX_ERROR, op_code);
+        return -1;
+    }
 
-        fprintf(stderr,"Unable to send answer to Session's Pipe.\n");
+    if (insertBox(boxes, box_name, 0, index, &retention, &segment, 1) == -1) {
+        fprintf(stderr,"Unable to insert Box %s.\n", box_name);
+        create_box_undo(box_name);
+        box_answer(reply, BOX_ERROR, op_code);
         return -1;
     }
 
-    return 0;
+    return box_answer(reply, BOX_SUCCESS, op_code);
 }
 
-int remove_box(int session_pipe, void *buffer, struct Box *head,
+int remove_box(reply_t *reply, void *buffer, box_table_t *boxes,
                uint8_t op_code) {
 
+    if (!name_fits(buffer, BOX_NAME_LENGTH)) {
+        fprintf(stderr,"Box name too long.\n");
+        box_answer(reply, BOX_ERROR, op_code);
+        return -1;
+    }
     char box_name[BOX_NAME_LENGTH];
-    memset(box_name, 0, BOX_NAME_LENGTH);
     memcpy(box_name, buffer, BOX_NAME_LENGTH);
 
-    if (tfs_unlink(box_name) == -1) {
+    struct Box *box = getBox(boxes, box_name);
+    if (box == NULL || tfs_unlink(box_name) == -1) {
         fprintf(stderr,"Unable to unlink Box %s.\n", box_name);
-        box_answer(session_pipe, BOX_ERROR, op_code);
+        if (box != NULL) {
+            putBox(box);
+        }
+        box_answer(reply, BOX_ERROR, op_code);
         return -1;
     }
 
-    if (deleteBox(head, box_name) == -1) {
+    if (deleteBox(boxes, box_name) == -1) {
         fprintf(stderr,"Unable to delete Box %s.\n", box_name);
-        box_answer(session_pipe, BOX_ERROR, op_code);
+        putBox(box);
+        box_answer(reply, BOX_ERROR, op_code);
         return -1;
     }
 
-    if (box_answer(session_pipe, BOX_SUCCESS, op_code) == -1) {
-        fprintf(stderr,"Unable to send answer to Session's Pipe.\n");
-        box_answer(session_pipe, BOX_ERROR, op_code);
-        return -1;
+    if (box_index_unlink(box_name) == -1) {
+        fprintf(stderr,"Unable to unlink index of Box %s.\n", box_name);
+    }
+    box_cursor_unlink(box_name);
+
+    // Once removed, the Box gets no new segments
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t first = box->box_segment_first;
+    uint64_t count = box->box_segment_count;
+    pthread_mutex_unlock(&box->box_lock);
+    for (uint64_t number = first; number < first + count; number++) {
+        box_segment_unlink(box_name, number);
     }
+    putBox(box);
 
-    return 0;
+    return box_answer(reply, BOX_SUCCESS, op_code);
 }
 
-int list_box(int session_pipe, struct Box *head) {
-    void *buffer = calloc(LIST_RESPONSE, sizeof(char));
-    if (buffer == NULL) {
-        fprintf(stderr,"Unable to alloc memory to list Boxes.\n");
+/*
+ * A Box listing being built, from its first frame to its last.
+ */
+typedef struct {
+    list_frame_t *l_head;
+    list_frame_t *l_tail;
+} listing_t;
+
+/*
+ * Add an entry (of LIST_RESPONSE bytes, to be filled) to the end of a listing.
+ *
+ * Returns the entry, or NULL if the memory could not be allocated.
+ */
+static char *listing_add(listing_t *listing) {
+    list_frame_t *tail = listing->l_tail;
+    if (tail == NULL || tail->lf_count == LIST_FRAME_ENTRIES) {
+        list_frame_t *frame = frame_get(FRAME_LIST);
+        if (frame == NULL) {
+            return NULL;
+        }
+        frame->lf_next = NULL;
+        frame->lf_count = 0;
+        frame->lf_merged = 0;
+        if (tail == NULL) {
+            listing->l_head = frame;
+        } else {
+            tail->lf_next = frame;
+        }
+        listing->l_tail = tail = frame;
+    }
+    return tail->lf_entries + tail->lf_count++ * LIST_RESPONSE;
+}
+
+// Entries hold their op code, whether they are the last one and the Box's name
+static int list_entry_compare(void const *a, void const *b) {
+    return strncmp((char const *)a + 2 * UINT8_T_SIZE,
+                   (char const *)b + 2 * UINT8_T_SIZE, BOX_NAME_LENGTH);
+}
+
+static int list_visit(struct Box *box, void *arg) {
+    char *entry = listing_add(arg);
+    if (entry == NULL) {
         return -1;
     }
+    memcpy(entry, &LIST_BOX_A, UINT8_T_SIZE);
+    box_to_string(box, entry + UINT8_T_SIZE);
+    entry[UINT8_T_SIZE] = 0; // the last entry is flagged once sorted
+    return 0;
+}
 
-    memcpy(buffer, &LIST_BOX_A, UINT8_T_SIZE);
+/*
+ * Sort a listing by name: every frame on its own and then, if there is more
+ * than one, merging them into a new listing, which replaces it.
+ *
+ * Returns 0 if successful, -1 if the memory could not be allocated.
+ */
+static int listing_sort(listing_t *listing) {
+    for (list_frame_t *frame = listing->l_head; frame != NULL;
+         frame = frame->lf_next) {
+        qsort(frame->lf_entries, frame->lf_count, LIST_RESPONSE,
+              list_entry_compare);
+    }
+    if (listing->l_head == listing->l_tail) {
+        return 0;
+    }
 
-    struct Box *current = head;
-    if (head == NULL) {
-        struct Box *no_box = malloc(sizeof(struct Box));
-        if (no_box == NULL) {
-            fprintf(stderr,"Unable to alloc memory to list Boxes.\n");
-            free(buffer);
-            return -1;
+    listing_t sorted = {NULL, NULL};
+    while (true) {
+        // The least of the entries not merged yet, of every frame
+        char *least = NULL;
+        list_frame_t *from = NULL;
+        for (list_frame_t *frame = listing->l_head; frame != NULL;
+             frame = frame->lf_next) {
+            if (frame->lf_merged == frame->lf_count) {
+                continue;
+            }
+            char *entry = frame->lf_entries + frame->lf_merged * LIST_RESPONSE;
+            if (least == NULL || list_entry_compare(entry, least) < 0) {
+                least = entry;
+                from = frame;
+            }
         }
-        memset(no_box->box_name, 0, BOX_NAME_LENGTH);
-        no_box->box_size = 0;
-        no_box->n_publishers = 0;
-        no_box->n_subscribers = 0;
-        no_box->last = 1;
-        no_box->next = NULL;
-        box_to_string(no_box, buffer + UINT8_T_SIZE);
-        if (write(session_pipe, buffer, LIST_RESPONSE) == -1) {
-            fprintf(stderr,"Unable to write in Manager's Pipe.\n");
-            free(no_box);
-            free(buffer);
+        if (least == NULL) {
+            break;
+        }
+
+        char *entry = listing_add(&sorted);
+        if (entry == NULL) {
+            list_release(sorted.l_head);
             return -1;
         }
-        free(no_box);
+        memcpy(entry, least, LIST_RESPONSE);
+        from->lf_merged++;
     }
 
-    while (current != NULL) {
-        box_to_string(current, buffer + UINT8_T_SIZE);
-        if (write(session_pipe, buffer, LIST_RESPONSE) == -1) {
-            fprintf(stderr,"Unable to write in Manager's Pipe.\n");
-            buffer -= UINT8_T_SIZE;
-            free(buffer);
+    list_release(listing->l_head);
+    *listing = sorted;
+    return 0;
+}
+
+int list_box(reply_t *reply, box_table_t *boxes) {
+    // The whole listing, an entry after the other, in pooled frames
+    listing_t listing = {NULL, NULL};
+    if (box_table_visit(boxes, list_visit, &listing) != 0 ||
+        listing_sort(&listing) != 0) {
+        fprintf(stderr,"Unable to alloc memory to list Boxes.\n");
+        list_release(listing.l_head);
+        return -1;
+    }
+
+    // No Boxes: a single entry, with an empty name
+    if (listing.l_head == NULL) {
+        char *entry = listing_add(&listing);
+        if (entry == NULL) {
+            fprintf(stderr,"Unable to alloc memory to list Boxes.\n");
             return -1;
         }
+        memset(entry, 0, LIST_RESPONSE);
+        memcpy(entry, &LIST_BOX_A, UINT8_T_SIZE);
+    }
+    list_frame_t *tail = listing.l_tail;
+    tail->lf_entries[(tail->lf_count - 1) * LIST_RESPONSE + UINT8_T_SIZE] = 1;
 
-        current = current->next;
+    reply->r_data = listing.l_head->lf_entries;
+    reply->r_list = listing.l_head;
+    reply->r_length = listing.l_head->lf_count * LIST_RESPONSE;
+    reply->r_sent = 0;
+    return 0;
+}
 
-        memset(buffer, 0, LIST_RESPONSE);
-        memcpy(buffer, &LIST_BOX_A, UINT8_T_SIZE);
+/*
+ * A request read from the Server's Pipe, handled by the scheduler's workers.
+ * It is a FRAME_REQUEST frame, request and state together.
+ *
+ * The Session's Pipe is opened without blocking: a Publisher's right away
+ * (its Pipe reads as closed until the Publisher opens it), any other
+ * client's once the client opens it for reading, which the request waits for
+ * by trying again after growing delays (up to PIPE_OPEN_TIMEOUT_MS). An answer
+ * to a Manager is then written without blocking either, waiting for the Pipe
+ * to have room; so a client that never shows up holds no worker.
+ */
+typedef struct {
+    task_t rt_task; // first, so the task is the request
+    char rt_request[MAX_REQUEST_LENGTH];
+    box_table_t *rt_boxes;
+    scheduler_t *rt_scheduler;
+
+    int rt_pipe;             // -1 until opened (or handed over to a session)
+    uint64_t rt_open_delay;  // before trying to open the Pipe again, in ms
+    uint64_t rt_open_waited; // for the client to open the Pipe, in ms
+    reply_t rt_reply;        // to a Manager
+} request_task_t;
+
+_Static_assert(sizeof(request_task_t) <= REQUEST_FRAME_SIZE,
+               "a request does not fit in its frame");
+
+/*
+ * Open the Session's Pipe of a request, without blocking.
+ *
+ * Returns 1 if opened, 0 if the client has not opened it yet (try again
+ * later), -1 if unable to open it.
+ */
+static int request_open(request_task_t *request) {
+    uint8_t op_code;
+    memcpy(&op_code, request->rt_request, UINT8_T_SIZE);
+    char session_pipe_name[PIPE_NAME_LENGTH];
+    memcpy(session_pipe_name, request->rt_request + UINT8_T_SIZE,
+           PIPE_NAME_LENGTH);
+    session_pipe_name[PIPE_NAME_LENGTH - 1] = '\0';
+
+    // Publishers write into their Pipe, every other client reads from it
+    int session_pipe =
+        open(session_pipe_name, (op_code == PUB_REGISTER ? O_RDONLY : O_WRONLY) |
+                                    O_NONBLOCK);
+    if (session_pipe == -1 && errno == ENXIO &&
+        request->rt_open_waited < PIPE_OPEN_TIMEOUT_MS) {
+        return 0; // no reader yet
     }
+    if (session_pipe == -1) {
+        fprintf(stderr,"Unable to open Session's Pipe.\n");
+        return -1;
+    }
+    request->rt_pipe = session_pipe;
+    return 1;
+}
 
-    free(buffer);
+/*
+ * Handle a request whose Session's Pipe was opened: start the Publisher's or
+ * Subscriber's session (which then owns the Pipe) or prepare the answer to
+ * the Manager.
+ */
+static void handle_request(request_task_t *request) {
+    void *buffer = request->rt_request;
+    u_int8_t op_code;
+    memcpy(&op_code, buffer, UINT8_T_SIZE);
+    buffer += UINT8_T_SIZE + PIPE_NAME_LENGTH;
+
+    int session_pipe = request->rt_pipe;
+    reply_t *reply = &request->rt_reply;
+    Client_Info info;
+
+    // Sessions go on in the scheduler, which then owns the Session's Pipe
+    switch (op_code) {
+    case 1:
+        if (register_client(&info, buffer, session_pipe) == -1 ||
+            publisher(request->rt_scheduler, &info, request->rt_boxes) == -1) {
+            fprintf(stderr,"Publisher unable to write.\n");
+            close(session_pipe);
+        }
+        request->rt_pipe = -1;
+        break;
 
-    return 0;
+    case 2:
+        if (register_client(&info, buffer, session_pipe) == -1 ||
+            register_start(&info, buffer + BOX_NAME_LENGTH) == -1 ||
+            subscriber(request->rt_scheduler, &info, request->rt_boxes) ==
+                -1) {
+            fprintf(stderr,"Subscriber unable to read.\n");
+            close(session_pipe);
+        }
+        request->rt_pipe = -1;
+        break;
+
+    case 3:
+        if (create_box(reply, buffer, request->rt_boxes, op_code) == -1) {
+            fprintf(stderr,"Unable to create Box-\n");
+        }
+        break;
+
+    case 5:
+        if (remove_box(reply, buffer, request->rt_boxes, op_code) == -1) {
+            fprintf(stderr,"Unable to remove Box.\n");
+        }
+        break;
+
+    case 7:
+        if (list_box(reply, request->rt_boxes) == -1) {
+            fprintf(stderr,"Unable to list boxes.\n");
+        }
+        break;
+
+    default:
+        fprintf(stderr,"Unknown OP_CODE given.\n");
+    }
 }
 
-void *working_thread(void *_args) {
-    thread_args *args = (thread_args *)_args;
-    int run = TRUE;
-    while (run) {
-        void *buffer = calloc(REQUEST_LENGTH, sizeof(char));
-        if (buffer == NULL) {
-            fprintf(stderr,"Unable to alloc memory to proccess request.\n");
-            return 0;
-        }
-        buffer = pcq_dequeue(args->queue);
-        u_int8_t op_code;
-        memcpy(&op_code, buffer, UINT8_T_SIZE);
-        buffer += UINT8_T_SIZE;
-
-        char session_pipe_name[PIPE_NAME_LENGTH];
-        memcpy(session_pipe_name, buffer, PIPE_NAME_LENGTH);
-        buffer += PIPE_NAME_LENGTH;
-
-        int session_pipe = open(session_pipe_name, O_WRONLY);
-        if (session_pipe == -1) {
-            fprintf(stderr,"Unable to open Session's Pipe.\n");
-            return 0;
-        }
-
-        Client_Info *info;
-
-        switch (op_code) {
-        case 1:
-            info = register_client(buffer, session_pipe);
-            if (info == NULL) {
-                fprintf(stderr,"Unable to register publisher.\n");
-                close(session_pipe);
-            }
-            if (publisher(info, args->head) == -1) {
-                fprintf(stderr,"Publisher unable to write.\n");
-                close(session_pipe);
+/*
+ * Write (what is left of) the answer to a Manager without blocking.
+ *
+ * Returns 1 if it was written whole, 0 if the Pipe is full, -1 if unable to
+ * write in it.
+ */
+static int request_reply(request_task_t *request) {
+    reply_t *reply = &request->rt_reply;
+    while (true) {
+        // A listing goes on with its next frame, once one is sent whole
+        if (reply->r_sent == reply->r_length) {
+            if (reply->r_list == NULL || reply->r_list->lf_next == NULL) {
+                break;
             }
-            break;
+            list_frame_t *sent = reply->r_list;
+            reply->r_list = sent->lf_next;
+            frame_put(FRAME_LIST, sent);
+            reply->r_data = reply->r_list->lf_entries;
+            reply->r_length = reply->r_list->lf_count * LIST_RESPONSE;
+            reply->r_sent = 0;
+            continue;
+        }
 
-        case 2:
-            info = register_client(buffer, session_pipe);
-            if (info == NULL) {
-                fprintf(stderr,"Unable to register publisher.\n");
-                close(session_pipe);
+        ssize_t written = write(request->rt_pipe, reply->r_data + reply->r_sent,
+                                reply->r_length - reply->r_sent);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            if (subscriber(info, args->head) == -1) {
-                fprintf(stderr,"Subscriber unable to read.\n");
-                close(session_pipe);
+            if (errno == EAGAIN) {
+                return 0;
             }
-            break;
+            fprintf(stderr,"Unable to write in Session's Pipe.\n");
+            return -1;
+        }
+        reply->r_sent += (size_t)written;
+    }
+    return 1;
+}
 
-        case 3:
-            if (create_box(session_pipe, buffer, args->head, op_code) == -1) {
-                fprintf(stderr,"Unable to create Box-\n");
-                close(session_pipe);
-            }
-            break;
+static task_status_t request_end(request_task_t *request) {
+    if (request->rt_pipe != -1) {
+        scheduler_unwatch(request->rt_scheduler, request->rt_pipe);
+        close(request->rt_pipe);
+    }
+    reply_release(&request->rt_reply);
+    frame_put(FRAME_REQUEST, request);
+    return TASK_DONE;
+}
 
-        case 5:
-            if (remove_box(session_pipe, buffer, args->head, op_code) == -1) {
-                fprintf(stderr,"Unable to remove Box.\n");
-                close(session_pipe);
+static task_status_t request_run(task_t *task) {
+    request_task_t *request = (request_task_t *)task;
+
+    if (request->rt_pipe == -1) {
+        int opened = request_open(request);
+        if (opened == 0) {
+            // Try again later, waiting longer every time
+            scheduler_sleep(request->rt_scheduler, task,
+                            request->rt_open_delay);
+            request->rt_open_waited += request->rt_open_delay;
+            if (request->rt_open_delay < PIPE_OPEN_MAX_DELAY_MS) {
+                request->rt_open_delay *= 2;
             }
-            break;
+            return TASK_WAIT;
+        }
+        if (opened == -1) {
+            return request_end(request);
+        }
 
-        case 7:
-            if (list_box(session_pipe, args->head) == -1) {
-                fprintf(stderr,"Unable to list boxes.\n");
-                close(session_pipe);
+        handle_request(request);
+        if (request->rt_pipe == -1 || request->rt_reply.r_data == NULL) {
+            return request_end(request);
+        }
+    }
+
+    int replied = request_reply(request);
+    if (replied == 0) {
+        if (scheduler_watch(request->rt_scheduler, task, request->rt_pipe,
+                            EPOLLOUT) != 0) {
+            fprintf(stderr,"Unable to wait for Session's Pipe.\n");
+            return request_end(request);
+        }
+        return TASK_WAIT;
+    }
+    return request_end(request);
+}
+
+typedef struct stored_file {
+    char sf_name[BOX_SEGMENT_NAME_LENGTH];
+    size_t sf_size;
+    struct stored_file *sf_next;
+} stored_file_t;
+
+static void list_stored_file(char const *name, size_t size, void *arg) {
+    stored_file_t *stored = calloc(1, sizeof(stored_file_t));
+    if (stored == NULL) {
+        fprintf(stderr,"Unable to restore %s.\n", name);
+        return;
+    }
+    strncpy(stored->sf_name, name, BOX_SEGMENT_NAME_LENGTH - 1);
+    stored->sf_size = size;
+    stored->sf_next = *(stored_file_t **)arg;
+    *(stored_file_t **)arg = stored;
+}
+
+static int segment_compare(void const *a, void const *b) {
+    uint64_t first = ((box_segment_t const *)a)->bs_number;
+    uint64_t second = ((box_segment_t const *)b)->bs_number;
+    return first < second ? -1 : first > second;
+}
+
+/*
+ * Find the segments of a Box among the files stored, sorted (with their
+ * sizes, as their bs_used).
+ *
+ * Returns the segments (to be freed), or NULL if there are none or the memory
+ * could not be allocated.
+ */
+static box_segment_t *stored_segments(char const *box_name,
+                                      stored_file_t *stored, size_t *count) {
+    box_segment_t *segments = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    for (; stored != NULL; stored = stored->sf_next) {
+        char segment_box[BOX_NAME_LENGTH];
+        uint64_t number;
+        if (box_segment_parse(stored->sf_name, segment_box, &number) != 0 ||
+            strncmp(segment_box, box_name, BOX_NAME_LENGTH) != 0) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 8 : 2 * capacity;
+            box_segment_t *grown =
+                realloc(segments, capacity * sizeof(box_segment_t));
+            if (grown == NULL) {
+                free(segments);
+                *count = 0;
+                return NULL;
             }
-            break;
+            segments = grown;
+        }
+        segments[*count].bs_number = number;
+        segments[*count].bs_used = stored->sf_size;
+        (*count)++;
+    }
 
-        default:
-            fprintf(stderr,"Unknown OP_CODE given.\n");
+    if (*count > 0) {
+        qsort(segments, *count, sizeof(box_segment_t), segment_compare);
+    }
+    return segments;
+}
+
+static void restore_box(box_table_t *boxes, char *box_name,
+                        stored_file_t *stored) {
+    // The Box's retention, from its file
+    box_retention_t retention;
+    memset(&retention, 0, sizeof(box_retention_t));
+    int fhandle = tfs_open(box_name, 0);
+    if (fhandle != -1) {
+        tfs_read(fhandle, &retention, sizeof(box_retention_t));
+        tfs_close(fhandle);
+    }
+
+    tfs_file_t index;
+    int opened = box_index_open(box_name, &index);
+    size_t count;
+    box_segment_t *segments = stored_segments(box_name, stored, &count);
+    if (opened == -1 || segments == NULL) {
+        fprintf(stderr,"Unable to restore Box %s.\n", box_name);
+        free(segments);
+        return;
+    }
+
+    // Segments before a gap were left behind by drops cut short
+    size_t first = count - 1;
+    while (first > 0 &&
+           segments[first - 1].bs_number + 1 == segments[first].bs_number) {
+        first--;
+    }
+    for (size_t i = 0; i < first; i++) {
+        box_segment_unlink(box_name, segments[i].bs_number);
+    }
+
+    // The whole records are found (and indexed, if needed) from the Box's
+    // index: a Publisher may have been cut short writing the last ones
+    box_segment_reader_t reader;
+    box_segment_reader_init(&reader, box_name);
+    uint64_t records = 0;
+    size_t last_size = 0;
+    for (size_t i = first; i < count; i++) {
+        last_size = segments[i].bs_used;
+        box_segment_restore(&reader, index, segments[i].bs_number, last_size,
+                            &records, &segments[i - first]);
+    }
+    count -= first;
+
+    // Records are only appended after whole records, so the Publisher starts
+    // a new segment after one cut short
+    box_segment_t *last = &segments[count - 1];
+    if (last_size != BOX_SEGMENT_HEADER_LENGTH + last->bs_used) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        box_segment_t next = {.bs_number = last->bs_number + 1,
+                              .bs_used = 0,
+                              .bs_first_seq = records,
+                              .bs_created = (uint64_t)now.tv_sec * 1000000000u +
+                                            (uint64_t)now.tv_nsec};
+        fhandle = box_segment_create(box_name, next.bs_number,
+                                     next.bs_first_seq, next.bs_created);
+        if (fhandle == -1 || tfs_close(fhandle) == -1) {
+            fprintf(stderr,"Unable to restore Box %s.\n", box_name);
+            free(segments);
+            return;
         }
+        segments[count++] = next;
+    }
 
-        buffer -= (UINT8_T_SIZE + PIPE_NAME_LENGTH);
-        free(buffer);
+    if (insertBox(boxes, box_name, records, index, &retention, segments,
+                  count) == -1) {
+        fprintf(stderr,"Unable to restore Box %s.\n", box_name);
     }
-    return 0;
+    free(segments);
+}
+
+/*
+ * Restore the Boxes of the store, once its files are all listed (as restoring
+ * a Box changes the TFS).
+ *
+ * Returns 0 if successful, -1 if unable to list them.
+ */
+static int restore_boxes(box_table_t *boxes) {
+    stored_file_t *stored = NULL;
+    int result = tfs_list(list_stored_file, &stored);
+
+    // The files of the Boxes' segments, index and cursors are named after
+    // them
+    for (stored_file_t *file = stored; result == 0 && file != NULL;
+         file = file->sf_next) {
+        if (strchr(file->sf_name, BOX_FILE_MARK) == NULL) {
+            restore_box(boxes, file->sf_name, stored);
+        }
+    }
+
+    while (stored != NULL) {
+        stored_file_t *next = stored->sf_next;
+        free(stored);
+        stored = next;
+    }
+    return result;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr,"Instead of 3 arguments, %d were passed.\n", argc);
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr,"Instead of 3 to 5 arguments, %d were passed.\n", argc);
+        fprintf(stderr,
+                "Usage: %s <register_pipe_name> <max_sessions> [store_path] "
+                "[--delay=<iterations>]\n"
+                "  max_sessions: number of workers serving the sessions\n"
+                "  store_path: file keeping the Boxes across restarts\n"
+                "  --delay: latency of every access to TFS, in busy-loop "
+                "iterations\n",
+                argv[0]);
+        return -1;
+    }
+
+    // TFS's storage latency is emulated as configured by default, unless
+    // --delay=<iterations> sets it (e.g., 0 to run purely in memory)
+    tfs_params params = tfs_default_params();
+    char const *store_path = NULL;
+    for (int i = 3; i < argc; i++) {
+        if (strncmp(argv[i], "--delay=", 8) == 0) {
+            char *end;
+            errno = 0;
+            unsigned long delay = strtoul(argv[i] + 8, &end, 10);
+            if (errno != 0 || end == argv[i] + 8 || *end != '\0' ||
+                argv[i][8] == '-') {
+                fprintf(stderr,"Invalid delay %s.\n", argv[i] + 8);
+                return -1;
+            }
+            for (size_t j = 0; j < TFS_DELAY_CLASSES; j++) {
+                params.delay[j] = delay;
+            }
+        } else if (store_path == NULL && strncmp(argv[i], "--", 2) != 0) {
+            store_path = argv[i];
+        } else {
+            fprintf(stderr,"Unknown option %s.\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // A Subscriber leaving must only end its own session
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        fprintf(stderr,"Unable to set signal handler.\n");
         return -1;
     }
 
     // Start TFS
-    if (tfs_init(NULL) != 0) {
+    // With a store path, the Boxes are kept in (and restored from) that file,
+    // and messages are logged in "<store path>.wal" before being published
+    char wal_path[PATH_MAX];
+    if (store_path != NULL) {
+        if (snprintf(wal_path, PATH_MAX, "%s.wal", store_path) >= PATH_MAX) {
+            fprintf(stderr,"Store path too long.\n");
+            return -1;
+        }
+        params.store_path = store_path;
+        params.wal_path = wal_path;
+    }
+    if (tfs_init(&params) != 0) {
         fprintf(stderr,"Unable to start TFS.\n");
         return -1;
     }
@@ -425,9 +1636,10 @@ int main(int argc, char **argv) {
            PIPE_NAME_LENGTH - strlen(PIPE_PATH));
 
     char *c;
+    errno = 0;
     long max_sessions = strtol(argv[2], &c, 10);
     if (errno != 0 || *c != '\0' || max_sessions > INT_MAX ||
-        max_sessions < INT_MIN) {
+        max_sessions < 1) {
         fprintf(stderr,"Invalid Max Sessions value.\n");
         tfs_destroy();
         return -1;
@@ -445,41 +1657,46 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    // Linked list to store all the Boxes that are created
-    struct Box *head = NULL;
+    // Hash table to store all the Boxes that are created
+    box_table_t *boxes = malloc(sizeof(box_table_t));
+    if (boxes == NULL || box_table_create(boxes) != 0) {
+        fprintf(stderr,"Unable to create Box table.\n");
+        tfs_destroy();
+        unlink(server_pipe_name);
+        return -1;
+    }
 
-    pc_queue_t *queue = malloc(sizeof(pc_queue_t));
-    if (queue == NULL) {
-        fprintf(stderr,"Unable to alloc for queue.\n");
+    // Boxes restored from the store
+    if (restore_boxes(boxes) != 0) {
+        fprintf(stderr,"Unable to restore Boxes.\n");
         tfs_destroy();
         unlink(server_pipe_name);
+        box_table_destroy(boxes);
         return -1;
     }
-    pcq_create(queue, QUEUE_CAPACITY);
 
-    // Create Worker Threads for each Session
-    pthread_t sessions_tid[max_sessions];
-    thread_args *args = malloc(sizeof(thread_args));
-    if (args == NULL) {
-        fprintf(stderr,"Unable to alloc for thread args.\n");
+    // Buffers of the requests, messages and answers handled by the Server
+    if (frame_pool_init() != 0) {
+        fprintf(stderr,"Unable to create frame pools.\n");
         tfs_destroy();
         unlink(server_pipe_name);
-        pcq_destroy(queue);
-        free(queue);
+        box_table_destroy(boxes);
         return -1;
     }
-    args->queue = queue;
-    args->head = head;
-    for (int i = 0; i < max_sessions; i++) {
-        if (pthread_create(&sessions_tid[i], NULL, working_thread, args) != 0) {
-            fprintf(stderr,"Error creating Thread(%d)\n", i);
-            tfs_destroy();
-            unlink(server_pipe_name);
-            destroy_list(head);
-            pcq_destroy(queue);
-            free(queue);
-            return -1;
-        }
+
+    // Sessions are run by a pool of workers, one per core (and at most
+    // max_sessions), which only block briefly: waiting sessions are parked
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_workers = cores > 0 && cores < max_sessions ? (size_t)cores
+                                                         : (size_t)max_sessions;
+    scheduler_t *scheduler = malloc(sizeof(scheduler_t));
+    if (scheduler == NULL ||
+        scheduler_create(scheduler, n_workers, frame_cache_flush) != 0) {
+        fprintf(stderr,"Unable to start session scheduler.\n");
+        tfs_destroy();
+        unlink(server_pipe_name);
+        box_table_destroy(boxes);
+        return -1;
     }
 
     int server_pipe = open(server_pipe_name, O_RDONLY);
@@ -487,9 +1704,7 @@ int main(int argc, char **argv) {
         fprintf(stderr,"Unable to open Server's Pipe.\n");
         tfs_destroy();
         unlink(server_pipe_name);
-        destroy_list(head);
-        pcq_destroy(queue);
-        free(queue);
+        box_table_destroy(boxes);
         return -1;
     }
     int dummy_server_pipe = open(server_pipe_name, O_WRONLY);
@@ -498,60 +1713,97 @@ int main(int argc, char **argv) {
         close(server_pipe);
         tfs_destroy();
         unlink(server_pipe_name);
-        pcq_destroy(queue);
-        destroy_list(head);
-        free(queue);
+        box_table_destroy(boxes);
         return -1;
     }
 
+    /*  Read requests in large chunks: each read may bring many requests
+     *  (and the beginning of one more, kept for the next read), which are
+     *  split into frames, each copied into its own pooled request, and
+     *  submitted to the scheduler in batches.
+     */
     int run = TRUE;
-    void *message = calloc(REQUEST_LENGTH, sizeof(char));
+    char *message = calloc(REGISTER_BUFFER_SIZE, sizeof(char));
+    if (message == NULL) {
+        fprintf(stderr,"Unable to alloc memory to read requests.\n");
+        tfs_destroy();
+        close(server_pipe);
+        close(dummy_server_pipe);
+        unlink(server_pipe_name);
+        box_table_destroy(boxes);
+        return -1;
+    }
+    task_t *batch[REQUEST_BATCH];
+    size_t filled = 0;
     while (run) {
-        if (read(server_pipe, message, REQUEST_LENGTH) == -1) {
+        ssize_t bytes_read =
+            read(server_pipe, message + filled, REGISTER_BUFFER_SIZE - filled);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             fprintf(stderr,"Unable to read message to Server Pipe.\n");
             tfs_destroy();
             close(server_pipe);
             unlink(server_pipe_name);
-            pcq_destroy(queue);
-            destroy_list(head);
+            box_table_destroy(boxes);
             free(message);
-            free(queue);
             return -1;
         }
+        filled += (size_t)bytes_read;
+
+        size_t offset = 0;
+        size_t batched = 0;
+        while (offset < filled) {
+            uint8_t op_code = (uint8_t)message[offset];
+            size_t length = request_length(op_code);
+            if (length == 0) {
+                // Unable to find where the next request starts
+                fprintf(stderr,"Unknown OP_CODE given, dropping requests.\n");
+                offset = filled;
+                break;
+            }
+            if (filled - offset < length) {
+                break; // incomplete request
+            }
 
-        if (pcq_enqueue(queue, message) == -1) {
-            fprintf(stderr,"Unable to queue request.\n");
-            tfs_destroy();
-            close(server_pipe);
-            unlink(server_pipe_name);
-            pcq_destroy(queue);
-            destroy_list(head);
-            free(message);
-            free(queue);
-            return -1;
+            request_task_t *request = frame_get(FRAME_REQUEST);
+            if (request == NULL) {
+                fprintf(stderr,"Unable to alloc memory to queue request.\n");
+                offset += length;
+                continue;
+            }
+            memcpy(request->rt_request, message + offset, length);
+            memset(request->rt_request + length, 0,
+                   MAX_REQUEST_LENGTH - length);
+
+            scheduler_task_init(&request->rt_task, request_run);
+            request->rt_boxes = boxes;
+            request->rt_scheduler = scheduler;
+            request->rt_pipe = -1;
+            request->rt_open_delay = PIPE_OPEN_MIN_DELAY_MS;
+            request->rt_open_waited = 0;
+            memset(&request->rt_reply, 0, sizeof(reply_t));
+            batch[batched++] = &request->rt_task;
+            if (batched == REQUEST_BATCH) {
+                scheduler_submit_batch(scheduler, batch, batched);
+                batched = 0;
+            }
+            offset += length;
         }
+        scheduler_submit_batch(scheduler, batch, batched);
 
-        memset(message, 0, REQUEST_LENGTH);
+        memmove(message, message + offset, filled - offset);
+        filled -= offset;
     }
 
     free(message);
 
-    for (int i = 0; i < max_sessions; i++) {
-        if (pthread_join(sessions_tid[i], NULL) != 0) {
-            fprintf(stderr,"Error creating Thread(%d)\n", i);
-            tfs_destroy();
-            close(server_pipe);
-            unlink(server_pipe_name);
-            pcq_destroy(queue);
-            destroy_list(head);
-            free(queue);
-            return -1;
-        }
-    }
-
-    pcq_destroy(queue);
-    destroy_list(head);
-    free(queue);
+    scheduler_destroy(scheduler);
+    free(scheduler);
+    frame_pool_destroy();
+    box_table_destroy(boxes);
+    free(boxes);
 
     if (close(server_pipe) == -1) {
         fprintf(stderr,"Error closing Server's Pipe.\n");
@@ -572,4 +1824,4 @@ int main(int argc, char **argv) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,190 @@
+#include "lockfree-queue.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Failed attempts before a producer/consumer goes to sleep
+#define LFQ_SPIN_TRIES (64)
+
+int lfq_create(lf_queue_t *queue, size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity) {
+        rounded <<= 1;
+    }
+
+    queue->lfq_slots = (lf_slot_t *)malloc(rounded * sizeof(lf_slot_t));
+    if (queue->lfq_slots == NULL) {
+        return -1;
+    }
+
+    queue->lfq_capacity = rounded;
+    queue->lfq_mask = rounded - 1;
+    for (size_t i = 0; i < rounded; i++) {
+        atomic_init(&queue->lfq_slots[i].lfs_sequence, i);
+        queue->lfq_slots[i].lfs_elem = NULL;
+    }
+
+    atomic_init(&queue->lfq_head, 0);
+    atomic_init(&queue->lfq_tail, 0);
+    atomic_init(&queue->lfq_sleeping_consumers, 0);
+    atomic_init(&queue->lfq_sleeping_producers, 0);
+
+    if (pthread_mutex_init(&queue->lfq_sleep_lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&queue->lfq_not_empty, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&queue->lfq_not_full, NULL) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int lfq_destroy(lf_queue_t *queue) {
+
+    free(queue->lfq_slots);
+
+    if (pthread_mutex_destroy(&queue->lfq_sleep_lock) != 0) {
+        return -1;
+    }
+    if (pthread_cond_destroy(&queue->lfq_not_empty) != 0) {
+        return -1;
+    }
+    if (pthread_cond_destroy(&queue->lfq_not_full) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool lfq_try_enqueue(lf_queue_t *queue, void *elem) {
+    size_t pos = atomic_load_explicit(&queue->lfq_head, memory_order_relaxed);
+    lf_slot_t *slot;
+
+    while (true) {
+        slot = &queue->lfq_slots[pos & queue->lfq_mask];
+        size_t seq =
+            atomic_load_explicit(&slot->lfs_sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Slot free for this position: claim it
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->lfq_head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // still holds the element of the previous lap: full
+        } else {
+            pos = atomic_load_explicit(&queue->lfq_head, memory_order_relaxed);
+        }
+    }
+
+    slot->lfs_elem = elem;
+    atomic_store_explicit(&slot->lfs_sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool lfq_try_dequeue(lf_queue_t *queue, void **elem) {
+    size_t pos = atomic_load_explicit(&queue->lfq_tail, memory_order_relaxed);
+    lf_slot_t *slot;
+
+    while (true) {
+        slot = &queue->lfq_slots[pos & queue->lfq_mask];
+        size_t seq =
+            atomic_load_explicit(&slot->lfs_sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            // Slot written for this position: claim it
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->lfq_tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; // not written yet: empty
+        } else {
+            pos = atomic_load_explicit(&queue->lfq_tail, memory_order_relaxed);
+        }
+    }
+
+    *elem = slot->lfs_elem;
+    // Free the slot for the position one lap ahead
+    atomic_store_explicit(&slot->lfs_sequence, pos + queue->lfq_mask + 1,
+                          memory_order_release);
+    return true;
+}
+
+/*
+ * Wake up a sleeper on the other side, if there is one.
+ *
+ * Sleepers register themselves (under lfq_sleep_lock) before checking the
+ * queue a last time, and the fence orders the caller's operation before the
+ * check for sleepers, so either the sleeper sees the operation or the caller
+ * sees the sleeper, which is then already waiting once the lock is taken.
+ */
+static void lfq_wake(lf_queue_t *queue, atomic_size_t *sleepers,
+                     pthread_cond_t *cond) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(sleepers, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->lfq_sleep_lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&queue->lfq_sleep_lock);
+}
+
+int lfq_enqueue(lf_queue_t *queue, void *elem) {
+    bool done = false;
+    for (int i = 0; i < LFQ_SPIN_TRIES && !done; i++) {
+        done = lfq_try_enqueue(queue, elem);
+    }
+
+    if (!done) {
+        // Full: sleep until a consumer frees a slot
+        if (pthread_mutex_lock(&queue->lfq_sleep_lock) != 0) {
+            return -1;
+        }
+        atomic_fetch_add(&queue->lfq_sleeping_producers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!lfq_try_enqueue(queue, elem)) {
+            pthread_cond_wait(&queue->lfq_not_full, &queue->lfq_sleep_lock);
+        }
+        atomic_fetch_sub(&queue->lfq_sleeping_producers, 1);
+        pthread_mutex_unlock(&queue->lfq_sleep_lock);
+    }
+
+    lfq_wake(queue, &queue->lfq_sleeping_consumers, &queue->lfq_not_empty);
+    return 0;
+}
+
+void *lfq_dequeue(lf_queue_t *queue) {
+    void *elem;
+    bool done = false;
+    for (int i = 0; i < LFQ_SPIN_TRIES && !done; i++) {
+        done = lfq_try_dequeue(queue, &elem);
+    }
+
+    if (!done) {
+        // Empty: sleep until a producer inserts an element
+        if (pthread_mutex_lock(&queue->lfq_sleep_lock) != 0) {
+            return NULL;
+        }
+        atomic_fetch_add(&queue->lfq_sleeping_consumers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!lfq_try_dequeue(queue, &elem)) {
+            pthread_cond_wait(&queue->lfq_not_empty, &queue->lfq_sleep_lock);
+        }
+        atomic_fetch_sub(&queue->lfq_sleeping_consumers, 1);
+        pthread_mutex_unlock(&queue->lfq_sleep_lock);
+    }
+
+    lfq_wake(queue, &queue->lfq_sleeping_producers, &queue->lfq_not_full);
+    return elem;
+}
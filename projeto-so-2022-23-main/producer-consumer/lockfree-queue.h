@@ -0,0 +1,62 @@
+#ifndef __LOCKFREE_QUEUE_H__
+#define __LOCKFREE_QUEUE_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Bounded multi-producer multi-consumer queue, with the same semantics as the
+// producer-consumer queue (pcq_*), but where enqueues and dequeues only take
+// a lock to sleep (when the queue is full or empty) or to wake up sleepers.
+//
+// Each slot holds a sequence number telling whether it is ready to be written
+// (sequence == position) or read (sequence == position + 1) by the operation
+// at a given position, so producers and consumers only contend on the head
+// and tail counters, each in its own cache line.
+
+#define LFQ_CACHE_LINE (64)
+
+typedef struct {
+    atomic_size_t lfs_sequence;
+    void *lfs_elem;
+} lf_slot_t;
+
+typedef struct {
+    lf_slot_t *lfq_slots;
+    size_t lfq_capacity;
+    size_t lfq_mask;
+
+    _Alignas(LFQ_CACHE_LINE) atomic_size_t lfq_head;
+
+    _Alignas(LFQ_CACHE_LINE) atomic_size_t lfq_tail;
+
+    _Alignas(LFQ_CACHE_LINE) pthread_mutex_t lfq_sleep_lock;
+    pthread_cond_t lfq_not_empty;
+    pthread_cond_t lfq_not_full;
+    atomic_size_t lfq_sleeping_consumers;
+    atomic_size_t lfq_sleeping_producers;
+} lf_queue_t;
+
+// lfq_create: create a queue, with a given (fixed) capacity, rounded up to a
+// power of two
+//
+// Memory: the queue pointer must be previously allocated with LFQ_CACHE_LINE
+// alignment (e.g., on the stack or with aligned_alloc)
+int lfq_create(lf_queue_t *queue, size_t capacity);
+
+// lfq_destroy: releases the internal resources of the queue
+//
+// Memory: does not free the queue pointer itself
+int lfq_destroy(lf_queue_t *queue);
+
+// lfq_enqueue: insert a new element at the front of the queue
+//
+// If the queue is full, sleep until the queue has space
+int lfq_enqueue(lf_queue_t *queue, void *elem);
+
+// lfq_dequeue: remove an element from the back of the queue
+//
+// If the queue is empty, sleep until the queue has an element
+void *lfq_dequeue(lf_queue_t *queue);
+
+#endif // __LOCKFREE_QUEUE_H__
@@ -8,7 +8,8 @@
 
 int pcq_create(pc_queue_t *queue, size_t capacity) {
 
-    queue->pcq_buffer = (void **)malloc(capacity * sizeof(void *));
+    // Empty slots are NULL, as enqueueing frees what a slot held before
+    queue->pcq_buffer = (void **)calloc(capacity, sizeof(void *));
     if (queue->pcq_buffer == NULL) {
         return -1;
     }
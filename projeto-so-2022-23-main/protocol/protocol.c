@@ -0,0 +1,160 @@
+#include "protocol.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void frame_header(void *header, uint8_t code, uint32_t length) {
+    memcpy(header, &code, sizeof(uint8_t));
+    memcpy((char *)header + sizeof(uint8_t), &length, sizeof(uint32_t));
+}
+
+ssize_t read_full(int fd, void *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytes_read = read(fd, (char *)buffer + done, length - done);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        done += (size_t)bytes_read;
+    }
+    return (ssize_t)done;
+}
+
+int write_full(int fd, void const *buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t written = write(fd, (char const *)buffer + done, length - done);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)written;
+    }
+    return 0;
+}
+
+int writev_full(int fd, struct iovec *iov, size_t n_iov) {
+    while (n_iov > 0) {
+        ssize_t written = writev(fd, iov, (int)n_iov);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        size_t left = (size_t)written;
+        while (n_iov > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+int frame_write(int fd, uint8_t code, void const *message, uint32_t length) {
+    char header[FRAME_HEADER_LENGTH];
+    frame_header(header, code, length);
+
+    // A single write, so frames up to PIPE_BUF bytes are written atomically
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = FRAME_HEADER_LENGTH},
+        {.iov_base = (void *)message, .iov_len = length},
+    };
+    return writev_full(fd, iov, 2);
+}
+
+void frame_reader_init(frame_reader_t *reader, int fd, char *buffer,
+                       size_t capacity) {
+    reader->fr_fd = fd;
+    reader->fr_buffer = buffer;
+    reader->fr_capacity = capacity;
+    reader->fr_start = 0;
+    reader->fr_end = 0;
+}
+
+/*
+ * Read until the reader holds at least length unconsumed bytes.
+ *
+ * Returns 1 if it does, 0 if the end of file came first, -1 on error.
+ */
+static int frame_reader_fill(frame_reader_t *reader, size_t length) {
+    if (reader->fr_end - reader->fr_start >= length) {
+        return 1;
+    }
+
+    // Make room after the bytes not yet consumed
+    if (reader->fr_start + length > reader->fr_capacity) {
+        memmove(reader->fr_buffer, reader->fr_buffer + reader->fr_start,
+                reader->fr_end - reader->fr_start);
+        reader->fr_end -= reader->fr_start;
+        reader->fr_start = 0;
+    }
+
+    while (reader->fr_end - reader->fr_start < length) {
+        ssize_t bytes_read =
+            read(reader->fr_fd, reader->fr_buffer + reader->fr_end,
+                 reader->fr_capacity - reader->fr_end);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (bytes_read == 0) {
+            return 0;
+        }
+        reader->fr_end += (size_t)bytes_read;
+    }
+    return 1;
+}
+
+int frame_reader_ready(frame_reader_t const *reader) {
+    size_t available = reader->fr_end - reader->fr_start;
+    if (available < FRAME_HEADER_LENGTH) {
+        return 0;
+    }
+
+    uint32_t length;
+    memcpy(&length, reader->fr_buffer + reader->fr_start + sizeof(uint8_t),
+           sizeof(uint32_t));
+    return available - FRAME_HEADER_LENGTH >= length;
+}
+
+int frame_reader_next(frame_reader_t *reader, uint8_t *code, char **message,
+                      uint32_t *length) {
+    int filled = frame_reader_fill(reader, FRAME_HEADER_LENGTH);
+    if (filled != 1) {
+        // End of file in the middle of a header
+        return filled == 0 && reader->fr_start == reader->fr_end ? 0 : -1;
+    }
+
+    char *header = reader->fr_buffer + reader->fr_start;
+    memcpy(code, header, sizeof(uint8_t));
+    memcpy(length, header + sizeof(uint8_t), sizeof(uint32_t));
+    if (*length > reader->fr_capacity - FRAME_HEADER_LENGTH) {
+        return -1;
+    }
+
+    if (frame_reader_fill(reader, FRAME_HEADER_LENGTH + *length) != 1) {
+        return -1;
+    }
+
+    *message = reader->fr_buffer + reader->fr_start + FRAME_HEADER_LENGTH;
+    reader->fr_start += FRAME_HEADER_LENGTH + *length;
+    return 1;
+}
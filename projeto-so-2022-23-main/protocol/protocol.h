@@ -0,0 +1,79 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Messages exchanged between Publishers, the Server and Subscribers are sent
+// in variable-length frames:
+//
+//   [ code (uint8_t) ] | [ length (uint32_t) ] | [ message (char[length]) ]
+//
+// where the message is not '\0' terminated. Both integers are in the host's
+// byte order, as the Pipes never leave the machine.
+
+#define FRAME_HEADER_LENGTH (sizeof(uint8_t) + sizeof(uint32_t))
+
+// frame_header: fill header (FRAME_HEADER_LENGTH bytes) for a frame with the
+// given code and message length
+void frame_header(void *header, uint8_t code, uint32_t length);
+
+// read_full: read length bytes into buffer, even if in several reads
+//
+// Returns the number of bytes read (less than length only at end of file), or
+// -1 on error
+ssize_t read_full(int fd, void *buffer, size_t length);
+
+// write_full: write length bytes from buffer, even if in several writes
+//
+// Returns 0 if successful, -1 otherwise
+int write_full(int fd, void const *buffer, size_t length);
+
+// writev_full: write every byte described by the n_iov buffers of iov, even if
+// in several writes (iov is changed in the process)
+//
+// Returns 0 if successful, -1 otherwise
+int writev_full(int fd, struct iovec *iov, size_t n_iov);
+
+// frame_write: write a frame with the given code and message
+//
+// Returns 0 if successful, -1 otherwise
+int frame_write(int fd, uint8_t code, void const *message, uint32_t length);
+
+/*
+ * Reader of the frames coming from a Pipe.
+ *
+ * Frames are read into the given buffer as many as fit at a time, so a Pipe
+ * holding many small frames is drained in few reads.
+ */
+typedef struct {
+    int fr_fd;
+    char *fr_buffer;
+    size_t fr_capacity;
+    size_t fr_start; // first byte not yet consumed
+    size_t fr_end;   // end of the bytes read
+} frame_reader_t;
+
+// frame_reader_init: read frames of fd into buffer, of capacity bytes, which
+// bounds the longest frame accepted
+void frame_reader_init(frame_reader_t *reader, int fd, char *buffer,
+                       size_t capacity);
+
+// frame_reader_ready: whether the next frame is already in the reader's
+// buffer, in which case frame_reader_next neither reads nor invalidates the
+// messages it returned before
+int frame_reader_ready(frame_reader_t const *reader);
+
+// frame_reader_next: read the next frame, setting *message to its message
+// (inside the reader's buffer, valid until the following call)
+//
+// Returns 1 if a frame was read, 0 at end of file (between frames), or -1 on
+// error, on a frame cut short, or on a frame longer than the buffer; on a
+// non-blocking fd, -1 with errno EAGAIN keeps what was read, to call again once
+// fd is readable
+int frame_reader_next(frame_reader_t *reader, uint8_t *code, char **message,
+                      uint32_t *length);
+
+#endif // __PROTOCOL_H__
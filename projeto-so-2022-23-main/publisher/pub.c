@@ -12,6 +12,9 @@
 #include <unistd.h>
 #include <signal.h>
 
+#define PUB_READ_BUFFER (64 * 1024)
+#define PUB_WRITE_BUFFER (64 * 1024)
+
 static volatile int running = TRUE;
 
 void sigpipe_handler() { running = FALSE; }
@@ -37,12 +40,13 @@ int register_pub(int server_pipe, char *session_pipe_name, char *box) {
     memcpy(message, session_pipe_name, pipe_n_bytes);
     message += PIPE_NAME_LENGTH;
 
-    // Box FIXME falta '/' para tfs_directory
-    size_t box_n_bytes =
-        strlen(box) > BOX_NAME_LENGTH ? BOX_NAME_LENGTH : strlen(box);
-    memcpy(message, box, box_n_bytes);
+    // Box (as a TFS path, like the Manager sends it)
+    char tfs_directory = '/';
+    memcpy(message, &tfs_directory, sizeof(char));
+    message += sizeof(char);
+    memcpy(message, box, strlen(box));
 
-    message -= (UINT8_T_SIZE + PIPE_NAME_LENGTH);
+    message -= (UINT8_T_SIZE + PIPE_NAME_LENGTH + 1);
 
     if (write(server_pipe, message, REQUEST_LENGTH) == -1) {
         fprintf(stderr,"Unable to write message.\n");
@@ -54,28 +58,128 @@ int register_pub(int server_pipe, char *session_pipe_name, char *box) {
     return 0;
 }
 
-ssize_t send_message(int session_pipe, char *message) {
+/*
+ * Frames waiting to be written into the Session's Pipe, so that many
+ * messages are sent in a single write.
+ */
+typedef struct {
+    int ob_pipe;
+    char *ob_data;
+    size_t ob_used;
+} out_buffer_t;
+
+int flush_messages(out_buffer_t *out) {
 
-    // Function to write from a Buffer into a Pipe
+    // Function to write the buffered frames into the Pipe
 
-    void *to_send = calloc(MESSAGE_SIZE + UINT8_T_SIZE, sizeof(char));
-    if (to_send == NULL) {
-        fprintf(stderr,"Unable to alloc memory to send message.\n");
+    if (out->ob_used == 0) {
+        return 0;
+    }
+    if (write_full(out->ob_pipe, out->ob_data, out->ob_used) == -1) {
         return -1;
     }
+    out->ob_used = 0;
+    return 0;
+}
 
-    memcpy(to_send, &PUB_2_SERVER, UINT8_T_SIZE);
-    to_send += UINT8_T_SIZE;
+int send_message(out_buffer_t *out, char const *message, size_t length) {
 
-    memcpy(to_send, message, strlen(message));
-    to_send -= UINT8_T_SIZE;
+    // Function to add a message to the buffered frames, truncating it to
+    // MESSAGE_SIZE - 1 bytes
 
-    ssize_t bytes_written =
-        write(session_pipe, to_send, MESSAGE_SIZE + UINT8_T_SIZE);
+    if (length > MESSAGE_SIZE - 1) {
+        length = MESSAGE_SIZE - 1;
+    }
 
-    free(to_send);
+    if (out->ob_used + FRAME_HEADER_LENGTH + length > PUB_WRITE_BUFFER &&
+        flush_messages(out) == -1) {
+        return -1;
+    }
 
-    return bytes_written;
+    frame_header(out->ob_data + out->ob_used, PUB_2_SERVER, (uint32_t)length);
+    memcpy(out->ob_data + out->ob_used + FRAME_HEADER_LENGTH, message, length);
+    out->ob_used += FRAME_HEADER_LENGTH + length;
+    return 0;
+}
+
+int publish_input(int session_pipe) {
+
+    // Function to send every line of the Stdin as a message
+
+    char *input = malloc(PUB_READ_BUFFER);
+    char *output = malloc(PUB_WRITE_BUFFER);
+    if (input == NULL || output == NULL) {
+        fprintf(stderr,"Unable to alloc memory to read messages.\n");
+        free(input);
+        free(output);
+        return -1;
+    }
+    out_buffer_t out = {.ob_pipe = session_pipe, .ob_data = output, .ob_used = 0};
+
+    // Bytes of input not yet sent, and whether the line they start was already
+    // sent (truncated) and must be skipped
+    size_t filled = 0;
+    int truncated = FALSE;
+    int result = 0;
+
+    while (running) {
+        ssize_t bytes_read =
+            read(STDIN_FILENO, input + filled, PUB_READ_BUFFER - filled);
+        if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr,"Unable to read from Stdin.\n");
+            result = -1;
+            break;
+        }
+        int eof = bytes_read == 0;
+        filled += (size_t)bytes_read;
+
+        size_t start = 0;
+        while (start < filled && result == 0) {
+            char *newline = memchr(input + start, '\n', filled - start);
+            size_t end = newline != NULL ? (size_t)(newline - input) : filled;
+
+            if (newline == NULL && !eof) {
+                // Keep the beginning of the line for the next read, unless it
+                // is already too long for a message
+                if (truncated || end - start < MESSAGE_SIZE - 1) {
+                    if (truncated) {
+                        start = filled;
+                    }
+                    break;
+                }
+                result = send_message(&out, input + start, end - start);
+                truncated = TRUE;
+                start = filled;
+                break;
+            }
+
+            if (!truncated) {
+                result = send_message(&out, input + start, end - start);
+            }
+            truncated = FALSE;
+            start = end + 1;
+        }
+
+        if (result == 0) {
+            result = flush_messages(&out);
+        }
+        if (result == -1 || eof) {
+            break;
+        }
+
+        memmove(input, input + start, filled - start);
+        filled -= start;
+    }
+
+    if (result == -1 && running) {
+        fprintf(stderr,"Unable to write message.\n");
+    }
+    free(input);
+    free(output);
+    return result;
 }
 
 int pub_destroy(int session_pipe, char *session_pipe_name) {
@@ -102,6 +206,13 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    // Longer names are rejected rather than cut short (naming another Box)
+    if (strlen(argv[3]) > BOX_NAME_MAX) {
+        fprintf(stderr,"Box name %s is longer than %zu characters.\n", argv[3],
+                BOX_NAME_MAX);
+        return -1;
+    }
+
     // Server's Pipe name
     char *server_pipe_name = calloc(PIPE_NAME_LENGTH, sizeof(char));
     memcpy(server_pipe_name, PIPE_PATH, strlen(PIPE_PATH));
@@ -169,8 +280,10 @@ int main(int argc, char **argv) {
     }
 
     /*  Write messages written in the Stdin to Session's Pipe.
-     *  Messages end with a '\n' that gets replaced with a '\0'.
-     *  If a message is bigger than 1024 bytes, it gets truncated.
+     *  Messages end with a '\n' (the last one may end with EOF instead).
+     *  If a message is bigger than MESSAGE_SIZE - 1 bytes, it gets truncated.
+     *  Stdin is read in chunks of PUB_READ_BUFFER bytes, and the messages of
+     *  each chunk are written into the Pipe together.
      *  Stops reading from the Stdin and writtin to the Pipe when EOF
      *  is reached (CTRL-D is pressed).
      */
@@ -181,31 +294,9 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    char c = 'a';
-    size_t i = 0;
-    char buffer[MESSAGE_SIZE];
-    memset(buffer, 0, MESSAGE_SIZE);
-
-    while ((c = (char)getchar()) != EOF && running) {
-        if (i < MESSAGE_SIZE - 1) {
-            if (c == '\n') {
-                c = '\0';
-                i = MESSAGE_SIZE - 1;
-            }
-            buffer[i] = c;
-        }
-
-        if (i >= MESSAGE_SIZE - 1) {
-            if (send_message(session_pipe, buffer) < 0) {
-                fprintf(stderr,"Unable to write message.\n");
-                pub_destroy(session_pipe, session_pipe_name);
-                return -1;
-            }
-            i = 0;
-            memset(buffer, 0, MESSAGE_SIZE);
-        }
-
-        i++;
+    if (publish_input(session_pipe) == -1) {
+        pub_destroy(session_pipe, session_pipe_name);
+        return -1;
     }
 
     if (pub_destroy(session_pipe, session_pipe_name) != 0) {
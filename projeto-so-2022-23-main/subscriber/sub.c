@@ -12,15 +12,20 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#define SUB_READ_BUFFER (64 * 1024)
+#define SUB_OUTPUT_BATCH (256)
+
 static volatile int running = TRUE;
 
 void sigint_handler() { running = FALSE; }
 
-int register_sub(int server_pipe, char *session_pipe_name, char *box) {
+int register_sub(int server_pipe, char *session_pipe_name, char *box,
+                 uint8_t start_kind, uint64_t start_value,
+                 char const *cursor_name) {
 
     // Function to register the Subscriber in the Server
 
-    void *message = calloc(REQUEST_LENGTH, sizeof(char));
+    void *message = calloc(SUB_REQUEST_LENGTH, sizeof(char));
     if (message == NULL) {
         fprintf(stderr,"Unable to alloc memory to register Subscriber.\n");
         return -1;
@@ -37,14 +42,27 @@ int register_sub(int server_pipe, char *session_pipe_name, char *box) {
     memcpy(message, session_pipe_name, pipe_n_bytes);
     message += PIPE_NAME_LENGTH;
 
-    // Box FIXME falta '/' para tfs_directory
-    size_t box_n_bytes =
-        strlen(box) > BOX_NAME_LENGTH ? BOX_NAME_LENGTH : strlen(box);
-    memcpy(message, box, box_n_bytes);
+    // Box (as a TFS path, like the Manager sends it)
+    char tfs_directory = '/';
+    memcpy(message, &tfs_directory, sizeof(char));
+    message += sizeof(char);
+    memcpy(message, box, strlen(box));
+    message += BOX_NAME_LENGTH - 1;
+
+    // Where to start reading the Box
+    memcpy(message, &start_kind, UINT8_T_SIZE);
+    memcpy(message + UINT8_T_SIZE, &start_value, sizeof(uint64_t));
+    message += UINT8_T_SIZE + sizeof(uint64_t);
+
+    // Cursor to resume from (and keep), if any
+    if (cursor_name != NULL) {
+        memcpy(message, cursor_name, strlen(cursor_name));
+    }
 
-    message -= (UINT8_T_SIZE + PIPE_NAME_LENGTH);
+    message -= (UINT8_T_SIZE + PIPE_NAME_LENGTH + BOX_NAME_LENGTH +
+                UINT8_T_SIZE + sizeof(uint64_t));
 
-    if (write(server_pipe, message, REQUEST_LENGTH) == -1) {
+    if (write(server_pipe, message, SUB_REQUEST_LENGTH) == -1) {
         fprintf(stderr,"Unable to write message.\n");
         free(message);
         return -1;
@@ -54,25 +72,18 @@ int register_sub(int server_pipe, char *session_pipe_name, char *box) {
     return 0;
 }
 
-int read_message(int session_pipe, char *buffer) {
+static char const newline = '\n';
 
-    // Function to read from a Pipe into a Buffer
+int write_output(struct iovec *iov, size_t *n_iov) {
 
-    void *message = calloc(MESSAGE_SIZE + UINT8_T_SIZE, sizeof(char));
-    if (message == NULL) {
-        fprintf(stderr,"Unable to alloc memory to read message.\n");
-        return -1;
-    }
+    // Function to write the batched output into Stdout
 
-    if (read(session_pipe, message, MESSAGE_SIZE + UINT8_T_SIZE) <= 0) {
-        free(message);
-        return -1;
+    if (*n_iov == 0) {
+        return 0;
     }
-
-    memcpy(buffer, message + UINT8_T_SIZE, MESSAGE_SIZE);
-    free(message);
-
-    return 0;
+    int result = writev_full(STDOUT_FILENO, iov, *n_iov);
+    *n_iov = 0;
+    return result;
 }
 
 int sub_destroy(int session_pipe, char *session_pipe_name) {
@@ -93,9 +104,82 @@ int sub_destroy(int session_pipe, char *session_pipe_name) {
     return 0;
 }
 
+/*
+ * Parse where to start reading the Box: "earliest", "latest", "seq=<number>"
+ * or "time=<ns since the Epoch>".
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int parse_start(char const *start, uint8_t *start_kind,
+                uint64_t *start_value) {
+    *start_value = 0;
+    if (strcmp(start, "earliest") == 0) {
+        *start_kind = SUB_START_EARLIEST;
+        return 0;
+    }
+    if (strcmp(start, "latest") == 0) {
+        *start_kind = SUB_START_LATEST;
+        return 0;
+    }
+
+    char const *value;
+    if (strncmp(start, "seq=", 4) == 0) {
+        *start_kind = SUB_START_SEQUENCE;
+        value = start + 4;
+    } else if (strncmp(start, "time=", 5) == 0) {
+        *start_kind = SUB_START_TIMESTAMP;
+        value = start + 5;
+    } else {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+        return -1;
+    }
+    *start_value = (uint64_t)parsed;
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr,"Instead of 4 arguments, %d were passed.\n", argc);
+    if (argc < 4 || argc > 7) {
+        fprintf(stderr,"Instead of 4 to 7 arguments, %d were passed.\n", argc);
+        return -1;
+    }
+
+    // With --raw, the frames are written into Stdout as received; with
+    // --start=<start>, the Box is read from there instead of its beginning;
+    // with --cursor=<name>, the Box is read from where the last Subscriber of
+    // that name left it (or from <start>, for a new name)
+    int raw = FALSE;
+    uint8_t start_kind = SUB_START_EARLIEST;
+    uint64_t start_value = 0;
+    char const *cursor_name = NULL;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--raw") == 0) {
+            raw = TRUE;
+        } else if (strncmp(argv[i], "--cursor=", 9) == 0 &&
+                   argv[i][9] != '\0') {
+            cursor_name = argv[i] + 9;
+        } else if (strncmp(argv[i], "--start=", 8) != 0 ||
+                   parse_start(argv[i] + 8, &start_kind, &start_value) != 0) {
+            fprintf(stderr,"Unknown option %s.\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // Longer names are rejected rather than cut short (naming another Box or
+    // cursor)
+    if (strlen(argv[3]) > BOX_NAME_MAX) {
+        fprintf(stderr,"Box name %s is longer than %zu characters.\n", argv[3],
+                BOX_NAME_MAX);
+        return -1;
+    }
+    if (cursor_name != NULL && strlen(cursor_name) > CURSOR_NAME_LENGTH - 1) {
+        fprintf(stderr,"Cursor name %s is longer than %zu characters.\n",
+                cursor_name, CURSOR_NAME_LENGTH - 1);
         return -1;
     }
 
@@ -135,7 +219,8 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    if (register_sub(server_pipe, session_pipe_name, box_name) != 0) {
+    if (register_sub(server_pipe, session_pipe_name, box_name, start_kind,
+                     start_value, cursor_name) != 0) {
         fprintf(stderr,"Unable to register this Session in the Server.\n");
         close(server_pipe);
         unlink(session_pipe_name);
@@ -162,8 +247,11 @@ int main(int argc, char **argv) {
     }
 
     /*  Read messages from Session's Pipe and write them into Stdout.
-     *  Messages are received one by one with '\0' at the end with a maximum
-     *  size of 1024 bytes.
+     *  Messages are received in frames holding their length, with a maximum
+     *  size of MESSAGE_SIZE - 1 bytes.
+     *  Frames are read SUB_READ_BUFFER bytes at a time, and the messages
+     *  already read are written from the receive buffer with a single writev
+     *  before reading again (or every SUB_OUTPUT_BATCH messages).
      */
 
     if (signal(SIGINT, sigint_handler) == SIG_ERR) {
@@ -173,24 +261,65 @@ int main(int argc, char **argv) {
     }
 
     int message_counter = 0;
-    char *buffer = calloc(MESSAGE_SIZE, sizeof(char));
+    char *buffer = calloc(SUB_READ_BUFFER, sizeof(char));
     if (buffer == NULL) {
         fprintf(stderr,"Unable to alloc memory to read message.\n");
         sub_destroy(session_pipe, session_pipe_name);
         return -1;
     }
+    frame_reader_t reader;
+    frame_reader_init(&reader, session_pipe, buffer, SUB_READ_BUFFER);
+
+    // Each message is written with its '\n' (or, with --raw, as its frame)
+    struct iovec iov[2 * SUB_OUTPUT_BATCH];
+    size_t n_iov = 0;
+    int result = 0;
 
     while (running) {
-        if (read_message(session_pipe, buffer) != 0) {
+        // The messages batched point into the receive buffer: write them
+        // before it is read into again
+        if ((n_iov == 2 * SUB_OUTPUT_BATCH || !frame_reader_ready(&reader)) &&
+            write_output(iov, &n_iov) == -1) {
+            fprintf(stderr,"Unable to write messages into Stdout.\n");
+            result = -1;
+            break;
+        }
+
+        uint8_t code;
+        char *message;
+        uint32_t length;
+        int status = frame_reader_next(&reader, &code, &message, &length);
+        if (status == 0) {
+            break; // the Server ended the session
+        }
+        if (status == -1 || code != SERVER_2_SUB) {
             fprintf(stderr,"Error reading messages from box.\n");
-            free(buffer);
-            sub_destroy(session_pipe, session_pipe_name);
-            return -1;
+            result = -1;
+            break;
+        }
+
+        if (raw) {
+            iov[n_iov].iov_base = message - FRAME_HEADER_LENGTH;
+            iov[n_iov++].iov_len = FRAME_HEADER_LENGTH + length;
+        } else {
+            iov[n_iov].iov_base = message;
+            iov[n_iov++].iov_len = length;
+            iov[n_iov].iov_base = (void *)&newline;
+            iov[n_iov++].iov_len = sizeof(char);
         }
-        fprintf(stdout, "%s\n", buffer);
         message_counter++;
     }
 
+    if (result == 0 && write_output(iov, &n_iov) == -1) {
+        fprintf(stderr,"Unable to write messages into Stdout.\n");
+        result = -1;
+    }
+    if (result == -1) {
+        free(buffer);
+        sub_destroy(session_pipe, session_pipe_name);
+        return -1;
+    }
+
     fprintf(stderr, "Messages sent: %d\n", message_counter);
     free(buffer);
 
@@ -0,0 +1,165 @@
+/*
+ * Benchmark of the rate of small messages through a Pipe, for several
+ * message sizes, with
+ *   - fixed frames: the code and a whole MESSAGE_LENGTH message, whatever
+ *     its length (the format before length-prefixed frames);
+ *   - length-prefixed frames, written one at a time (frame_write);
+ *   - length-prefixed frames, batched into 64 KiB writes (as the Publisher
+ *     does), and read back by a frame_reader_t in both cases.
+ * Reports the messages per second and the MB per second of messages (not
+ * counting the frames' overhead) of each.
+ *
+ * Usage: tests/frame_bench [messages]
+ */
+#include "betterassert.h"
+#include "protocol/protocol.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MESSAGE_LENGTH (1024) // of the fixed frames
+#define FIXED_FRAME_LENGTH (sizeof(uint8_t) + MESSAGE_LENGTH)
+#define BATCH_BUFFER (64 * 1024)
+#define READ_BUFFER (64 * 1024)
+#define CODE (9)
+
+typedef enum {
+    FORMAT_FIXED,
+    FORMAT_FRAMED,
+    FORMAT_FRAMED_BATCHED,
+} format_t;
+
+typedef struct {
+    int ra_fd;
+    format_t ra_format;
+    size_t ra_messages;
+    size_t ra_length;
+} reader_args_t;
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void *read_messages(void *arg) {
+    reader_args_t const *args = arg;
+    char *buffer = malloc(READ_BUFFER);
+    ALWAYS_ASSERT(buffer != NULL, "malloc failed");
+
+    if (args->ra_format == FORMAT_FIXED) {
+        for (size_t i = 0; i < args->ra_messages; i++) {
+            ALWAYS_ASSERT(read_full(args->ra_fd, buffer, FIXED_FRAME_LENGTH) ==
+                              FIXED_FRAME_LENGTH,
+                          "unable to read message %zu", i);
+            ALWAYS_ASSERT(buffer[0] == CODE, "unexpected frame");
+        }
+    } else {
+        frame_reader_t reader;
+        frame_reader_init(&reader, args->ra_fd, buffer, READ_BUFFER);
+        for (size_t i = 0; i < args->ra_messages; i++) {
+            uint8_t code;
+            char *message;
+            uint32_t length;
+            ALWAYS_ASSERT(frame_reader_next(&reader, &code, &message,
+                                            &length) == 1,
+                          "unable to read message %zu", i);
+            ALWAYS_ASSERT(code == CODE && length == args->ra_length,
+                          "unexpected frame");
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void write_messages(int fd, format_t format, size_t messages,
+                           size_t length) {
+    char message[MESSAGE_LENGTH];
+    memset(message, 'm', length);
+
+    if (format == FORMAT_FIXED) {
+        char frame[FIXED_FRAME_LENGTH];
+        memset(frame, 0, FIXED_FRAME_LENGTH);
+        frame[0] = CODE;
+        memcpy(frame + sizeof(uint8_t), message, length);
+        for (size_t i = 0; i < messages; i++) {
+            ALWAYS_ASSERT(write_full(fd, frame, FIXED_FRAME_LENGTH) == 0,
+                          "unable to write message %zu", i);
+        }
+        return;
+    }
+
+    if (format == FORMAT_FRAMED) {
+        for (size_t i = 0; i < messages; i++) {
+            ALWAYS_ASSERT(frame_write(fd, CODE, message, (uint32_t)length) ==
+                              0,
+                          "unable to write message %zu", i);
+        }
+        return;
+    }
+
+    char *batch = malloc(BATCH_BUFFER);
+    ALWAYS_ASSERT(batch != NULL, "malloc failed");
+    size_t used = 0;
+    for (size_t i = 0; i < messages; i++) {
+        if (used + FRAME_HEADER_LENGTH + length > BATCH_BUFFER) {
+            ALWAYS_ASSERT(write_full(fd, batch, used) == 0,
+                          "unable to write message %zu", i);
+            used = 0;
+        }
+        frame_header(batch + used, CODE, (uint32_t)length);
+        memcpy(batch + used + FRAME_HEADER_LENGTH, message, length);
+        used += FRAME_HEADER_LENGTH + length;
+    }
+    ALWAYS_ASSERT(write_full(fd, batch, used) == 0, "unable to write");
+    free(batch);
+}
+
+/*
+ * Send messages of the given length through a new Pipe, in the given format.
+ *
+ * Returns the messages per second.
+ */
+static double run(format_t format, size_t messages, size_t length) {
+    int fds[2];
+    ALWAYS_ASSERT(pipe(fds) == 0, "pipe failed");
+    reader_args_t args = {.ra_fd = fds[0],
+                          .ra_format = format,
+                          .ra_messages = messages,
+                          .ra_length = length};
+    pthread_t reader;
+
+    double start = now();
+    ALWAYS_ASSERT(pthread_create(&reader, NULL, read_messages, &args) == 0,
+                  "pthread_create failed");
+    write_messages(fds[1], format, messages, length);
+    ALWAYS_ASSERT(pthread_join(reader, NULL) == 0, "pthread_join failed");
+    double elapsed = now() - start;
+
+    close(fds[0]);
+    close(fds[1]);
+    return (double)messages / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    ALWAYS_ASSERT(messages > 0, "usage: %s [messages]", argv[0]);
+
+    static const size_t lengths[] = {8, 32, 128, 512, MESSAGE_LENGTH};
+    static const char *formats[] = {"fixed", "framed", "framed, batched"};
+    printf("%8s %16s %14s %10s\n", "length", "format", "messages/s", "MB/s");
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        for (format_t format = FORMAT_FIXED; format <= FORMAT_FRAMED_BATCHED;
+             format++) {
+            double rate = run(format, messages, lengths[i]);
+            printf("%8zu %16s %14.0f %10.1f\n", lengths[i], formats[format],
+                   rate, rate * (double)lengths[i] / 1e6);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Test of the frame pools' counters (frame_pool_stats): once warmed up, the
+ * Server's patterns of use of frames allocate none from the heap.
+ *   - Sessions: threads get and release sessions, their message buffers,
+ *     answers and Box listings (of a few frames each), and keep a ring of the
+ *     latest Box messages, releasing the oldest.
+ *   - Requests: a thread gets request frames (as the one reading the Server's
+ *     Pipe) that other threads (the workers) release.
+ * Prints the counters of every kind of frame.
+ *
+ * Usage: tests/frame_pool_test [iterations]
+ */
+#include "betterassert.h"
+#include "utils/common.h"
+#include "utils/frame-pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS (4)
+#define ROUNDS (10)
+#define LISTING_FRAMES (3)
+
+static size_t iterations;
+static pthread_barrier_t barrier;
+
+static void *session(void *arg) {
+    (void)arg;
+    void *ring[BOX_RING_SIZE] = {NULL};
+    for (size_t i = 0; i < iterations; i++) {
+        void *state = frame_get(FRAME_SESSION);
+        void *buffer = frame_get(FRAME_MESSAGE);
+        void *answer = frame_get(FRAME_RESPONSE);
+        void *message = frame_get(FRAME_BOX_MESSAGE);
+        ALWAYS_ASSERT(state != NULL && buffer != NULL && answer != NULL &&
+                          message != NULL,
+                      "frame_get failed");
+        void *listing[LISTING_FRAMES];
+        for (size_t j = 0; j < LISTING_FRAMES; j++) {
+            listing[j] = frame_get(FRAME_LIST);
+            ALWAYS_ASSERT(listing[j] != NULL, "frame_get failed");
+        }
+        for (size_t j = 0; j < LISTING_FRAMES; j++) {
+            frame_put(FRAME_LIST, listing[j]);
+        }
+        void **slot = &ring[i % BOX_RING_SIZE];
+        if (*slot != NULL) {
+            frame_put(FRAME_BOX_MESSAGE, *slot);
+        }
+        *slot = message;
+        frame_put(FRAME_RESPONSE, answer);
+        frame_put(FRAME_MESSAGE, buffer);
+        frame_put(FRAME_SESSION, state);
+
+        // Every thread has held as many frames as it ever holds at once, so
+        // they were all allocated at once (while warming up), whatever the
+        // threads' interleaving
+        if (i == BOX_RING_SIZE) {
+            pthread_barrier_wait(&barrier);
+        }
+    }
+
+    for (size_t i = 0; i < BOX_RING_SIZE; i++) {
+        if (ring[i] != NULL) {
+            frame_put(FRAME_BOX_MESSAGE, ring[i]);
+        }
+    }
+    frame_cache_flush();
+    return NULL;
+}
+
+static void *release_requests(void *arg) {
+    void **requests = arg;
+    for (size_t i = 0; i < QUEUE_CAPACITY / THREADS; i++) {
+        frame_put(FRAME_REQUEST, requests[i]);
+    }
+    frame_cache_flush();
+    return NULL;
+}
+
+static void run_threads(void *(*function)(void *), void **args) {
+    pthread_t threads[THREADS];
+    for (size_t i = 0; i < THREADS; i++) {
+        ALWAYS_ASSERT(pthread_create(&threads[i], NULL, function,
+                                     args == NULL ? NULL : args[i]) == 0,
+                      "pthread_create failed");
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        ALWAYS_ASSERT(pthread_join(threads[i], NULL) == 0,
+                      "pthread_join failed");
+    }
+}
+
+static void allocated(size_t counts[FRAME_CLASSES]) {
+    for (size_t i = 0; i < FRAME_CLASSES; i++) {
+        frame_stats_t stats;
+        frame_pool_stats((frame_class_t)i, &stats);
+        counts[i] = stats.fs_allocated;
+    }
+}
+
+static void requests_round(void) {
+    void *requests[QUEUE_CAPACITY];
+    void *args[THREADS];
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        requests[i] = frame_get(FRAME_REQUEST);
+        ALWAYS_ASSERT(requests[i] != NULL, "frame_get failed");
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        args[i] = &requests[i * (QUEUE_CAPACITY / THREADS)];
+    }
+    run_threads(release_requests, args);
+}
+
+int main(int argc, char **argv) {
+    iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    ALWAYS_ASSERT(iterations > BOX_RING_SIZE, "usage: %s [iterations]",
+                  argv[0]);
+    ALWAYS_ASSERT(frame_pool_init() == 0, "frame_pool_init failed");
+    ALWAYS_ASSERT(pthread_barrier_init(&barrier, NULL, THREADS) == 0,
+                  "pthread_barrier_init failed");
+
+    // Warm up, then check nothing else is allocated
+    run_threads(session, NULL);
+    requests_round();
+    size_t before[FRAME_CLASSES];
+    allocated(before);
+
+    for (size_t i = 0; i < ROUNDS; i++) {
+        run_threads(session, NULL);
+        requests_round();
+    }
+    size_t after[FRAME_CLASSES];
+    allocated(after);
+
+    static const char *names[FRAME_CLASSES] = {
+        "request", "message", "response", "box message", "session", "list"};
+    printf("%12s %10s %10s %12s %8s\n", "frame", "allocated", "gets",
+           "cache hits", "hits %");
+    for (size_t i = 0; i < FRAME_CLASSES; i++) {
+        frame_stats_t stats;
+        frame_pool_stats((frame_class_t)i, &stats);
+        printf("%12s %10zu %10zu %12zu %8.1f\n", names[i], stats.fs_allocated,
+               stats.fs_gets, stats.fs_cache_hits,
+               100.0 * (double)stats.fs_cache_hits / (double)stats.fs_gets);
+    }
+    for (size_t i = 0; i < FRAME_CLASSES; i++) {
+        ALWAYS_ASSERT(after[i] == before[i],
+                      "%zu %s frames allocated once warmed up",
+                      after[i] - before[i], names[i]);
+    }
+
+    pthread_barrier_destroy(&barrier);
+    frame_pool_destroy();
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Benchmark of appends to a single TecnicoFS file: writes millions of small
+ * messages one after the other (so the file spans direct, indirect and double
+ * indirect blocks), reads them all back, and reports the bytes per second of
+ * both. The simulated storage latency is off, so this measures TFS itself.
+ *
+ * Usage: tests/fs_append [messages] [message_size]
+ */
+#include "betterassert.h"
+#include "fs/operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BOX_FILE "/box"
+#define READ_CHUNK (64 * 1024)
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t n_messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+    size_t message_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 24;
+    ALWAYS_ASSERT(n_messages > 0 && message_size > 0,
+                  "usage: %s [messages] [message_size]", argv[0]);
+    size_t total = n_messages * message_size;
+
+    tfs_params params = tfs_default_params();
+    for (size_t i = 0; i < TFS_DELAY_CLASSES; i++) {
+        params.delay[i] = 0;
+    }
+    // The file's blocks, those of its indirect blocks and some more
+    params.max_block_count = total / params.block_size * 102 / 100 + 64;
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed");
+
+    char *message = malloc(message_size);
+    char *chunk = malloc(READ_CHUNK);
+    ALWAYS_ASSERT(message != NULL && chunk != NULL, "malloc failed");
+
+    int fd = tfs_open(BOX_FILE, TFS_O_CREAT | TFS_O_APPEND);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    double start = now();
+    for (size_t i = 0; i < n_messages; i++) {
+        memset(message, 'a' + (int)(i % 26), message_size);
+        ALWAYS_ASSERT(tfs_write(fd, message, message_size) ==
+                          (ssize_t)message_size,
+                      "tfs_write failed at message %zu", i);
+    }
+    double written = now() - start;
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+
+    // Read back in large chunks, checking every message
+    fd = tfs_open(BOX_FILE, 0);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    size_t offset = 0;
+    start = now();
+    while (offset < total) {
+        ssize_t length = tfs_read(fd, chunk, READ_CHUNK);
+        ALWAYS_ASSERT(length > 0, "tfs_read failed at offset %zu", offset);
+        for (size_t i = 0; i < (size_t)length; i++) {
+            size_t index = (offset + i) / message_size;
+            ALWAYS_ASSERT(chunk[i] == 'a' + (int)(index % 26),
+                          "read back something else at offset %zu",
+                          offset + i);
+        }
+        offset += (size_t)length;
+    }
+    double read = now() - start;
+    ALWAYS_ASSERT(tfs_read(fd, chunk, READ_CHUNK) == 0, "file too long");
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+
+    printf("%zu messages of %zu bytes (%zu bytes)\n", n_messages,
+           message_size, total);
+    printf("append: %.3f s, %.0f messages/s, %.1f MB/s\n", written,
+           (double)n_messages / written, (double)total / written / 1e6);
+    printf("read:   %.3f s, %.1f MB/s\n", read, (double)total / read / 1e6);
+
+    free(message);
+    free(chunk);
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+    return 0;
+}
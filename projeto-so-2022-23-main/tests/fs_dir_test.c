@@ -0,0 +1,113 @@
+/*
+ * Test of directories growing on demand: a directory takes no blocks while
+ * empty and then as many files as there are inodes, across several rebuilds
+ * of its hash table, in the root directory and in a subdirectory. Files are
+ * then removed and added again, and the whole tree is checked after the store
+ * is restored (and recovered) too.
+ *
+ * Usage: tests/fs_dir_test [files]
+ */
+#include "betterassert.h"
+#include "fs/operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STORE_PATH "fs_dir_test.store"
+#define SUBDIR "/d"
+
+static size_t n_files;
+
+static void file_name(char *name, size_t size, char const *dir, size_t i) {
+    snprintf(name, size, "%s/f%zu", dir, i);
+}
+
+static void create_files(char const *dir, size_t from, size_t to) {
+    char name[64];
+    for (size_t i = from; i < to; i++) {
+        file_name(name, sizeof(name), dir, i);
+        int fd = tfs_open(name, TFS_O_CREAT | TFS_O_EXCL);
+        ALWAYS_ASSERT(fd != -1, "unable to create %s", name);
+        ALWAYS_ASSERT(tfs_write(fd, &i, sizeof(i)) == sizeof(i),
+                      "unable to write %s", name);
+        ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+    }
+}
+
+// Checks the files in [from, to) are there (if present) or not
+static void check_files(char const *dir, size_t from, size_t to,
+                        bool present) {
+    char name[64];
+    for (size_t i = from; i < to; i++) {
+        file_name(name, sizeof(name), dir, i);
+        int fd = tfs_open(name, 0);
+        if (!present) {
+            ALWAYS_ASSERT(fd == -1, "%s was not removed", name);
+            continue;
+        }
+        ALWAYS_ASSERT(fd != -1, "%s is missing", name);
+        size_t contents = 0;
+        ALWAYS_ASSERT(tfs_read(fd, &contents, sizeof(contents)) ==
+                              sizeof(contents) &&
+                          contents == i,
+                      "%s has wrong contents", name);
+        ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+    }
+}
+
+static void check_tree(void) {
+    check_files("", 0, n_files / 2, false);
+    check_files("", n_files / 2, n_files, true);
+    check_files(SUBDIR, 0, n_files, true);
+}
+
+int main(int argc, char **argv) {
+    n_files = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    ALWAYS_ASSERT(n_files > 1, "usage: %s [files]", argv[0]);
+
+    tfs_params params = tfs_default_params();
+    memset(params.delay, 0, sizeof(params.delay));
+    // The root directory, the subdirectory and the files in both
+    params.max_inode_count = 2 + 2 * n_files;
+    params.max_block_count = 8 * n_files;
+    params.store_path = STORE_PATH;
+    unlink(STORE_PATH);
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed");
+
+    ALWAYS_ASSERT(tfs_mkdir(SUBDIR) == 0, "tfs_mkdir failed");
+    create_files("", 0, n_files);
+    create_files(SUBDIR, 0, n_files);
+    check_files("", 0, n_files, true);
+    check_files(SUBDIR, 0, n_files, true);
+
+    // Every inode is taken
+    ALWAYS_ASSERT(tfs_open("/extra", TFS_O_CREAT) == -1,
+                  "a file was created beyond the inode count");
+
+    // Removed and added again, then removed for good
+    char name[64];
+    for (size_t i = 0; i < n_files / 2; i++) {
+        file_name(name, sizeof(name), "", i);
+        ALWAYS_ASSERT(tfs_unlink(name) == 0, "unable to remove %s", name);
+    }
+    check_files("", 0, n_files / 2, false);
+    create_files("", 0, n_files / 2);
+    check_files("", 0, n_files, true);
+    for (size_t i = 0; i < n_files / 2; i++) {
+        file_name(name, sizeof(name), "", i);
+        ALWAYS_ASSERT(tfs_unlink(name) == 0, "unable to remove %s", name);
+    }
+    check_tree();
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+
+    // Restored (and recovered) from the store
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed to restore");
+    check_tree();
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+
+    unlink(STORE_PATH);
+    printf("Successful test.\n");
+    return 0;
+}
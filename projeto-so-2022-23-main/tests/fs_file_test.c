@@ -0,0 +1,83 @@
+/*
+ * Test of positional reads and writes through a file (tfs_file_t), and of
+ * reads and writes through an open file's handle, once the file is deleted:
+ * they fail, whether or not its inode was reused by another file since, which
+ * is left untouched.
+ *
+ * Usage: tests/fs_file_test
+ */
+#include "betterassert.h"
+#include "fs/operations.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_NAME "/f"
+#define OTHER_NAME "/g"
+
+int main(void) {
+    tfs_params params = tfs_default_params();
+    memset(params.delay, 0, sizeof(params.delay));
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed");
+
+    char const contents[] = "contents";
+    char buffer[sizeof(contents)];
+    int fd = tfs_open(FILE_NAME, TFS_O_CREAT);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+
+    tfs_file_t file;
+    ALWAYS_ASSERT(tfs_get_file(FILE_NAME, &file) == 0, "tfs_get_file failed");
+    ALWAYS_ASSERT(tfs_get_file("/", &file) == -1,
+                  "tfs_get_file found a directory");
+    ALWAYS_ASSERT(tfs_pwrite(file, contents, sizeof(contents), 0) ==
+                      sizeof(contents),
+                  "tfs_pwrite failed");
+    ALWAYS_ASSERT(tfs_pread(file, buffer, sizeof(buffer), 0) ==
+                          sizeof(buffer) &&
+                      memcmp(buffer, contents, sizeof(contents)) == 0,
+                  "tfs_pread failed");
+
+    // Deleted
+    ALWAYS_ASSERT(tfs_unlink(FILE_NAME) == 0, "tfs_unlink failed");
+    ALWAYS_ASSERT(tfs_pread(file, buffer, sizeof(buffer), 0) == -1,
+                  "tfs_pread read a deleted file");
+    ALWAYS_ASSERT(tfs_pwrite(file, contents, sizeof(contents), 0) == -1,
+                  "tfs_pwrite wrote a deleted file");
+
+    // Deleted, and its inode reused by another file
+    fd = tfs_open(OTHER_NAME, TFS_O_CREAT);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+    tfs_file_t other;
+    ALWAYS_ASSERT(tfs_get_file(OTHER_NAME, &other) == 0,
+                  "tfs_get_file failed");
+    ALWAYS_ASSERT(other.tf_inumber == file.tf_inumber,
+                  "the inode was not reused");
+    ALWAYS_ASSERT(tfs_pwrite(file, contents, sizeof(contents), 0) == -1,
+                  "tfs_pwrite wrote into the file reusing the inode");
+    ALWAYS_ASSERT(tfs_pread(file, buffer, sizeof(buffer), 0) == -1,
+                  "tfs_pread read the file reusing the inode");
+    ALWAYS_ASSERT(tfs_pread(other, buffer, sizeof(buffer), 0) == 0,
+                  "the file reusing the inode was written");
+
+    // Deleted while open, and its inode reused by another file
+    ALWAYS_ASSERT(tfs_unlink(OTHER_NAME) == 0, "tfs_unlink failed");
+    fd = tfs_open(FILE_NAME, TFS_O_CREAT);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    ALWAYS_ASSERT(tfs_unlink(FILE_NAME) == 0, "tfs_unlink failed");
+    int other_fd = tfs_open(OTHER_NAME, TFS_O_CREAT);
+    ALWAYS_ASSERT(other_fd != -1, "tfs_open failed");
+    ALWAYS_ASSERT(tfs_write(fd, contents, sizeof(contents)) == -1,
+                  "tfs_write wrote into the file reusing the inode");
+    ALWAYS_ASSERT(tfs_read(fd, buffer, sizeof(buffer)) == -1,
+                  "tfs_read read the file reusing the inode");
+    ALWAYS_ASSERT(tfs_read(other_fd, buffer, sizeof(buffer)) == 0,
+                  "the file reusing the inode was written");
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+    ALWAYS_ASSERT(tfs_close(other_fd) == 0, "tfs_close failed");
+
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+    printf("Successful test.\n");
+    return 0;
+}
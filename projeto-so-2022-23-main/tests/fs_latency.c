@@ -0,0 +1,191 @@
+/*
+ * Harness measuring the latency of each TecnicoFS operation (open creating a
+ * file, write, read, close and unlink) under different models of the storage
+ * latency (tfs_params' delay of each class of operation):
+ *   - memory: no simulated latency;
+ *   - default: the default delay for every class;
+ *   - the delays of inodes, directory entries and data blocks given, if any.
+ * Reports percentiles and a histogram (by powers of two) of each operation.
+ *
+ * Usage: tests/fs_latency [iterations] [inode_delay dir_delay block_delay]
+ */
+#include "betterassert.h"
+#include "fs/operations.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WRITE_SIZE (256)
+#define FILES (32) // created (and unlinked) in turn
+#define BUCKETS (24) // the last one counts everything from 2^23 ns on
+
+typedef enum {
+    OP_OPEN,
+    OP_WRITE,
+    OP_READ,
+    OP_CLOSE,
+    OP_UNLINK,
+    OPS,
+} op_t;
+
+static const char *op_names[OPS] = {"open", "write", "read", "close",
+                                    "unlink"};
+
+typedef struct {
+    uint64_t *ol_samples; // in ns
+    size_t ol_count;
+} op_latencies_t;
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static void record(op_latencies_t *latencies, op_t op, uint64_t start) {
+    op_latencies_t *op_latencies = &latencies[op];
+    op_latencies->ol_samples[op_latencies->ol_count++] = now_ns() - start;
+}
+
+static int compare(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+static size_t bucket(uint64_t latency) {
+    size_t index = 0;
+    while (latency > 1 && index < BUCKETS - 1) {
+        latency >>= 1;
+        index++;
+    }
+    return index;
+}
+
+static void report(char const *model, op_latencies_t *latencies) {
+    printf("== %s\n", model);
+    printf("%8s %10s %10s %10s %10s\n", "op", "p50 ns", "p90 ns", "p99 ns",
+           "max ns");
+    size_t histogram[OPS][BUCKETS];
+    memset(histogram, 0, sizeof(histogram));
+    for (op_t op = OP_OPEN; op < OPS; op++) {
+        uint64_t *samples = latencies[op].ol_samples;
+        size_t count = latencies[op].ol_count;
+        qsort(samples, count, sizeof(uint64_t), compare);
+        printf("%8s %10lu %10lu %10lu %10lu\n", op_names[op],
+               samples[count / 2], samples[count * 9 / 10],
+               samples[count * 99 / 100], samples[count - 1]);
+        for (size_t i = 0; i < count; i++) {
+            histogram[op][bucket(samples[i])]++;
+        }
+    }
+
+    // Only the buckets from the first to the last used by any operation
+    size_t first = BUCKETS;
+    size_t last = 0;
+    for (op_t op = OP_OPEN; op < OPS; op++) {
+        for (size_t i = 0; i < BUCKETS; i++) {
+            if (histogram[op][i] > 0) {
+                first = i < first ? i : first;
+                last = i > last ? i : last;
+            }
+        }
+    }
+    printf("%10s", ">= ns");
+    for (op_t op = OP_OPEN; op < OPS; op++) {
+        printf(" %8s", op_names[op]);
+    }
+    printf("\n");
+    for (size_t i = first; i <= last; i++) {
+        printf("%10lu", (uint64_t)1 << i);
+        for (op_t op = OP_OPEN; op < OPS; op++) {
+            printf(" %8zu", histogram[op][i]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Create, write, read, close and unlink files in turn, on a TFS with the
+ * given delays, recording the latency of each operation.
+ */
+static void run(char const *model, size_t const delay[TFS_DELAY_CLASSES],
+                size_t iterations) {
+    tfs_params params = tfs_default_params();
+    memcpy(params.delay, delay, sizeof(params.delay));
+    params.max_inode_count = FILES + 1;
+    params.max_open_files_count = FILES;
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed");
+
+    op_latencies_t latencies[OPS];
+    for (op_t op = OP_OPEN; op < OPS; op++) {
+        latencies[op].ol_samples = malloc(iterations * sizeof(uint64_t));
+        ALWAYS_ASSERT(latencies[op].ol_samples != NULL, "malloc failed");
+        latencies[op].ol_count = 0;
+    }
+
+    char buffer[WRITE_SIZE];
+    memset(buffer, 'l', WRITE_SIZE);
+    for (size_t i = 0; i < iterations; i++) {
+        char name[MAX_FILE_NAME];
+        snprintf(name, sizeof(name), "/f%zu", i % FILES);
+
+        uint64_t start = now_ns();
+        int fd = tfs_open(name, TFS_O_CREAT);
+        record(latencies, OP_OPEN, start);
+        ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+
+        start = now_ns();
+        ssize_t written = tfs_write(fd, buffer, WRITE_SIZE);
+        record(latencies, OP_WRITE, start);
+        ALWAYS_ASSERT(written == WRITE_SIZE, "tfs_write failed");
+
+        tfs_file_t file;
+        ALWAYS_ASSERT(tfs_get_file(name, &file) == 0, "tfs_get_file failed");
+        start = now_ns();
+        ssize_t read = tfs_pread(file, buffer, WRITE_SIZE, 0);
+        record(latencies, OP_READ, start);
+        ALWAYS_ASSERT(read == WRITE_SIZE, "tfs_pread failed");
+
+        start = now_ns();
+        int closed = tfs_close(fd);
+        record(latencies, OP_CLOSE, start);
+        ALWAYS_ASSERT(closed == 0, "tfs_close failed");
+
+        start = now_ns();
+        int unlinked = tfs_unlink(name);
+        record(latencies, OP_UNLINK, start);
+        ALWAYS_ASSERT(unlinked == 0, "tfs_unlink failed");
+    }
+
+    report(model, latencies);
+    for (op_t op = OP_OPEN; op < OPS; op++) {
+        free(latencies[op].ol_samples);
+    }
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    ALWAYS_ASSERT(iterations > 0 && (argc == 1 || argc == 2 || argc == 5),
+                  "usage: %s [iterations] [inode_delay dir_delay "
+                  "block_delay]",
+                  argv[0]);
+
+    size_t const memory[TFS_DELAY_CLASSES] = {0};
+    run("memory", memory, iterations);
+    tfs_params defaults = tfs_default_params();
+    run("default", defaults.delay, iterations);
+
+    if (argc == 5) {
+        size_t delay[TFS_DELAY_CLASSES];
+        for (size_t i = 0; i < TFS_DELAY_CLASSES; i++) {
+            delay[i] = strtoul(argv[2 + i], NULL, 10);
+        }
+        run("given", delay, iterations);
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Stress test of TecnicoFS under concurrency: each thread writes (and reads
+ * back) records of its own file, and then every thread reads the same file,
+ * with 1, 2, 4, ... threads. Reports the operations per second of each run,
+ * which grow with the threads as far as the cores go, as files in use by
+ * different threads (and readers of the same file) do not wait for each other.
+ *
+ * Usage: tests/fs_scaling [max_threads] [ops_per_thread]
+ */
+#include "betterassert.h"
+#include "fs/operations.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RECORD_SIZE (64)
+#define FILE_RECORDS (256) // a file is truncated once it holds as many
+#define SHARED_FILE "/shared"
+
+typedef struct {
+    size_t ta_index;
+    size_t ta_ops;
+} thread_args_t;
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void *write_own_file(void *arg) {
+    thread_args_t const *args = arg;
+    char name[MAX_FILE_NAME];
+    snprintf(name, sizeof(name), "/f%zu", args->ta_index);
+
+    char record[RECORD_SIZE];
+    char read_back[RECORD_SIZE];
+    memset(record, 'a' + (int)(args->ta_index % 26), RECORD_SIZE);
+
+    int fd = tfs_open(name, TFS_O_CREAT | TFS_O_TRUNC);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    tfs_file_t file;
+    ALWAYS_ASSERT(tfs_get_file(name, &file) == 0, "tfs_get_file failed");
+
+    for (size_t i = 0; i < args->ta_ops; i++) {
+        size_t slot = i % FILE_RECORDS;
+        if (slot == 0 && i > 0) {
+            ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+            fd = tfs_open(name, TFS_O_TRUNC);
+            ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+        }
+        ALWAYS_ASSERT(tfs_write(fd, record, RECORD_SIZE) == RECORD_SIZE,
+                      "tfs_write failed");
+        ALWAYS_ASSERT(tfs_pread(file, read_back, RECORD_SIZE,
+                                slot * RECORD_SIZE) == RECORD_SIZE,
+                      "tfs_pread failed");
+        ALWAYS_ASSERT(memcmp(record, read_back, RECORD_SIZE) == 0,
+                      "read back something else");
+    }
+
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+    return NULL;
+}
+
+static void *read_shared_file(void *arg) {
+    thread_args_t const *args = arg;
+    tfs_file_t file;
+    ALWAYS_ASSERT(tfs_get_file(SHARED_FILE, &file) == 0,
+                  "tfs_get_file failed");
+
+    char record[RECORD_SIZE];
+    for (size_t i = 0; i < args->ta_ops; i++) {
+        size_t offset = ((i + args->ta_index) % FILE_RECORDS) * RECORD_SIZE;
+        ALWAYS_ASSERT(tfs_pread(file, record, RECORD_SIZE, offset) ==
+                          RECORD_SIZE,
+                      "tfs_pread failed");
+    }
+    return NULL;
+}
+
+/*
+ * Run n_threads threads of the given function on a new TFS.
+ *
+ * Returns the operations per second of all threads together.
+ */
+static double run(void *(*function)(void *), size_t n_threads, size_t ops) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = n_threads + 2;
+    params.max_block_count =
+        (n_threads + 2) * (FILE_RECORDS * RECORD_SIZE / params.block_size + 2);
+    params.max_open_files_count = n_threads + 1;
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed");
+
+    // The file every thread reads
+    char record[RECORD_SIZE];
+    memset(record, 's', RECORD_SIZE);
+    int fd = tfs_open(SHARED_FILE, TFS_O_CREAT);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+    for (size_t i = 0; i < FILE_RECORDS; i++) {
+        ALWAYS_ASSERT(tfs_write(fd, record, RECORD_SIZE) == RECORD_SIZE,
+                      "tfs_write failed");
+    }
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+
+    pthread_t threads[n_threads];
+    thread_args_t args[n_threads];
+    double start = now();
+    for (size_t i = 0; i < n_threads; i++) {
+        args[i].ta_index = i;
+        args[i].ta_ops = ops;
+        ALWAYS_ASSERT(pthread_create(&threads[i], NULL, function, &args[i]) ==
+                          0,
+                      "pthread_create failed");
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        ALWAYS_ASSERT(pthread_join(threads[i], NULL) == 0,
+                      "pthread_join failed");
+    }
+    double elapsed = now() - start;
+
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+    return (double)(n_threads * ops) / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+    size_t ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+    ALWAYS_ASSERT(max_threads > 0 && ops > 0, "usage: %s [max_threads] "
+                                              "[ops_per_thread]",
+                  argv[0]);
+
+    printf("%8s %16s %8s %16s %8s\n", "threads", "own file ops/s", "speedup",
+           "shared ops/s", "speedup");
+    double own_base = 0;
+    double shared_base = 0;
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        double own = run(write_own_file, n_threads, ops);
+        double shared = run(read_shared_file, n_threads, ops);
+        if (n_threads == 1) {
+            own_base = own;
+            shared_base = shared;
+        }
+        printf("%8zu %16.0f %8.2f %16.0f %8.2f\n", n_threads, own,
+               own / own_base, shared, shared / shared_base);
+    }
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * Benchmark of the Server with many idle Subscribers: starts mbroker, creates
+ * a Box with 1 Publisher and (by default) 100 Subscribers, and reports
+ *   - the Server's CPU usage while nothing is published (which should be
+ *     none: idle Subscribers wait for the Box to grow instead of polling it);
+ *   - the end-to-end latency of messages (published one per millisecond),
+ *     from the Publisher writing one to each Subscriber reading it, and the
+ *     CPU usage meanwhile.
+ *
+ * Run from the root of the project (or give the path of mbroker).
+ *
+ * Usage: tests/idle_subscribers [subscribers] [messages] [mbroker_path]
+ */
+#include "betterassert.h"
+#include "protocol/protocol.h"
+#include "utils/common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BOX "/idle"
+#define WORKERS "4"
+#define IDLE_SECONDS (2)
+#define RECEIVE_TIMEOUT_MS (5000)
+#define MESSAGE_INTERVAL_NS (1000 * 1000)
+#define READER_BUFFER (4096)
+
+static char dir[] = "/tmp/mbroker-idle-XXXXXX";
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static void pipe_path(char *path, char const *name) {
+    snprintf(path, PIPE_NAME_LENGTH, "%s/tmp/%s", dir, name);
+}
+
+/*
+ * CPU time used by a process so far, in seconds (from /proc/<pid>/stat).
+ */
+static double cpu_seconds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    ALWAYS_ASSERT(file != NULL, "unable to open %s", path);
+    char line[1024];
+    ALWAYS_ASSERT(fgets(line, sizeof(line), file) != NULL, "unable to read %s",
+                  path);
+    fclose(file);
+
+    // utime and stime are the 12th and 13th fields after the command's name
+    char *fields = strrchr(line, ')');
+    ALWAYS_ASSERT(fields != NULL, "unexpected %s", path);
+    unsigned long utime;
+    unsigned long stime;
+    ALWAYS_ASSERT(sscanf(fields + 2,
+                         "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                         &utime, &stime) == 2,
+                  "unexpected %s", path);
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static pid_t start_server(char const *mbroker) {
+    // It runs elsewhere, so its path must not be relative
+    char server[PATH_MAX];
+    char cwd[PATH_MAX];
+    ALWAYS_ASSERT(getcwd(cwd, sizeof(cwd)) != NULL, "getcwd failed");
+    ALWAYS_ASSERT(snprintf(server, sizeof(server), "%s/%s",
+                           mbroker[0] == '/' ? "" : cwd,
+                           mbroker) < (int)sizeof(server),
+                  "path of %s too long", mbroker);
+    ALWAYS_ASSERT(access(server, X_OK) == 0, "%s not found", mbroker);
+
+    // The Server's Pipe is in ../tmp, from where it runs
+    char path[PIPE_NAME_LENGTH];
+    snprintf(path, sizeof(path), "%s/tmp", dir);
+    ALWAYS_ASSERT(mkdir(path, 0700) == 0, "unable to create %s", path);
+    snprintf(path, sizeof(path), "%s/run", dir);
+    ALWAYS_ASSERT(mkdir(path, 0700) == 0, "unable to create %s", path);
+
+    pid_t pid = fork();
+    ALWAYS_ASSERT(pid != -1, "fork failed");
+    if (pid == 0) {
+        if (chdir(path) == 0) {
+            execl(server, server, "reg", WORKERS, (char *)NULL);
+        }
+        PANIC("unable to start %s", mbroker);
+    }
+
+    char server_pipe[PIPE_NAME_LENGTH];
+    pipe_path(server_pipe, "reg");
+    struct stat status;
+    for (int i = 0; i < 200 && stat(server_pipe, &status) != 0; i++) {
+        struct timespec delay = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+        nanosleep(&delay, NULL);
+    }
+    ALWAYS_ASSERT(stat(server_pipe, &status) == 0, "the Server did not start");
+    return pid;
+}
+
+static void send_request(void const *request, size_t length) {
+    char server_pipe[PIPE_NAME_LENGTH];
+    pipe_path(server_pipe, "reg");
+    int fd = open(server_pipe, O_WRONLY);
+    ALWAYS_ASSERT(fd != -1, "unable to open the Server's Pipe");
+    ALWAYS_ASSERT(write_full(fd, request, length) == 0,
+                  "unable to write a request");
+    close(fd);
+}
+
+/*
+ * Fill in the start of a request: its code, Session's Pipe and Box.
+ */
+static void request_init(char *request, uint8_t code, char const *pipe) {
+    memset(request, 0, MAX_REQUEST_LENGTH);
+    request[0] = (char)code;
+    memcpy(request + UINT8_T_SIZE, pipe, strlen(pipe));
+    memcpy(request + UINT8_T_SIZE + PIPE_NAME_LENGTH, BOX, strlen(BOX));
+}
+
+static void create_box(void) {
+    char pipe[PIPE_NAME_LENGTH];
+    pipe_path(pipe, "manager");
+    ALWAYS_ASSERT(mkfifo(pipe, 0600) == 0, "unable to create %s", pipe);
+
+    char request[MAX_REQUEST_LENGTH];
+    request_init(request, BOX_CREATION_R, pipe);
+    send_request(request, BOX_REQUEST_LENGTH);
+
+    char answer[TOTAL_RESPONSE_LENGTH];
+    int fd = open(pipe, O_RDONLY);
+    ALWAYS_ASSERT(fd != -1, "unable to open %s", pipe);
+    ALWAYS_ASSERT(read_full(fd, answer, TOTAL_RESPONSE_LENGTH) ==
+                      TOTAL_RESPONSE_LENGTH,
+                  "unable to read the answer");
+    int32_t code;
+    memcpy(&code, answer + UINT8_T_SIZE, sizeof(int32_t));
+    ALWAYS_ASSERT(code == BOX_SUCCESS, "unable to create the Box");
+    close(fd);
+    unlink(pipe);
+}
+
+/*
+ * Register a Subscriber reading the Box from its first message, returning
+ * the (non-blocking) read end of its Pipe.
+ */
+static int subscribe(size_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "s%zu", index);
+    char pipe[PIPE_NAME_LENGTH];
+    pipe_path(pipe, name);
+    ALWAYS_ASSERT(mkfifo(pipe, 0600) == 0, "unable to create %s", pipe);
+
+    // Opened before registering, so the Server finds its reader right away
+    int fd = open(pipe, O_RDONLY | O_NONBLOCK);
+    ALWAYS_ASSERT(fd != -1, "unable to open %s", pipe);
+
+    char request[MAX_REQUEST_LENGTH];
+    request_init(request, SUB_REGISTER, pipe);
+    request[REQUEST_LENGTH] = (char)SUB_START_EARLIEST;
+    send_request(request, SUB_REQUEST_LENGTH);
+    return fd;
+}
+
+static int publish(void) {
+    char pipe[PIPE_NAME_LENGTH];
+    pipe_path(pipe, "publisher");
+    ALWAYS_ASSERT(mkfifo(pipe, 0600) == 0, "unable to create %s", pipe);
+
+    char request[MAX_REQUEST_LENGTH];
+    request_init(request, PUB_REGISTER, pipe);
+    send_request(request, REQUEST_LENGTH);
+
+    int fd = open(pipe, O_WRONLY);
+    ALWAYS_ASSERT(fd != -1, "unable to open %s", pipe);
+    return fd;
+}
+
+/*
+ * Read the message numbered seq from every Subscriber, recording how long
+ * after sent it arrived.
+ */
+static void receive(frame_reader_t *readers, struct pollfd *fds,
+                    size_t n_subscribers, uint64_t seq, uint64_t *latencies) {
+    size_t left = n_subscribers;
+    for (size_t i = 0; i < n_subscribers; i++) {
+        fds[i].events = POLLIN;
+    }
+
+    while (left > 0) {
+        int ready = poll(fds, n_subscribers, RECEIVE_TIMEOUT_MS);
+        ALWAYS_ASSERT(ready > 0, "message %lu not received", seq);
+        uint64_t received = now_ns();
+
+        for (size_t i = 0; i < n_subscribers; i++) {
+            if (fds[i].events == 0 || fds[i].revents == 0) {
+                continue;
+            }
+            uint8_t code;
+            char *message;
+            uint32_t length;
+            int status = frame_reader_next(&readers[i], &code, &message,
+                                           &length);
+            if (status == -1 && errno == EAGAIN) {
+                continue;
+            }
+            ALWAYS_ASSERT(status == 1 && code == SERVER_2_SUB &&
+                              length == 2 * sizeof(uint64_t),
+                          "unexpected frame");
+            uint64_t sent[2];
+            memcpy(sent, message, sizeof(sent));
+            ALWAYS_ASSERT(sent[0] == seq, "message %lu instead of %lu",
+                          sent[0], seq);
+            latencies[i] = received - sent[1];
+            fds[i].events = 0;
+            left--;
+        }
+    }
+}
+
+static int compare(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    size_t n_subscribers = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    size_t n_messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+    char const *mbroker = argc > 3 ? argv[3] : "mbroker/mbroker";
+    ALWAYS_ASSERT(n_subscribers > 0 && n_messages > 0,
+                  "usage: %s [subscribers] [messages] [mbroker_path]",
+                  argv[0]);
+
+    ALWAYS_ASSERT(mkdtemp(dir) != NULL, "unable to create %s", dir);
+    pid_t server = start_server(mbroker);
+    create_box();
+
+    struct pollfd *fds = calloc(n_subscribers, sizeof(struct pollfd));
+    frame_reader_t *readers = calloc(n_subscribers, sizeof(frame_reader_t));
+    char *buffers = calloc(n_subscribers, READER_BUFFER);
+    uint64_t *latencies = calloc(n_subscribers * n_messages, sizeof(uint64_t));
+    ALWAYS_ASSERT(fds != NULL && readers != NULL && buffers != NULL &&
+                      latencies != NULL,
+                  "calloc failed");
+    for (size_t i = 0; i < n_subscribers; i++) {
+        fds[i].fd = subscribe(i);
+        frame_reader_init(&readers[i], fds[i].fd, buffers + i * READER_BUFFER,
+                          READER_BUFFER);
+    }
+    int publisher = publish();
+
+    // Idle: every Subscriber waits for the Box to grow
+    sleep(1);
+    double cpu = cpu_seconds(server);
+    uint64_t start = now_ns();
+    sleep(IDLE_SECONDS);
+    double idle_cpu = (cpu_seconds(server) - cpu) /
+                      ((double)(now_ns() - start) / 1e9) * 100.0;
+
+    // Busy: one message at a time, read by every Subscriber
+    cpu = cpu_seconds(server);
+    start = now_ns();
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = MESSAGE_INTERVAL_NS};
+    for (uint64_t seq = 0; seq < n_messages; seq++) {
+        nanosleep(&interval, NULL);
+        uint64_t message[2] = {seq, now_ns()};
+        ALWAYS_ASSERT(frame_write(publisher, PUB_2_SERVER, message,
+                                  sizeof(message)) == 0,
+                      "unable to publish");
+        receive(readers, fds, n_subscribers, seq,
+                latencies + seq * n_subscribers);
+    }
+    double busy_seconds = (double)(now_ns() - start) / 1e9;
+    double busy_cpu = (cpu_seconds(server) - cpu) / busy_seconds * 100.0;
+
+    size_t n_latencies = n_subscribers * n_messages;
+    qsort(latencies, n_latencies, sizeof(uint64_t), compare);
+    printf("%zu Subscribers, %zu messages\n", n_subscribers, n_messages);
+    printf("idle: %.1f%% CPU over %d s\n", idle_cpu, IDLE_SECONDS);
+    printf("busy: %.1f%% CPU over %.2f s\n", busy_cpu, busy_seconds);
+    printf("latency (us): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           (double)latencies[n_latencies / 2] / 1e3,
+           (double)latencies[n_latencies * 9 / 10] / 1e3,
+           (double)latencies[n_latencies * 99 / 100] / 1e3,
+           (double)latencies[n_latencies - 1] / 1e3);
+
+    // Stop the Server and remove what it and the clients left
+    close(publisher);
+    for (size_t i = 0; i < n_subscribers; i++) {
+        close(fds[i].fd);
+    }
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    char command[PATH_MAX];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    ALWAYS_ASSERT(system(command) == 0, "unable to remove %s", dir);
+
+    free(fds);
+    free(readers);
+    free(buffers);
+    free(latencies);
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Microbenchmark of handing items from producer threads to consumer threads,
+ * with 1 to 32 threads of each:
+ *   - through the producer-consumer queue (pcq_*), a bounded queue behind
+ *     mutexes and condition variables, of requests (which it copies);
+ *   - through the lock-free queue (lfq_*), a bounded ring of the same
+ *     capacity and semantics, which only locks to sleep when empty or full;
+ *   - through the scheduler (scheduler_submit), whose per-worker run queues
+ *     (with work stealing) are what mbroker hands requests and sessions over
+ *     with.
+ * Reports the items handed over per second of each.
+ *
+ * Usage: tests/queue_bench [max_threads] [items]
+ */
+#include "betterassert.h"
+#include "producer-consumer/lockfree-queue.h"
+#include "producer-consumer/producer-consumer.h"
+#include "utils/common.h"
+#include "utils/scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+    pc_queue_t *pa_queue;
+    lf_queue_t *pa_lfq;
+    scheduler_t *pa_scheduler;
+    task_t *pa_tasks; // to submit, scheduler only
+    size_t pa_items;
+} producer_args_t;
+
+static atomic_size_t consumed; // by the scheduler's tasks
+static size_t queue_items; // queue consumers stop once they took as many
+static atomic_size_t queue_taken;
+static char request[REQUEST_LENGTH];
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void *pcq_producer(void *arg) {
+    producer_args_t const *args = arg;
+    for (size_t i = 0; i < args->pa_items; i++) {
+        ALWAYS_ASSERT(pcq_enqueue(args->pa_queue, request) == 0,
+                      "pcq_enqueue failed");
+    }
+    return NULL;
+}
+
+static void *pcq_consumer(void *arg) {
+    pc_queue_t *queue = arg;
+    while (atomic_fetch_add(&queue_taken, 1) < queue_items) {
+        ALWAYS_ASSERT(pcq_dequeue(queue) != NULL, "pcq_dequeue failed");
+    }
+    return NULL;
+}
+
+static void *lfq_producer(void *arg) {
+    producer_args_t const *args = arg;
+    for (size_t i = 0; i < args->pa_items; i++) {
+        ALWAYS_ASSERT(lfq_enqueue(args->pa_lfq, request) == 0,
+                      "lfq_enqueue failed");
+    }
+    return NULL;
+}
+
+static void *lfq_consumer(void *arg) {
+    lf_queue_t *queue = arg;
+    while (atomic_fetch_add(&queue_taken, 1) < queue_items) {
+        ALWAYS_ASSERT(lfq_dequeue(queue) == request, "lfq_dequeue failed");
+    }
+    return NULL;
+}
+
+static task_status_t consume_task(task_t *task) {
+    (void)task;
+    atomic_fetch_add_explicit(&consumed, 1, memory_order_relaxed);
+    return TASK_DONE;
+}
+
+static void *scheduler_producer(void *arg) {
+    producer_args_t const *args = arg;
+    for (size_t i = 0; i < args->pa_items; i++) {
+        scheduler_submit(args->pa_scheduler, &args->pa_tasks[i]);
+    }
+    return NULL;
+}
+
+static void start_producers(pthread_t *producers, producer_args_t *args,
+                            size_t n_threads, void *(*producer)(void *)) {
+    for (size_t i = 0; i < n_threads; i++) {
+        ALWAYS_ASSERT(pthread_create(&producers[i], NULL, producer, &args[i]) ==
+                          0,
+                      "pthread_create failed");
+    }
+}
+
+static void join(pthread_t *threads, size_t n_threads) {
+    for (size_t i = 0; i < n_threads; i++) {
+        ALWAYS_ASSERT(pthread_join(threads[i], NULL) == 0,
+                      "pthread_join failed");
+    }
+}
+
+/*
+ * Hand items over through a pcq of QUEUE_CAPACITY (as the Server's requests
+ * were), from n_threads producers to as many consumers.
+ *
+ * Returns the items handed over per second.
+ */
+static double run_pcq(size_t n_threads, size_t items) {
+    pc_queue_t queue;
+    ALWAYS_ASSERT(pcq_create(&queue, QUEUE_CAPACITY) == 0,
+                  "pcq_create failed");
+    pthread_t producers[n_threads];
+    pthread_t consumers[n_threads];
+    producer_args_t args[n_threads];
+    for (size_t i = 0; i < n_threads; i++) {
+        args[i].pa_queue = &queue;
+        args[i].pa_items = items / n_threads;
+    }
+    queue_items = n_threads * (items / n_threads);
+    atomic_store(&queue_taken, 0);
+
+    double start = now();
+    for (size_t i = 0; i < n_threads; i++) {
+        ALWAYS_ASSERT(pthread_create(&consumers[i], NULL, pcq_consumer,
+                                     &queue) == 0,
+                      "pthread_create failed");
+    }
+    start_producers(producers, args, n_threads, pcq_producer);
+    join(producers, n_threads);
+    join(consumers, n_threads);
+    double elapsed = now() - start;
+
+    // The queue keeps (and frees) the copies it makes until its slots are
+    // reused, so the last ones are left
+    for (size_t i = 0; i < QUEUE_CAPACITY; i++) {
+        free(queue.pcq_buffer[i]);
+    }
+    pcq_destroy(&queue);
+    return (double)queue_items / elapsed;
+}
+
+/*
+ * Hand items over through a lock-free queue of QUEUE_CAPACITY, from n_threads
+ * producers to as many consumers.
+ *
+ * Returns the items handed over per second.
+ */
+static double run_lfq(size_t n_threads, size_t items) {
+    lf_queue_t queue;
+    ALWAYS_ASSERT(lfq_create(&queue, QUEUE_CAPACITY) == 0,
+                  "lfq_create failed");
+    pthread_t producers[n_threads];
+    pthread_t consumers[n_threads];
+    producer_args_t args[n_threads];
+    for (size_t i = 0; i < n_threads; i++) {
+        args[i].pa_lfq = &queue;
+        args[i].pa_items = items / n_threads;
+    }
+    queue_items = n_threads * (items / n_threads);
+    atomic_store(&queue_taken, 0);
+
+    double start = now();
+    for (size_t i = 0; i < n_threads; i++) {
+        ALWAYS_ASSERT(pthread_create(&consumers[i], NULL, lfq_consumer,
+                                     &queue) == 0,
+                      "pthread_create failed");
+    }
+    start_producers(producers, args, n_threads, lfq_producer);
+    join(producers, n_threads);
+    join(consumers, n_threads);
+    double elapsed = now() - start;
+
+    ALWAYS_ASSERT(lfq_destroy(&queue) == 0, "lfq_destroy failed");
+    return (double)queue_items / elapsed;
+}
+
+/*
+ * Hand items (tasks) over through a scheduler of n_threads workers, from
+ * n_threads producers.
+ *
+ * Returns the items handed over per second.
+ */
+static double run_scheduler(size_t n_threads, size_t items) {
+    size_t per_thread = items / n_threads;
+    task_t *tasks = malloc(n_threads * per_thread * sizeof(task_t));
+    ALWAYS_ASSERT(tasks != NULL, "malloc failed");
+    for (size_t i = 0; i < n_threads * per_thread; i++) {
+        scheduler_task_init(&tasks[i], consume_task);
+    }
+    scheduler_t scheduler;
+    pthread_t producers[n_threads];
+    producer_args_t args[n_threads];
+    for (size_t i = 0; i < n_threads; i++) {
+        args[i].pa_scheduler = &scheduler;
+        args[i].pa_tasks = tasks + i * per_thread;
+        args[i].pa_items = per_thread;
+    }
+    atomic_store(&consumed, 0);
+
+    double start = now();
+    ALWAYS_ASSERT(scheduler_create(&scheduler, n_threads, NULL) == 0,
+                  "scheduler_create failed");
+    start_producers(producers, args, n_threads, scheduler_producer);
+    join(producers, n_threads);
+    scheduler_destroy(&scheduler); // once every task queued is run
+    double elapsed = now() - start;
+
+    ALWAYS_ASSERT(atomic_load(&consumed) == n_threads * per_thread,
+                  "items lost");
+    free(tasks);
+    return (double)atomic_load(&consumed) / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 32;
+    size_t items = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    ALWAYS_ASSERT(max_threads > 0 && items >= max_threads,
+                  "usage: %s [max_threads] [items]", argv[0]);
+
+    printf("%8s %16s %16s %18s\n", "threads", "pcq items/s", "lfq items/s",
+           "scheduler items/s");
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        printf("%8zu %16.0f %16.0f %18.0f\n", n_threads,
+               run_pcq(n_threads, items), run_lfq(n_threads, items),
+               run_scheduler(n_threads, items));
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Benchmark of durable writes (TFS_O_DURABLE, each waiting until it is
+ * committed to the write-ahead log) against the log's commit interval
+ * (wal_commit_interval_us): threads append messages to files of their own,
+ * as the Server appends a Box's messages, so the longer the interval the
+ * more writes share each fdatasync, and the longer each waits for it.
+ * Reports the messages per second and the mean latency of a write, for each
+ * interval.
+ *
+ * Usage: tests/wal_bench [threads] [seconds] [message_size]
+ */
+#include "betterassert.h"
+#include "fs/operations.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_MESSAGE_SIZE (1024)
+
+typedef struct {
+    size_t wa_index;
+    size_t wa_size;
+    size_t wa_messages;
+} writer_args_t;
+
+static atomic_bool stopping;
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void *append_messages(void *arg) {
+    writer_args_t *args = arg;
+    char name[MAX_FILE_NAME];
+    snprintf(name, sizeof(name), "/w%zu", args->wa_index);
+    int fd = tfs_open(name, TFS_O_CREAT | TFS_O_APPEND | TFS_O_DURABLE);
+    ALWAYS_ASSERT(fd != -1, "tfs_open failed");
+
+    char message[MAX_MESSAGE_SIZE];
+    memset(message, 'w', args->wa_size);
+    while (!atomic_load(&stopping)) {
+        ALWAYS_ASSERT(tfs_write(fd, message, args->wa_size) ==
+                          (ssize_t)args->wa_size,
+                      "tfs_write failed");
+        args->wa_messages++;
+    }
+
+    ALWAYS_ASSERT(tfs_close(fd) == 0, "tfs_close failed");
+    return NULL;
+}
+
+/*
+ * Append messages from n_threads threads for the given time, on a new store
+ * and log committed every interval_us.
+ *
+ * Returns the messages per second.
+ */
+static double run(char const *dir, size_t interval_us, size_t n_threads,
+                  double seconds, size_t size) {
+    char store_path[64];
+    char wal_path[64];
+    snprintf(store_path, sizeof(store_path), "%s/store", dir);
+    snprintf(wal_path, sizeof(wal_path), "%s/wal", dir);
+
+    tfs_params params = tfs_default_params();
+    memset(params.delay, 0, sizeof(params.delay));
+    params.max_block_count = 16384; // room for the messages of a few seconds
+    params.store_path = store_path;
+    params.wal_path = wal_path;
+    params.wal_commit_interval_us = interval_us;
+    ALWAYS_ASSERT(tfs_init(&params) == 0, "tfs_init failed");
+
+    pthread_t threads[n_threads];
+    writer_args_t args[n_threads];
+    atomic_store(&stopping, false);
+    double start = now();
+    for (size_t i = 0; i < n_threads; i++) {
+        args[i] = (writer_args_t){.wa_index = i, .wa_size = size};
+        ALWAYS_ASSERT(pthread_create(&threads[i], NULL, append_messages,
+                                     &args[i]) == 0,
+                      "pthread_create failed");
+    }
+
+    struct timespec duration = {.tv_sec = (time_t)seconds,
+                                .tv_nsec = (long)((seconds - (double)(time_t)
+                                                                 seconds) *
+                                                  1e9)};
+    nanosleep(&duration, NULL);
+    atomic_store(&stopping, true);
+    size_t messages = 0;
+    for (size_t i = 0; i < n_threads; i++) {
+        ALWAYS_ASSERT(pthread_join(threads[i], NULL) == 0,
+                      "pthread_join failed");
+        messages += args[i].wa_messages;
+    }
+    double elapsed = now() - start;
+
+    ALWAYS_ASSERT(tfs_destroy() == 0, "tfs_destroy failed");
+    ALWAYS_ASSERT(unlink(store_path) == 0 && unlink(wal_path) == 0,
+                  "unable to remove the store and the log");
+    return (double)messages / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t n_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    double seconds = argc > 2 ? strtod(argv[2], NULL) : 1.0;
+    size_t size = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+    ALWAYS_ASSERT(n_threads > 0 && seconds > 0 && size > 0 &&
+                      size <= MAX_MESSAGE_SIZE,
+                  "usage: %s [threads] [seconds] [message_size]", argv[0]);
+
+    char dir[] = "/tmp/wal_bench.XXXXXX";
+    ALWAYS_ASSERT(mkdtemp(dir) != NULL, "mkdtemp failed");
+
+    static const size_t intervals_us[] = {0, 100, 500, 1000, 2000, 5000, 10000};
+    printf("%12s %14s %16s\n", "interval us", "messages/s", "mean latency us");
+    for (size_t i = 0; i < sizeof(intervals_us) / sizeof(intervals_us[0]);
+         i++) {
+        double rate = run(dir, intervals_us[i], n_threads, seconds, size);
+        printf("%12zu %14.0f %16.1f\n", intervals_us[i], rate,
+               1e6 * (double)n_threads / rate);
+    }
+
+    ALWAYS_ASSERT(rmdir(dir) == 0, "unable to remove %s", dir);
+    return 0;
+}
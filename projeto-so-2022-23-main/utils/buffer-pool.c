@@ -0,0 +1,67 @@
+#include "buffer-pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+int buffer_pool_create(buffer_pool_t *pool, size_t buffer_size,
+                       size_t prealloc) {
+    // Free buffers hold the free list's next pointer
+    pool->bp_buffer_size =
+        buffer_size < sizeof(void *) ? sizeof(void *) : buffer_size;
+    pool->bp_free = NULL;
+    atomic_init(&pool->bp_allocated, 0);
+
+    if (pthread_mutex_init(&pool->bp_lock, NULL) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < prealloc; i++) {
+        void *buffer = malloc(pool->bp_buffer_size);
+        if (buffer == NULL) {
+            buffer_pool_destroy(pool);
+            return -1;
+        }
+        atomic_fetch_add_explicit(&pool->bp_allocated, 1, memory_order_relaxed);
+        buffer_pool_put(pool, buffer);
+    }
+
+    return 0;
+}
+
+void buffer_pool_destroy(buffer_pool_t *pool) {
+    while (pool->bp_free != NULL) {
+        void *next = *(void **)pool->bp_free;
+        free(pool->bp_free);
+        pool->bp_free = next;
+    }
+    pthread_mutex_destroy(&pool->bp_lock);
+}
+
+void *buffer_pool_get(buffer_pool_t *pool) {
+    pthread_mutex_lock(&pool->bp_lock);
+    void *buffer = pool->bp_free;
+    if (buffer != NULL) {
+        pool->bp_free = *(void **)buffer;
+    }
+    pthread_mutex_unlock(&pool->bp_lock);
+
+    if (buffer == NULL) {
+        buffer = malloc(pool->bp_buffer_size);
+        if (buffer != NULL) {
+            atomic_fetch_add_explicit(&pool->bp_allocated, 1,
+                                      memory_order_relaxed);
+        }
+    }
+    return buffer;
+}
+
+void buffer_pool_put(buffer_pool_t *pool, void *buffer) {
+    pthread_mutex_lock(&pool->bp_lock);
+    *(void **)buffer = pool->bp_free;
+    pool->bp_free = buffer;
+    pthread_mutex_unlock(&pool->bp_lock);
+}
+
+size_t buffer_pool_allocated(buffer_pool_t *pool) {
+    return atomic_load_explicit(&pool->bp_allocated, memory_order_relaxed);
+}
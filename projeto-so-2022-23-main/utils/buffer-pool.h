@@ -0,0 +1,42 @@
+#ifndef __UTILS_BUFFER_POOL_H__
+#define __UTILS_BUFFER_POOL_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Pool of fixed-size buffers.
+ *
+ * Released buffers are kept in a free list (linked through their first bytes)
+ * and handed out again, so buffers of protocol frames are recycled instead of
+ * being allocated and freed for every request.
+ */
+typedef struct {
+    size_t bp_buffer_size;
+    void *bp_free;
+    pthread_mutex_t bp_lock;
+    atomic_size_t bp_allocated;
+} buffer_pool_t;
+
+// buffer_pool_create: create a pool of buffers of buffer_size bytes, with
+// prealloc buffers already available
+int buffer_pool_create(buffer_pool_t *pool, size_t buffer_size,
+                       size_t prealloc);
+
+// buffer_pool_destroy: free the buffers available in the pool
+//
+// Memory: buffers not yet released are not freed
+void buffer_pool_destroy(buffer_pool_t *pool);
+
+// buffer_pool_get: obtain a buffer from the pool (allocating it if the pool
+// is empty), or NULL if the memory could not be allocated
+void *buffer_pool_get(buffer_pool_t *pool);
+
+// buffer_pool_put: release a buffer back into the pool
+void buffer_pool_put(buffer_pool_t *pool, void *buffer);
+
+// buffer_pool_allocated: number of buffers the pool has allocated so far
+size_t buffer_pool_allocated(buffer_pool_t *pool);
+
+#endif // __UTILS_BUFFER_POOL_H__
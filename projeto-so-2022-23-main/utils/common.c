@@ -1,58 +1,431 @@
 #include "../utils/common.h"
+#include "../utils/frame-pool.h"
 #include "../utils/logging.h"
 #include "string.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-struct Box *getBox(struct Box *head, char *box_name) {
-    struct Box *current = head;
+/*
+ * Length of a request sent to the Server's Pipe, given its code.
+ *
+ * Returns 0 for an unknown code.
+ */
+size_t request_length(uint8_t op_code) {
+    if (op_code == PUB_REGISTER || op_code == BOX_REMOVAL_R) {
+        return REQUEST_LENGTH;
+    }
+    if (op_code == BOX_CREATION_R) {
+        return BOX_REQUEST_LENGTH;
+    }
+    if (op_code == SUB_REGISTER) {
+        return SUB_REQUEST_LENGTH;
+    }
+    if (op_code == LIST_BOX_R) {
+        return LIST_REQUEST;
+    }
+    return 0;
+}
+
+/*
+ * Obtain an empty Box message, holding a single reference.
+ *
+ * Returns NULL if the memory could not be allocated.
+ */
+box_message_t *box_message_get(void) {
+    box_message_t *message = frame_get(FRAME_BOX_MESSAGE);
+    if (message == NULL) {
+        return NULL;
+    }
+    atomic_init(&message->bm_refs, 1);
+    message->bm_offset = 0;
+    message->bm_length = 0;
+    return message;
+}
+
+void box_message_put(box_message_t *message) {
+    if (atomic_fetch_sub_explicit(&message->bm_refs, 1, memory_order_acq_rel) ==
+        1) {
+        frame_put(FRAME_BOX_MESSAGE, message);
+    }
+}
+
+/*
+ * Publish a message into the Box's ring, taking over the caller's reference
+ * (and dropping the ring's reference to the oldest message, if full).
+ *
+ * The caller must hold box_lock.
+ */
+void box_ring_push(struct Box *box, box_message_t *message) {
+    box_message_t **slot = &box->box_ring[box->box_ring_next % BOX_RING_SIZE];
+    if (*slot != NULL) {
+        box_message_put(*slot);
+    }
+    *slot = message;
+    box->box_ring_next++;
+}
+
+/*
+ * Take up to max consecutive messages of the ring, starting with the one at
+ * the given offset of the Box (the ones following it may be in the next
+ * segment).
+ *
+ * *seq is a hint of the number of that message (the value left by the previous
+ * call), which is looked up in the ring when wrong; on return it is the number
+ * of the message following the ones taken.
+ *
+ * The caller must hold box_lock, and release each message taken.
+ *
+ * Returns the number of messages taken: 0 if the message at offset is no longer
+ * (or not) in the ring.
+ */
+size_t box_ring_take(struct Box *box, uint64_t *seq, uint64_t offset,
+                     box_message_t **messages, size_t max) {
+    uint64_t next = box->box_ring_next;
+    uint64_t oldest = next - box->box_ring_first > BOX_RING_SIZE
+                          ? next - BOX_RING_SIZE
+                          : box->box_ring_first;
+
+    uint64_t current = *seq;
+    if (current < oldest || current >= next ||
+        box->box_ring[current % BOX_RING_SIZE]->bm_offset != offset) {
+        for (current = oldest; current < next; current++) {
+            if (box->box_ring[current % BOX_RING_SIZE]->bm_offset == offset) {
+                break;
+            }
+        }
+    }
+
+    if (current == next) {
+        *seq = current;
+        return 0; // a message missing from the ring
+    }
+
+    size_t count = 0;
+    while (count < max && current < next) {
+        box_message_t *message = box->box_ring[current % BOX_RING_SIZE];
+        atomic_fetch_add_explicit(&message->bm_refs, 1, memory_order_relaxed);
+        messages[count++] = message;
+        current++;
+    }
+
+    *seq = current;
+    return count;
+}
+
+/*
+ * Look up a segment of a Box.
+ *
+ * The caller must hold box_lock.
+ *
+ * Returns the segment, or NULL if the Box does not (or no longer) retain it.
+ */
+box_segment_t *box_segment_get(struct Box *box, uint64_t number) {
+    if (number < box->box_segment_first ||
+        number - box->box_segment_first >= box->box_segment_count) {
+        return NULL;
+    }
+    return &box->box_segments[number % box->box_segments_capacity];
+}
+
+// The segment being written (the caller must hold box_lock)
+box_segment_t *box_segment_last(struct Box *box) {
+    return box_segment_get(box, box->box_segment_first +
+                                    box->box_segment_count - 1);
+}
 
+/*
+ * Add a segment (numbered after the Box's last one) to a Box, counting its
+ * records in box_size and box_end.
+ *
+ * The caller must hold box_lock (unless the Box is not in a table yet).
+ *
+ * Returns 0 if successful, -1 if the memory could not be allocated.
+ */
+int box_segment_push(struct Box *box, box_segment_t const *segment) {
+    if (box->box_segment_count == box->box_segments_capacity) {
+        size_t capacity = box->box_segments_capacity == 0
+                              ? 8
+                              : 2 * box->box_segments_capacity;
+        box_segment_t *grown = malloc(capacity * sizeof(box_segment_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < box->box_segment_count; i++) {
+            uint64_t number = box->box_segment_first + i;
+            grown[number % capacity] =
+                box->box_segments[number % box->box_segments_capacity];
+        }
+        free(box->box_segments);
+        box->box_segments = grown;
+        box->box_segments_capacity = capacity;
+    }
+
+    if (box->box_segment_count == 0) {
+        box->box_segment_first = segment->bs_number;
+    }
+    box->box_segments[segment->bs_number % box->box_segments_capacity] =
+        *segment;
+    box->box_segment_count++;
+    box->box_size += segment->bs_used;
+    box->box_end = segment->bs_number * BOX_SEGMENT_SIZE +
+                   BOX_SEGMENT_HEADER_LENGTH + segment->bs_used;
+    return 0;
+}
+
+/*
+ * Drop the oldest segment of a Box (which must have more than one).
+ *
+ * The caller must hold box_lock.
+ */
+void box_segment_pop(struct Box *box) {
+    box->box_size -= box->box_segments[box->box_segment_first %
+                                       box->box_segments_capacity]
+                         .bs_used;
+    box->box_segment_first++;
+    box->box_segment_count--;
+}
+
+/*
+ * Add a waiter to a Box, unless already waiting.
+ *
+ * The caller must hold box_lock.
+ */
+void box_wait(struct Box *box, box_waiter_t *waiter) {
+    if (waiter->bw_waiting) {
+        return;
+    }
+    waiter->bw_waiting = TRUE;
+    waiter->bw_next = box->box_waiters;
+    box->box_waiters = waiter;
+}
+
+/*
+ * Remove a waiter from a Box, if waiting.
+ *
+ * The caller must hold box_lock.
+ */
+void box_unwait(struct Box *box, box_waiter_t *waiter) {
+    if (!waiter->bw_waiting) {
+        return;
+    }
+    box_waiter_t **link = &box->box_waiters;
+    while (*link != waiter) {
+        link = &(*link)->bw_next;
+    }
+    *link = waiter->bw_next;
+    waiter->bw_waiting = FALSE;
+}
+
+/*
+ * Wake (and remove) every waiter of a Box.
+ *
+ * The caller must hold box_lock, so a waiter that left the Box (with
+ * box_unwait) is never woken afterwards.
+ */
+void box_wake_all(struct Box *box) {
+    box_waiter_t *waiter = box->box_waiters;
+    box->box_waiters = NULL;
+    while (waiter != NULL) {
+        box_waiter_t *next = waiter->bw_next;
+        waiter->bw_waiting = FALSE;
+        waiter->bw_wake(waiter->bw_arg);
+        waiter = next;
+    }
+}
+
+static void box_free(struct Box *box) {
+    for (size_t i = 0; i < BOX_RING_SIZE; i++) {
+        if (box->box_ring[i] != NULL) {
+            box_message_put(box->box_ring[i]);
+        }
+    }
+    pthread_mutex_destroy(&box->box_lock);
+    free(box->box_segments);
+    free(box);
+}
+
+static size_t box_hash(char const *box_name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < BOX_NAME_LENGTH && box_name[i] != '\0'; i++) {
+        hash ^= (uint8_t)box_name[i];
+        hash *= 16777619u;
+    }
+    return hash % BOX_TABLE_BUCKETS;
+}
+
+int box_table_create(box_table_t *table) {
+    for (size_t i = 0; i < BOX_TABLE_BUCKETS; i++) {
+        table->bt_buckets[i] = NULL;
+        if (pthread_rwlock_init(&table->bt_locks[i], NULL) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void box_table_destroy(box_table_t *table) {
+    for (size_t i = 0; i < BOX_TABLE_BUCKETS; i++) {
+        struct Box *current = table->bt_buckets[i];
+        while (current != NULL) {
+            struct Box *next = current->next;
+            box_free(current);
+            current = next;
+        }
+        table->bt_buckets[i] = NULL;
+        pthread_rwlock_destroy(&table->bt_locks[i]);
+    }
+}
+
+struct Box *getBox(box_table_t *table, char *box_name) {
+    size_t bucket = box_hash(box_name);
+
+    pthread_rwlock_rdlock(&table->bt_locks[bucket]);
+    struct Box *current = table->bt_buckets[bucket];
     while (current != NULL) {
-        if (current->box_name == box_name)
-            return current;
+        if (strncmp(current->box_name, box_name, BOX_NAME_LENGTH) == 0) {
+            pthread_mutex_lock(&current->box_lock);
+            current->refs++;
+            pthread_mutex_unlock(&current->box_lock);
+            break;
+        }
 
         current = current->next;
     }
-    return NULL;
+    pthread_rwlock_unlock(&table->bt_locks[bucket]);
+
+    return current;
 }
 
-int insertBox(struct Box *head, char *box_name, uint64_t box_size) {
-    struct Box *new_node = (struct Box *)malloc(sizeof(struct Box));
+void putBox(struct Box *box) {
+    pthread_mutex_lock(&box->box_lock);
+    uint64_t refs = --box->refs;
+    pthread_mutex_unlock(&box->box_lock);
+
+    if (refs == 0) {
+        box_free(box);
+    }
+}
+
+int insertBox(box_table_t *table, char *box_name, uint64_t box_records,
+              tfs_file_t box_index, box_retention_t const *retention,
+              box_segment_t const *segments, size_t count) {
+    struct Box *new_node = (struct Box *)calloc(1, sizeof(struct Box));
     if (new_node == NULL) {
         fprintf(stderr,"Unable to alloc memory to create Box.\n");
         return -1;
     }
 
-    strcpy(new_node->box_name, box_name);
-    new_node->box_size = box_size;
+    strncpy(new_node->box_name, box_name, BOX_NAME_LENGTH - 1);
+    new_node->box_ring_first = box_records;
+    new_node->box_ring_next = box_records;
+    new_node->box_index = box_index;
+    new_node->box_retention = *retention;
+    for (size_t i = 0; i < count; i++) {
+        if (box_segment_push(new_node, &segments[i]) != 0) {
+            fprintf(stderr,"Unable to alloc memory to create Box.\n");
+            free(new_node->box_segments);
+            free(new_node);
+            return -1;
+        }
+    }
     new_node->n_publishers = 0;
     new_node->n_subscribers = 0;
     new_node->last = 1;
-    new_node->next = NULL;
-
-    if (head == NULL) {
-        head = new_node;
-        return 0;
+    // The table's own reference
+    new_node->refs = 1;
+    new_node->removed = FALSE;
+    if (pthread_mutex_init(&new_node->box_lock, NULL) != 0) {
+        free(new_node->box_segments);
+        free(new_node);
+        return -1;
     }
+    new_node->box_waiters = NULL;
 
-    struct Box *current = head;
+    size_t bucket = box_hash(box_name);
 
-    while (current->next != NULL) {
-        if (current->box_name == box_name) {
+    pthread_rwlock_wrlock(&table->bt_locks[bucket]);
+    for (struct Box *current = table->bt_buckets[bucket]; current != NULL;
+         current = current->next) {
+        if (strncmp(current->box_name, box_name, BOX_NAME_LENGTH) == 0) {
+            pthread_rwlock_unlock(&table->bt_locks[bucket]);
+            pthread_mutex_destroy(&new_node->box_lock);
+            free(new_node->box_segments);
             free(new_node);
             return -1;
         }
+    }
 
-        current = current->next;
+    new_node->next = table->bt_buckets[bucket];
+    table->bt_buckets[bucket] = new_node;
+    pthread_rwlock_unlock(&table->bt_locks[bucket]);
+
+    return 0;
+}
+
+int deleteBox(box_table_t *table, char *box_name) {
+    size_t bucket = box_hash(box_name);
+
+    pthread_rwlock_wrlock(&table->bt_locks[bucket]);
+    struct Box *curr = table->bt_buckets[bucket];
+    struct Box *prev = NULL;
+    while (curr != NULL &&
+           strncmp(curr->box_name, box_name, BOX_NAME_LENGTH) != 0) {
+        prev = curr;
+        curr = curr->next;
     }
 
-    current->last = 0;
-    current->next = new_node;
+    if (curr == NULL) {
+        pthread_rwlock_unlock(&table->bt_locks[bucket]);
+        return -1;
+    }
+
+    if (prev != NULL) {
+        prev->next = curr->next;
+    } else {
+        table->bt_buckets[bucket] = curr->next;
+    }
+    pthread_rwlock_unlock(&table->bt_locks[bucket]);
+
+    // Wake up its Subscribers, so they end their sessions
+    pthread_mutex_lock(&curr->box_lock);
+    curr->removed = TRUE;
+    curr->next = NULL;
+    box_wake_all(curr);
+    pthread_mutex_unlock(&curr->box_lock);
+
+    // Drop the table's reference
+    putBox(curr);
+    return 0;
+}
 
+/*
+ * Visit every Box in the table, in no particular order: visit is called with
+ * the Box's box_lock held (and must not take the table's locks), until it
+ * returns -1.
+ *
+ * Returns 0 if every Box was visited, -1 otherwise.
+ */
+int box_table_visit(box_table_t *table,
+                    int (*visit)(struct Box *box, void *arg), void *arg) {
+    for (size_t i = 0; i < BOX_TABLE_BUCKETS; i++) {
+        pthread_rwlock_rdlock(&table->bt_locks[i]);
+        for (struct Box *current = table->bt_buckets[i]; current != NULL;
+             current = current->next) {
+            pthread_mutex_lock(&current->box_lock);
+            int result = visit(current, arg);
+            pthread_mutex_unlock(&current->box_lock);
+            if (result == -1) {
+                pthread_rwlock_unlock(&table->bt_locks[i]);
+                return -1;
+            }
+        }
+        pthread_rwlock_unlock(&table->bt_locks[i]);
+    }
     return 0;
 }
 
-int insertionSort(struct Box *head, char *box_name, uint64_t box_size,
+int insertionSort(struct Box **head, char *box_name, uint64_t box_size,
                   uint64_t n_publishers, uint64_t n_subscribers) {
     struct Box *new_node = (struct Box *)malloc(sizeof(struct Box));
     if (new_node == NULL) {
@@ -67,11 +440,11 @@ int insertionSort(struct Box *head, char *box_name, uint64_t box_size,
     new_node->next = NULL;
     new_node->last = 0;
 
-    if (head == NULL || strcmp(box_name, head->box_name) < 0) {
-        new_node->next = head;
-        head = new_node;
+    if (*head == NULL || strcmp(box_name, (*head)->box_name) < 0) {
+        new_node->next = *head;
+        *head = new_node;
     } else {
-        struct Box *current = head;
+        struct Box *current = *head;
         while (current->next != NULL &&
                strcmp(box_name, current->next->box_name) > 0) {
             current = current->next;
@@ -83,30 +456,6 @@ int insertionSort(struct Box *head, char *box_name, uint64_t box_size,
     return 0;
 }
 
-int deleteBox(struct Box *head, char *box_name) {
-    struct Box *curr = head;
-    struct Box *prev = NULL;
-    // FIXME devia ser strcmp(curr->box_name, box_name) != 0
-    while (curr != NULL && strcmp(curr->box_name, box_name) != 0) {
-        prev = curr;
-        curr = curr->next;
-    }
-
-    if (curr != NULL) {
-        if (prev != NULL)
-            prev->next = curr->next;
-
-        else {
-            head = curr->next;
-        }
-
-        free(curr);
-        return 0;
-    }
-
-    return -1;
-}
-
 void box_to_string(struct Box *box, char *buffer) {
     memcpy(buffer, &box->last, UINT8_T_SIZE);
     buffer += UINT8_T_SIZE;
@@ -129,8 +478,9 @@ void box_to_string(struct Box *box, char *buffer) {
 void destroy_list(struct Box *head) {
     struct Box *current = head;
     while (current != NULL) {
-        current = current->next;
+        struct Box *next = current->next;
         free(current);
+        current = next;
     }
 }
 
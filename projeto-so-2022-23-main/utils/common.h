@@ -3,21 +3,57 @@
 
 #include "../fs/operations.h"
 #include "../producer-consumer/producer-consumer.h"
+#include "../protocol/protocol.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 #define PIPE_NAME_LENGTH (256 * sizeof(char))
 #define BOX_NAME_LENGTH (32 * sizeof(char))
+// Longest Box name a client takes (sent after a '/', and with its '\0')
+#define BOX_NAME_MAX (BOX_NAME_LENGTH - 2)
 #define UINT8_T_SIZE (sizeof(uint8_t))
 #define REQUEST_LENGTH (PIPE_NAME_LENGTH + BOX_NAME_LENGTH + UINT8_T_SIZE)
+#define CURSOR_NAME_LENGTH (32 * sizeof(char))
+// A Subscriber's request ends with where it starts: the kind of start
+// (SUB_START_*), its sequence number or timestamp and the name of its cursor
+// (empty for none)
+#define SUB_REQUEST_LENGTH                                                     \
+    (REQUEST_LENGTH + UINT8_T_SIZE + sizeof(uint64_t) + CURSOR_NAME_LENGTH)
+// A Box creation request ends with the Box's retention (box_retention_t)
+#define BOX_REQUEST_LENGTH (REQUEST_LENGTH + 3 * sizeof(uint64_t))
+#define MAX_REQUEST_LENGTH (SUB_REQUEST_LENGTH) // the longest of them
+// A request read from the Server's Pipe, with the state of its handling
+#define REQUEST_FRAME_SIZE (MAX_REQUEST_LENGTH + 128)
 #define TOTAL_RESPONSE_LENGTH (1029)
 #define ERROR_MESSAGE_SIZE (1024)
 #define TRUE (1)
 #define FALSE (0)
 #define LIST_REQUEST (257)
 #define LIST_RESPONSE (58)
+// The Box listing is sent from a chain of frames of LIST_FRAME_ENTRIES entries
+// (with their bookkeeping) each
+#define LIST_FRAME_ENTRIES (64)
+#define LIST_FRAME_SIZE (LIST_FRAME_ENTRIES * LIST_RESPONSE + 64)
 #define QUEUE_CAPACITY (200)
-#define MESSAGE_SIZE (1024)
+#define MESSAGE_SIZE (8 * 1024) // longest message, '\0' included
+#define SESSION_BUFFER_SIZE (16 * 1024) // holds a frame or a record, at least
+// A Publisher's or Subscriber's session, with the state of its handling
+#define SESSION_FRAME_SIZE (4 * 1024)
+#define BOX_TABLE_BUCKETS (1024)
+#define REGISTER_BUFFER_SIZE (64 * REQUEST_LENGTH)
+#define REQUEST_BATCH (64) // requests submitted to the scheduler at once
+#define BOX_RING_SIZE (64)
+#define SUB_RING_BATCH (16)
+#define PUB_COMMIT_BATCH (32)
+#define SESSION_ROUNDS (16) // rounds of work per run of a session
+// Delays between attempts at opening a client's Session's Pipe (in ms), and
+// how long the client has to open it
+#define PIPE_OPEN_MIN_DELAY_MS (1)
+#define PIPE_OPEN_MAX_DELAY_MS (64)
+#define PIPE_OPEN_TIMEOUT_MS (10 * 1000)
+#define SUB_CURSOR_BATCH (64) // messages delivered per save of a cursor
+#define BOX_SEGMENT_SIZE (64 * 1024) // a segment's header and records, less
 
 static const uint8_t PUB_REGISTER = 1;
 static const uint8_t SUB_REGISTER = 2;
@@ -33,14 +69,93 @@ static const int32_t BOX_SUCCESS = 0;
 static const int32_t BOX_ERROR = -1;
 static const uint8_t LAST_BOX = 1;
 static const char PIPE_PATH[] = "../tmp/";
+static const uint8_t SUB_START_EARLIEST = 0; // the first message of the Box
+static const uint8_t SUB_START_LATEST = 1;   // messages published from now on
+static const uint8_t SUB_START_SEQUENCE = 2; // the message of a given number
+static const uint8_t SUB_START_TIMESTAMP = 3; // the first published since
+// Boxes' names may not hold it: it marks the TFS files kept along the Boxes
+static const char BOX_FILE_MARK = '#';
 
-
-// FIXME faltave lock para a linked list
 typedef struct {
     int session_pipe;
     char box_name[BOX_NAME_LENGTH];
+    uint8_t start_kind;   // Subscribers only
+    uint64_t start_value; // Subscribers only
+    char cursor_name[CURSOR_NAME_LENGTH]; // Subscribers only
 } Client_Info;
 
+/*
+ * Header of a record in a Box's file, followed by its payload (the message,
+ * which may hold any bytes). Records are stored back to back, so a record can
+ * be skipped (or a batch of them parsed) from the headers alone.
+ */
+typedef struct {
+    uint32_t br_length;    // of the payload, at most MESSAGE_SIZE - 1
+    uint32_t br_reserved;  // 0
+    uint64_t br_seq;       // number of the record in the Box, from 0
+    uint64_t br_timestamp; // when it was published, in ns since the Epoch
+} box_record_t;
+
+#define BOX_RECORD_HEADER_LENGTH (sizeof(box_record_t))
+
+/*
+ * Limits of what a Box retains (0 for no limit). Once exceeded, the oldest
+ * segments of the Box are dropped, whole, but never the one being written.
+ */
+typedef struct {
+    uint64_t br_max_bytes;   // of records
+    uint64_t br_max_records;
+    uint64_t br_max_age;     // of records, in seconds
+} box_retention_t;
+
+/*
+ * A segment of a Box: the TFS file holding the Box's records from offset
+ * bs_number * BOX_SEGMENT_SIZE (of the Box) on, after the segment's header,
+ * up to bs_used bytes later. Records never span segments, so offsets of a Box
+ * skip the headers and what is left unused at the end of each segment.
+ */
+typedef struct {
+    uint64_t bs_number;
+    uint64_t bs_used;       // bytes of whole records
+    uint64_t bs_first_seq;  // of its first record (even if not written yet)
+    uint64_t bs_created;    // when started, in ns since the Epoch
+} box_segment_t;
+
+// Header of a segment's file, followed by its records
+typedef struct {
+    uint64_t bsh_first_seq;
+    uint64_t bsh_created;
+} box_segment_header_t;
+
+#define BOX_SEGMENT_HEADER_LENGTH (sizeof(box_segment_header_t))
+
+/*
+ * A message published into a Box, kept in memory for its Subscribers.
+ *
+ * bm_record is the header of its record in the Box's file and bm_frame holds
+ * the frame sent to Subscribers, so the message itself (the record's payload)
+ * starts at bm_frame + FRAME_HEADER_LENGTH. Once published a message is never
+ * modified; it is reference counted and released with box_message_put.
+ */
+typedef struct {
+    atomic_uint bm_refs;
+    uint64_t bm_offset; // offset of the record in the Box
+    size_t bm_length;   // length of the record, header included
+    box_record_t bm_record;
+    char bm_frame[FRAME_HEADER_LENGTH + MESSAGE_SIZE];
+} box_message_t;
+
+/*
+ * A session waiting for a Box to grow (or be removed), woken (once) by calling
+ * bw_wake(bw_arg).
+ */
+typedef struct box_waiter {
+    struct box_waiter *bw_next;
+    uint8_t bw_waiting; // whether it is in a Box's list of waiters
+    void (*bw_wake)(void *arg);
+    void *bw_arg;
+} box_waiter_t;
+
 struct Box {
     char box_name[BOX_NAME_LENGTH];
     uint64_t box_size;
@@ -48,21 +163,96 @@ struct Box {
     uint8_t last;
     uint64_t n_subscribers;
     struct Box *next;
+
+    // Server side only: box_lock protects the fields above (except next, which
+    // is protected by the bucket lock of the box table) and the fields below.
+    // The waiters are woken whenever box_end grows or the Box is removed.
+    pthread_mutex_t box_lock;
+    box_waiter_t *box_waiters;
+    uint64_t refs;
+    uint8_t removed;
+
+    // Ring of the latest messages published, numbered by the sequence numbers
+    // of their records: message seq is in box_ring[seq % BOX_RING_SIZE] while
+    // box_ring_next - BOX_RING_SIZE <= seq < box_ring_next (and seq is at
+    // least box_ring_first, the first published since the Box was inserted).
+    // box_ring_next is also the sequence number of the Box's next record.
+    box_message_t *box_ring[BOX_RING_SIZE];
+    uint64_t box_ring_first;
+    uint64_t box_ring_next;
+
+    // The Box's index (see box-index.h)
+    tfs_file_t box_index;
+
+    // Segments retained, oldest first, numbered from box_segment_first: the
+    // last one is being written. Segment n is in
+    // box_segments[n % box_segments_capacity]. box_size counts the bytes of
+    // their records and box_end is the offset of the end of the last one.
+    box_segment_t *box_segments;
+    size_t box_segments_capacity;
+    uint64_t box_segment_first;
+    uint64_t box_segment_count;
+    uint64_t box_end;
+    box_retention_t box_retention;
 };
 
+/*
+ * Concurrent hash table of Boxes, keyed by box name.
+ *
+ * Each bucket is a linked list (through struct Box's next) protected by its own
+ * reader-writer lock. Boxes are reference counted: getBox takes a reference
+ * that must be released with putBox, so a Box removed from the table stays
+ * valid until every session using it is done.
+ */
 typedef struct {
-    pc_queue_t *queue;
-    struct Box *head;
-} thread_args;
+    struct Box *bt_buckets[BOX_TABLE_BUCKETS];
+    pthread_rwlock_t bt_locks[BOX_TABLE_BUCKETS];
+} box_table_t;
 
-struct Box *getBox(struct Box *head, char *box_name);
+size_t request_length(uint8_t op_code);
 
-int insertBox(struct Box *head, char *box_name, uint64_t box_size);
+box_message_t *box_message_get(void);
 
-int insertionSort(struct Box *head, char *box_name, uint64_t box_size,
-                  uint64_t n_publishers, uint64_t n_subscribers);
+void box_message_put(box_message_t *message);
+
+void box_ring_push(struct Box *box, box_message_t *message);
+
+size_t box_ring_take(struct Box *box, uint64_t *seq, uint64_t offset,
+                     box_message_t **messages, size_t max);
+
+box_segment_t *box_segment_get(struct Box *box, uint64_t number);
+
+box_segment_t *box_segment_last(struct Box *box);
+
+int box_segment_push(struct Box *box, box_segment_t const *segment);
+
+void box_segment_pop(struct Box *box);
+
+void box_wait(struct Box *box, box_waiter_t *waiter);
+
+void box_unwait(struct Box *box, box_waiter_t *waiter);
 
-int deleteBox(struct Box *head, char *box_name);
+void box_wake_all(struct Box *box);
+
+int box_table_create(box_table_t *table);
+
+void box_table_destroy(box_table_t *table);
+
+struct Box *getBox(box_table_t *table, char *box_name);
+
+void putBox(struct Box *box);
+
+int insertBox(box_table_t *table, char *box_name, uint64_t box_records,
+              tfs_file_t box_index, box_retention_t const *retention,
+              box_segment_t const *segments, size_t count);
+
+int deleteBox(box_table_t *table, char *box_name);
+
+int box_table_visit(box_table_t *table,
+                    int (*visit)(struct Box *box, void *arg), void *arg);
+
+int insertionSort(struct Box **head, char *box_name, uint64_t box_size,
+                  uint64_t n_publishers, uint64_t n_subscribers);
 
 void box_to_string(struct Box *box, char *buffer);
 
@@ -0,0 +1,105 @@
+#include "frame-pool.h"
+#include "buffer-pool.h"
+#include "common.h"
+#include <stdatomic.h>
+
+typedef struct {
+    void *fc_free;
+    size_t fc_count;
+} frame_cache_t;
+
+static const size_t frame_sizes[FRAME_CLASSES] = {
+    [FRAME_REQUEST] = REQUEST_FRAME_SIZE,
+    [FRAME_MESSAGE] = SESSION_BUFFER_SIZE,
+    [FRAME_RESPONSE] = TOTAL_RESPONSE_LENGTH,
+    [FRAME_BOX_MESSAGE] = sizeof(box_message_t),
+    [FRAME_SESSION] = SESSION_FRAME_SIZE,
+    [FRAME_LIST] = LIST_FRAME_SIZE,
+};
+
+// Frames allocated up front for each kind
+static const size_t frame_prealloc[FRAME_CLASSES] = {
+    [FRAME_REQUEST] = QUEUE_CAPACITY,
+    [FRAME_MESSAGE] = 0,
+    [FRAME_RESPONSE] = 0,
+    [FRAME_BOX_MESSAGE] = 0,
+    [FRAME_SESSION] = 0,
+    [FRAME_LIST] = 0,
+};
+
+static buffer_pool_t frame_pools[FRAME_CLASSES];
+static atomic_size_t frame_gets[FRAME_CLASSES];
+static atomic_size_t frame_cache_hits[FRAME_CLASSES];
+
+static _Thread_local frame_cache_t frame_caches[FRAME_CLASSES];
+
+int frame_pool_init(void) {
+    for (size_t i = 0; i < FRAME_CLASSES; i++) {
+        if (buffer_pool_create(&frame_pools[i], frame_sizes[i],
+                               frame_prealloc[i]) != 0) {
+            for (size_t j = 0; j < i; j++) {
+                buffer_pool_destroy(&frame_pools[j]);
+            }
+            return -1;
+        }
+        atomic_init(&frame_gets[i], 0);
+        atomic_init(&frame_cache_hits[i], 0);
+    }
+    return 0;
+}
+
+void frame_pool_destroy(void) {
+    frame_cache_flush();
+    for (size_t i = 0; i < FRAME_CLASSES; i++) {
+        buffer_pool_destroy(&frame_pools[i]);
+    }
+}
+
+void *frame_get(frame_class_t frame_class) {
+    atomic_fetch_add_explicit(&frame_gets[frame_class], 1,
+                              memory_order_relaxed);
+
+    frame_cache_t *cache = &frame_caches[frame_class];
+    if (cache->fc_free != NULL) {
+        void *frame = cache->fc_free;
+        cache->fc_free = *(void **)frame;
+        cache->fc_count--;
+        atomic_fetch_add_explicit(&frame_cache_hits[frame_class], 1,
+                                  memory_order_relaxed);
+        return frame;
+    }
+
+    return buffer_pool_get(&frame_pools[frame_class]);
+}
+
+void frame_put(frame_class_t frame_class, void *frame) {
+    frame_cache_t *cache = &frame_caches[frame_class];
+    if (cache->fc_count >= FRAME_CACHE_SIZE) {
+        buffer_pool_put(&frame_pools[frame_class], frame);
+        return;
+    }
+
+    *(void **)frame = cache->fc_free;
+    cache->fc_free = frame;
+    cache->fc_count++;
+}
+
+void frame_cache_flush(void) {
+    for (size_t i = 0; i < FRAME_CLASSES; i++) {
+        frame_cache_t *cache = &frame_caches[i];
+        while (cache->fc_free != NULL) {
+            void *frame = cache->fc_free;
+            cache->fc_free = *(void **)frame;
+            buffer_pool_put(&frame_pools[i], frame);
+        }
+        cache->fc_count = 0;
+    }
+}
+
+void frame_pool_stats(frame_class_t frame_class, frame_stats_t *stats) {
+    stats->fs_allocated = buffer_pool_allocated(&frame_pools[frame_class]);
+    stats->fs_gets =
+        atomic_load_explicit(&frame_gets[frame_class], memory_order_relaxed);
+    stats->fs_cache_hits = atomic_load_explicit(&frame_cache_hits[frame_class],
+                                                memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+#ifndef __UTILS_FRAME_POOL_H__
+#define __UTILS_FRAME_POOL_H__
+
+#include <stddef.h>
+
+/*
+ * Buffers for the fixed-size protocol frames exchanged by the Server.
+ *
+ * There is one shared buffer pool per kind of frame. On top of it, each thread
+ * keeps a small cache of released frames of every kind, so a session reusing
+ * its frames touches neither the heap nor the pool's lock. A thread's cache
+ * holds at most FRAME_CACHE_SIZE frames of each kind; further frames go back
+ * to the shared pool (where, e.g., request buffers released by the workers are
+ * picked up again by the thread reading the Server's Pipe).
+ */
+typedef enum {
+    FRAME_REQUEST = 0,     // requests read from the Server's Pipe (and their
+                           // handling's state)
+    FRAME_MESSAGE = 1,     // buffers of the Publisher and Subscriber sessions
+    FRAME_RESPONSE = 2,    // answers to Box creation and removal
+    FRAME_BOX_MESSAGE = 3, // messages kept in the rings of the Boxes
+    FRAME_SESSION = 4,     // Publisher and Subscriber sessions
+    FRAME_LIST = 5,        // entries of the Box listing
+    FRAME_CLASSES = 6,
+} frame_class_t;
+
+#define FRAME_CACHE_SIZE (8)
+
+typedef struct {
+    size_t fs_allocated;  // frames allocated from the heap
+    size_t fs_gets;       // calls to frame_get
+    size_t fs_cache_hits; // calls served by the calling thread's cache
+} frame_stats_t;
+
+// frame_pool_init: create the shared pools
+int frame_pool_init(void);
+
+// frame_pool_destroy: free the frames in the shared pools
+//
+// Memory: frames in use or in the cache of a live thread are not freed
+void frame_pool_destroy(void);
+
+// frame_get: obtain a (not zeroed) frame of the given kind, or NULL if the
+// memory could not be allocated
+void *frame_get(frame_class_t frame_class);
+
+// frame_put: release a frame obtained with frame_get for the same kind
+void frame_put(frame_class_t frame_class, void *frame);
+
+// frame_cache_flush: return the frames cached by the calling thread to the
+// shared pools; must be called before a thread using frames exits
+void frame_cache_flush(void);
+
+// frame_pool_stats: fill stats with the counters of the given kind of frame
+void frame_pool_stats(frame_class_t frame_class, frame_stats_t *stats);
+
+#endif // __UTILS_FRAME_POOL_H__
@@ -0,0 +1,425 @@
+#include "scheduler.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCHEDULER_EVENTS (64)
+
+// Scheduling states of a task
+enum {
+    TASK_IDLE = 0, // parked
+    TASK_QUEUED,   // in a run queue
+    TASK_RUNNING,  // being run by a worker
+    TASK_NOTIFIED, // being run, and woken meanwhile
+};
+
+// The worker the calling thread is, if any
+static _Thread_local scheduler_t *current_scheduler = NULL;
+static _Thread_local size_t current_worker = 0;
+
+/*
+ * Append count tasks, already linked through t_next from head to tail, under
+ * a single acquisition of the queue's lock.
+ */
+static void run_queue_push(run_queue_t *queue, task_t *head, task_t *tail,
+                           size_t count) {
+    tail->t_next = NULL;
+    pthread_mutex_lock(&queue->rq_lock);
+    if (queue->rq_tail == NULL) {
+        queue->rq_head = head;
+    } else {
+        queue->rq_tail->t_next = head;
+    }
+    queue->rq_tail = tail;
+    atomic_fetch_add(&queue->rq_length, count);
+    pthread_mutex_unlock(&queue->rq_lock);
+}
+
+static task_t *run_queue_pop(run_queue_t *queue) {
+    if (atomic_load_explicit(&queue->rq_length, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue->rq_lock);
+    task_t *task = queue->rq_head;
+    if (task != NULL) {
+        queue->rq_head = task->t_next;
+        if (queue->rq_head == NULL) {
+            queue->rq_tail = NULL;
+        }
+        atomic_fetch_sub(&queue->rq_length, 1);
+    }
+    pthread_mutex_unlock(&queue->rq_lock);
+    return task;
+}
+
+/*
+ * Queue count tasks, linked from head to tail: in the calling worker's own
+ * queue, or (from other threads) in every worker's queue in turn. Wakes up a
+ * sleeping worker, if any (or all of them, for more than one task, so the
+ * others steal from that queue).
+ */
+static void scheduler_queue_list(scheduler_t *scheduler, task_t *head,
+                                 task_t *tail, size_t count) {
+    size_t index = current_scheduler == scheduler
+                       ? current_worker
+                       : atomic_fetch_add_explicit(&scheduler->s_next, 1,
+                                                   memory_order_relaxed) %
+                             scheduler->s_n_workers;
+    run_queue_push(&scheduler->s_queues[index], head, tail, count);
+
+    // Pairs with the check of the queues by workers going to sleep
+    if (atomic_load(&scheduler->s_idle) > 0) {
+        pthread_mutex_lock(&scheduler->s_idle_lock);
+        if (count > 1) {
+            pthread_cond_broadcast(&scheduler->s_idle_cond);
+        } else {
+            pthread_cond_signal(&scheduler->s_idle_cond);
+        }
+        pthread_mutex_unlock(&scheduler->s_idle_lock);
+    }
+}
+
+static void scheduler_queue(scheduler_t *scheduler, task_t *task) {
+    scheduler_queue_list(scheduler, task, task, 1);
+}
+
+static bool scheduler_has_work(scheduler_t *scheduler) {
+    for (size_t i = 0; i < scheduler->s_n_workers; i++) {
+        if (atomic_load(&scheduler->s_queues[i].rq_length) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Obtain the next task for a worker: from its own queue or else stolen from
+ * another worker's, sleeping while there are none.
+ *
+ * Returns NULL once the scheduler is stopping and every queue is empty.
+ */
+static task_t *scheduler_next(scheduler_t *scheduler, size_t index) {
+    while (true) {
+        for (size_t i = 0; i < scheduler->s_n_workers; i++) {
+            size_t victim = (index + i) % scheduler->s_n_workers;
+            task_t *task = run_queue_pop(&scheduler->s_queues[victim]);
+            if (task != NULL) {
+                return task;
+            }
+        }
+
+        pthread_mutex_lock(&scheduler->s_idle_lock);
+        atomic_fetch_add(&scheduler->s_idle, 1);
+        bool has_work = scheduler_has_work(scheduler);
+        if (!has_work && atomic_load(&scheduler->s_stopping)) {
+            atomic_fetch_sub(&scheduler->s_idle, 1);
+            pthread_mutex_unlock(&scheduler->s_idle_lock);
+            return NULL;
+        }
+        if (!has_work) {
+            pthread_cond_wait(&scheduler->s_idle_cond,
+                              &scheduler->s_idle_lock);
+        }
+        atomic_fetch_sub(&scheduler->s_idle, 1);
+        pthread_mutex_unlock(&scheduler->s_idle_lock);
+    }
+}
+
+static void task_execute(scheduler_t *scheduler, task_t *task) {
+    atomic_store(&task->t_state, TASK_RUNNING);
+    task_status_t status = task->t_run(task);
+    if (status == TASK_DONE) {
+        return;
+    }
+
+    // Park the task, unless it yields or was woken while running
+    int expected = TASK_RUNNING;
+    if (status == TASK_WAIT &&
+        atomic_compare_exchange_strong(&task->t_state, &expected, TASK_IDLE)) {
+        return;
+    }
+    atomic_store(&task->t_state, TASK_QUEUED);
+    scheduler_queue(scheduler, task);
+}
+
+typedef struct {
+    scheduler_t *wa_scheduler;
+    size_t wa_index;
+} worker_args_t;
+
+static void *scheduler_worker(void *arg) {
+    worker_args_t args = *(worker_args_t *)arg;
+    free(arg);
+    scheduler_t *scheduler = args.wa_scheduler;
+
+    current_scheduler = scheduler;
+    current_worker = args.wa_index;
+
+    task_t *task;
+    while ((task = scheduler_next(scheduler, args.wa_index)) != NULL) {
+        task_execute(scheduler, task);
+    }
+
+    if (scheduler->s_worker_exit != NULL) {
+        scheduler->s_worker_exit();
+    }
+    return NULL;
+}
+
+static uint64_t scheduler_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000u + (uint64_t)now.tv_nsec / 1000000u;
+}
+
+/*
+ * Wake up the tasks whose deadline passed.
+ *
+ * Returns how long the poller may wait for the next deadline (in ms, -1 for
+ * as long as it takes).
+ */
+static int scheduler_timers_expire(scheduler_t *scheduler) {
+    uint64_t now = scheduler_now_ms();
+
+    pthread_mutex_lock(&scheduler->s_timer_lock);
+    task_t *expired = NULL;
+    task_t **last = &expired;
+    while (scheduler->s_timers != NULL &&
+           scheduler->s_timers->t_deadline <= now) {
+        *last = scheduler->s_timers;
+        last = &(*last)->t_timer_next;
+        scheduler->s_timers = *last;
+    }
+    *last = NULL;
+    int timeout = -1;
+    if (scheduler->s_timers != NULL) {
+        uint64_t left = scheduler->s_timers->t_deadline - now;
+        timeout = left < INT_MAX ? (int)left : INT_MAX;
+    }
+    pthread_mutex_unlock(&scheduler->s_timer_lock);
+
+    while (expired != NULL) {
+        task_t *next = expired->t_timer_next;
+        scheduler_wake(scheduler, expired);
+        expired = next;
+    }
+    return timeout;
+}
+
+static void *scheduler_poller(void *arg) {
+    scheduler_t *scheduler = arg;
+    struct epoll_event events[SCHEDULER_EVENTS];
+
+    while (true) {
+        int timeout = scheduler_timers_expire(scheduler);
+        int count =
+            epoll_wait(scheduler->s_epoll, events, SCHEDULER_EVENTS, timeout);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                return NULL; // the wakeup pipe: stopping
+            }
+            if (events[i].data.ptr != &scheduler->s_timers) {
+                scheduler_wake(scheduler, events[i].data.ptr);
+                continue;
+            }
+
+            // An earlier deadline, found on the next round (the eventfd is
+            // only read to clear it)
+            uint64_t value;
+            if (read(scheduler->s_timer_event, &value, sizeof(value)) == -1 &&
+                errno != EAGAIN) {
+                return NULL;
+            }
+        }
+    }
+}
+
+int scheduler_create(scheduler_t *scheduler, size_t n_workers,
+                     void (*worker_exit)(void)) {
+    scheduler->s_n_workers = n_workers == 0 ? 1 : n_workers;
+    scheduler->s_worker_exit = worker_exit;
+    atomic_init(&scheduler->s_idle, 0);
+    atomic_init(&scheduler->s_next, 0);
+    atomic_init(&scheduler->s_stopping, 0);
+
+    scheduler->s_queues = calloc(scheduler->s_n_workers, sizeof(run_queue_t));
+    scheduler->s_workers = calloc(scheduler->s_n_workers, sizeof(pthread_t));
+    if (scheduler->s_queues == NULL || scheduler->s_workers == NULL) {
+        free(scheduler->s_queues);
+        free(scheduler->s_workers);
+        return -1;
+    }
+    for (size_t i = 0; i < scheduler->s_n_workers; i++) {
+        pthread_mutex_init(&scheduler->s_queues[i].rq_lock, NULL);
+        atomic_init(&scheduler->s_queues[i].rq_length, 0);
+    }
+    pthread_mutex_init(&scheduler->s_idle_lock, NULL);
+    pthread_cond_init(&scheduler->s_idle_cond, NULL);
+    pthread_mutex_init(&scheduler->s_timer_lock, NULL);
+    scheduler->s_timers = NULL;
+
+    // The poller waits on the descriptors watched, on the wakeup pipe and on
+    // the timers' eventfd, up to the next deadline
+    scheduler->s_epoll = epoll_create1(0);
+    scheduler->s_timer_event = eventfd(0, EFD_NONBLOCK);
+    if (scheduler->s_epoll == -1 || scheduler->s_timer_event == -1 ||
+        pipe(scheduler->s_wakeup) != 0) {
+        return -1;
+    }
+    struct epoll_event wakeup = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event timer = {.events = EPOLLIN,
+                                .data.ptr = &scheduler->s_timers};
+    if (epoll_ctl(scheduler->s_epoll, EPOLL_CTL_ADD, scheduler->s_wakeup[0],
+                  &wakeup) != 0 ||
+        epoll_ctl(scheduler->s_epoll, EPOLL_CTL_ADD, scheduler->s_timer_event,
+                  &timer) != 0 ||
+        pthread_create(&scheduler->s_poller, NULL, scheduler_poller,
+                       scheduler) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < scheduler->s_n_workers; i++) {
+        worker_args_t *args = malloc(sizeof(worker_args_t));
+        if (args == NULL) {
+            return -1;
+        }
+        args->wa_scheduler = scheduler;
+        args->wa_index = i;
+        if (pthread_create(&scheduler->s_workers[i], NULL, scheduler_worker,
+                           args) != 0) {
+            free(args);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void scheduler_destroy(scheduler_t *scheduler) {
+    char stop = 0;
+    if (write(scheduler->s_wakeup[1], &stop, sizeof(char)) == 1) {
+        pthread_join(scheduler->s_poller, NULL);
+    }
+
+    pthread_mutex_lock(&scheduler->s_idle_lock);
+    atomic_store(&scheduler->s_stopping, 1);
+    pthread_cond_broadcast(&scheduler->s_idle_cond);
+    pthread_mutex_unlock(&scheduler->s_idle_lock);
+    for (size_t i = 0; i < scheduler->s_n_workers; i++) {
+        pthread_join(scheduler->s_workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < scheduler->s_n_workers; i++) {
+        pthread_mutex_destroy(&scheduler->s_queues[i].rq_lock);
+    }
+    pthread_mutex_destroy(&scheduler->s_idle_lock);
+    pthread_cond_destroy(&scheduler->s_idle_cond);
+    pthread_mutex_destroy(&scheduler->s_timer_lock);
+    close(scheduler->s_wakeup[0]);
+    close(scheduler->s_wakeup[1]);
+    close(scheduler->s_timer_event);
+    close(scheduler->s_epoll);
+    free(scheduler->s_queues);
+    free(scheduler->s_workers);
+}
+
+void scheduler_task_init(task_t *task, task_status_t (*run)(task_t *task)) {
+    task->t_run = run;
+    task->t_next = NULL;
+    atomic_init(&task->t_state, TASK_IDLE);
+    task->t_timer_next = NULL;
+    task->t_deadline = 0;
+}
+
+void scheduler_submit(scheduler_t *scheduler, task_t *task) {
+    atomic_store(&task->t_state, TASK_QUEUED);
+    scheduler_queue(scheduler, task);
+}
+
+void scheduler_submit_batch(scheduler_t *scheduler, task_t **tasks,
+                            size_t count) {
+    if (count == 0) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        atomic_store(&tasks[i]->t_state, TASK_QUEUED);
+        if (i + 1 < count) {
+            tasks[i]->t_next = tasks[i + 1];
+        }
+    }
+    scheduler_queue_list(scheduler, tasks[0], tasks[count - 1], count);
+}
+
+void scheduler_wake(scheduler_t *scheduler, task_t *task) {
+    int state = atomic_load(&task->t_state);
+    while (true) {
+        if (state == TASK_IDLE) {
+            if (atomic_compare_exchange_weak(&task->t_state, &state,
+                                             TASK_QUEUED)) {
+                scheduler_queue(scheduler, task);
+                return;
+            }
+        } else if (state == TASK_RUNNING) {
+            if (atomic_compare_exchange_weak(&task->t_state, &state,
+                                             TASK_NOTIFIED)) {
+                return;
+            }
+        } else {
+            return; // already going to run
+        }
+    }
+}
+
+int scheduler_watch(scheduler_t *scheduler, task_t *task, int fd,
+                    uint32_t events) {
+    // One-shot, so the task is woken once per wait
+    struct epoll_event event = {.events = events | EPOLLONESHOT,
+                                .data.ptr = task};
+    if (epoll_ctl(scheduler->s_epoll, EPOLL_CTL_MOD, fd, &event) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+    return epoll_ctl(scheduler->s_epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+void scheduler_sleep(scheduler_t *scheduler, task_t *task, uint64_t delay_ms) {
+    task->t_deadline = scheduler_now_ms() + delay_ms;
+
+    // Timers are kept sorted: only a handful of tasks sleep at once
+    pthread_mutex_lock(&scheduler->s_timer_lock);
+    task_t **next = &scheduler->s_timers;
+    while (*next != NULL && (*next)->t_deadline <= task->t_deadline) {
+        next = &(*next)->t_timer_next;
+    }
+    task->t_timer_next = *next;
+    *next = task;
+    bool earliest = scheduler->s_timers == task;
+    pthread_mutex_unlock(&scheduler->s_timer_lock);
+
+    if (earliest) {
+        uint64_t one = 1;
+        if (write(scheduler->s_timer_event, &one, sizeof(one)) == -1) {
+            return; // the counter is already set: the poller is waking up
+        }
+    }
+}
+
+void scheduler_unwatch(scheduler_t *scheduler, int fd) {
+    struct epoll_event event = {0};
+    epoll_ctl(scheduler->s_epoll, EPOLL_CTL_DEL, fd, &event);
+}
@@ -0,0 +1,109 @@
+#ifndef __UTILS_SCHEDULER_H__
+#define __UTILS_SCHEDULER_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Event-driven scheduler of tasks (e.g., sessions) over a fixed pool of
+ * worker threads.
+ *
+ * A task runs until it has to wait, and is then parked until woken: by a
+ * file descriptor becoming ready (scheduler_watch, through epoll), by a timer
+ * expiring (scheduler_sleep) or by another thread (scheduler_wake). Each
+ * worker has its own run queue, where the tasks it wakes and yields go; a
+ * worker with an empty queue steals from the others before going to sleep.
+ *
+ * A task is run by a single worker at a time. Waking a task while it runs
+ * makes it run again once it is done, so no wake up is ever lost.
+ */
+
+typedef enum {
+    TASK_WAIT,  // parked until woken
+    TASK_YIELD, // run again, after the other tasks queued
+    TASK_DONE,  // finished: the task is not touched again (and may be freed)
+} task_status_t;
+
+typedef struct task {
+    task_status_t (*t_run)(struct task *task);
+    struct task *t_next; // in a run queue
+    atomic_int t_state;  // scheduling state (private to the scheduler)
+
+    // Timer, while sleeping (private to the scheduler)
+    struct task *t_timer_next;
+    uint64_t t_deadline; // in ms of CLOCK_MONOTONIC
+} task_t;
+
+typedef struct {
+    pthread_mutex_t rq_lock;
+    task_t *rq_head;
+    task_t *rq_tail;
+    atomic_size_t rq_length;
+} run_queue_t;
+
+typedef struct {
+    size_t s_n_workers;
+    run_queue_t *s_queues;
+    pthread_t *s_workers;
+    void (*s_worker_exit)(void);
+
+    int s_epoll;
+    int s_wakeup[2]; // wakes up the poller, to stop it
+    pthread_t s_poller;
+
+    // Tasks sleeping, by deadline, woken by the poller once it passes
+    pthread_mutex_t s_timer_lock;
+    task_t *s_timers;
+    int s_timer_event; // eventfd waking up the poller for an earlier deadline
+
+    pthread_mutex_t s_idle_lock;
+    pthread_cond_t s_idle_cond;
+    atomic_size_t s_idle;  // workers asleep (or about to)
+    atomic_size_t s_next;  // queue for tasks queued from other threads
+    atomic_int s_stopping;
+} scheduler_t;
+
+// scheduler_create: start n_workers workers (at least one) and the poller;
+// worker_exit, if not NULL, is called by every worker before it exits
+int scheduler_create(scheduler_t *scheduler, size_t n_workers,
+                     void (*worker_exit)(void));
+
+// scheduler_destroy: stop the workers (once the tasks queued are run) and the
+// poller
+//
+// Memory: parked tasks are not freed
+void scheduler_destroy(scheduler_t *scheduler);
+
+// scheduler_task_init: prepare a task, to run with the given function
+void scheduler_task_init(task_t *task, task_status_t (*run)(task_t *task));
+
+// scheduler_submit: queue a task that is not parked nor queued (e.g., new)
+void scheduler_submit(scheduler_t *scheduler, task_t *task);
+
+// scheduler_submit_batch: queue count tasks that are not parked nor queued,
+// in order, taking a run queue's lock (and waking up idle workers) only once
+void scheduler_submit_batch(scheduler_t *scheduler, task_t **tasks,
+                            size_t count);
+
+// scheduler_wake: queue a parked task (or have it run again, if running)
+void scheduler_wake(scheduler_t *scheduler, task_t *task);
+
+// scheduler_watch: wake task once fd is ready for events (EPOLLIN or
+// EPOLLOUT); must be called by the task itself, right before it waits, or for
+// a task not yet submitted (which then first runs once fd is ready)
+//
+// Returns 0 if successful, -1 otherwise
+int scheduler_watch(scheduler_t *scheduler, task_t *task, int fd,
+                    uint32_t events);
+
+// scheduler_sleep: wake task once delay_ms milliseconds have passed; must be
+// called by the task itself, right before it waits (and the task must not be
+// woken otherwise meanwhile)
+void scheduler_sleep(scheduler_t *scheduler, task_t *task, uint64_t delay_ms);
+
+// scheduler_unwatch: stop watching fd (before closing it)
+void scheduler_unwatch(scheduler_t *scheduler, int fd);
+
+#endif // __UTILS_SCHEDULER_H__